@@ -3,9 +3,37 @@
 echo "Building..."
 cd ./src/
 
-g++ -Wall Log.cpp I2c.cpp PwmServoDriver.cpp Main.cpp -lm -o pwm
+LOG_SOURCES="FlightRecorder.cpp Log.cpp LogArchive.cpp LogBinary.cpp LogFile.cpp LogHandle.cpp LogRateLimiter.cpp LogRing.cpp LogSink.cpp LogStream.cpp Metrics.cpp PendingMessages.cpp Profile.cpp Scheduler.cpp StackTrace.cpp"
+# PROFILE="-DPROFILE_ENABLED=1" builds pwm with the PROFILE_SCOPE()
+# timers; 'kill -USR2 <pid>' then logs the table (see src/Profile.h).
+PROFILE=""
+
+g++ -Wall $PROFILE $LOG_SOURCES BatteryChecker.cpp Diagnostics.cpp I2c.cpp PwmServoDriver.cpp SharedMemory.cpp SysfsAttribute.cpp Wire.cpp Main.cpp -rdynamic -pthread -lrt -ldl -lm -lz -o pwm
+
+# Same flags as pwm, its own ring and log file (see tools/logbench.cpp):
+g++ -Wall -DLOGFILE_NAME='"/tmp/logbench.log"' -DLOG_RING_SHM_NAME='"/logbench_ring"' ../tools/logbench.cpp $LOG_SOURCES -rdynamic -pthread -lrt -ldl -lm -lz -o ../tools/logbench
 
 cd ..
 cp ./src/pwm ./
 
 echo "Created 'pwm'"
+
+# Device-side tools:
+g++ -Wall ./tools/logtail.cpp -o ./tools/logtail
+echo "Created 'tools/logtail'"
+g++ -Wall ./tools/batterysim.cpp -o ./tools/batterysim
+echo "Created 'tools/batterysim'"
+g++ -Wall ./tools/pwmstat.cpp ./src/SharedMemory.cpp -lrt -o ./tools/pwmstat
+echo "Created 'tools/pwmstat'"
+echo "Created 'tools/logbench'"
+
+# Host-side tools:
+echo "Building tools..."
+g++ -Wall ./tools/logdecode.cpp -o ./tools/logdecode
+echo "Created 'tools/logdecode'"
+g++ -Wall ./tools/logquery.cpp -lz -o ./tools/logquery
+./tools/logquery -t || echo "*** tools/logquery -t: LogIndex can't parse log lines"
+echo "Created 'tools/logquery'"
+# raw/twi.c against a model of the AVR's TWI unit (see tools/twisim.cpp):
+g++ -Wall -I./tools/avrshim ./tools/twisim.cpp -o ./tools/twisim
+echo "Created 'tools/twisim'"
@@ -0,0 +1,498 @@
+// BatteryChecker.cpp
+// This used to be done in Diagnostics but we need a way to power down
+// the unit when battery low, so BatterChecker thread is run by UntetheredOpManager
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <linux/gpio.h>
+#include <linux/netlink.h>
+
+#include "BatteryChecker.h"
+#include "BatterySim.h"
+#include "Metrics.h"
+#include "Scheduler.h"
+#include "SharedMemory.h"
+
+static MetricGauge capacity("battery_capacity_percent", "Battery capacity, %");
+static MetricGauge pollInterval("battery_poll_interval_ms", "Time between battery polls");
+static MetricCounter sharedStuck("battery_shared_stuck_total",
+	"Battery records not published, SharedData record held by a stuck writer");
+
+static string simDirFromEnv(void)
+{
+	const char *sim = getenv(BATTERY_SIM_DIR_ENV);
+	return sim != nullptr ? sim : "";
+}
+
+BatteryChecker::BatteryChecker(I2cBus& bus)
+	: m_i2c(bus), m_simDir(simDirFromEnv()),
+	m_capacity(m_simDir.empty() ? string(BATTERY_CAPACITY_FILE)
+		: m_simDir + "/" BATTERY_SIM_CAPACITY),
+	m_simCharger(m_simDir + "/" BATTERY_SIM_CHARGER),
+	m_task(0), m_ueventTask(0), m_alertTask(0),
+	m_ueventFd(-1), m_alertFd(-1), m_interval(BatteryCheckInterval),
+	m_checks(0),
+	m_running(false),
+	m_voltageStatus(VoltageStatus::BATTERY_VOLTAGE_FAULT),
+	m_chargingStatus(ChargingStatus::NOT_CHARGING),
+	m_capacityPercent(0)
+{
+}
+
+BatteryChecker::~BatteryChecker()
+{
+	Stop();
+}
+
+void BatteryChecker::Start(void)
+{
+	lock_guard<mutex> lock(m_mutex);
+	if (m_running)
+	{
+		return;
+	}
+	// _stopChecking() stops the checks but can't clear the ids or
+	// close the fds (it runs on the scheduler thread, without
+	// m_mutex): finish that stop first.
+	_stop();
+	m_log->LogInfo(IsSimulated() ? "Starting BatteryChecker (simulated)..."
+		: "Starting BatteryChecker...");
+	// First reading right away, as the thread used to.
+	bool changed;
+	if (!_check(changed))
+	{
+		return;
+	}
+	m_ueventFd = _openUevents();
+	m_alertFd = _openAlertGpio();
+	m_interval = BatteryCheckInterval;
+	// Before any callback can run, so one that stops the checks
+	// leaves it false.
+	m_running = true;
+	Scheduler& scheduler = Scheduler::GetInstance();
+	m_task = scheduler.Add("BatteryChecker", m_interval,
+		BatteryCheckJitter, [this]() { _poll(); });
+	if (m_task == 0)
+	{
+		m_log->LogErr(AT, "BatteryChecker: Can't schedule the checks.");
+		m_running = false;
+		_stop();  // Closes the fds, or every retry leaks a pair.
+		return;
+	}
+	if (m_ueventFd >= 0)
+	{
+		m_ueventTask = scheduler.AddFd("BatteryChecker uevents", m_ueventFd,
+			[this]() { _onUevents(); });
+	}
+	if (m_alertFd >= 0)
+	{
+		m_alertTask = scheduler.AddFd("BatteryChecker alert", m_alertFd,
+			[this]() { _onAlert(); });
+	}
+	// Maybe near the threshold already.
+	_adapt(true);
+}
+
+void BatteryChecker::Stop(void)
+{
+	lock_guard<mutex> lock(m_mutex);
+	_stop();
+}
+
+// Under m_mutex. Also after _stopChecking(), which left the ids and
+// fds.
+void BatteryChecker::_stop(void)
+{
+	// Each waits for a check in progress.
+	for (atomic<int> *task : { &m_task, &m_ueventTask, &m_alertTask })
+	{
+		if (*task != 0)
+		{
+			Scheduler::GetInstance().Remove(*task);
+			*task = 0;
+		}
+	}
+	for (int *fd : { &m_ueventFd, &m_alertFd })
+	{
+		if (*fd >= 0)
+		{
+			close(*fd);
+			*fd = -1;
+		}
+	}
+	if (m_running)
+	{
+		m_log->LogInfo("Stopping BatteryChecker...");
+	}
+	m_running = false;
+}
+
+// For NanoPi NEO platform, we read:
+// 1.
+//  /sys/class/power_supply/battery/capacity to get 0-100% (integer)
+//     -- gives capacity remaining in the battery
+// 2.
+//  /sys/class/power_supply/battery/voltage_now, similar to the original method.
+//     -- gives the battery's voltage (16-bit number)
+//    Take the number from #2, say 43536 / 12800 = battery voltage:
+//                         43536
+//                         -----  = 3.4V
+//                         12800
+// 1. and 2. are provided by a MAX17043 chip (which is I2C, but we have a
+//   handy driver that reads these values for us).
+// By reading simply the 'Capacity' we get 0-100.
+// Zero means no remaining capacity.
+// I observed on brand new unit/new battery:
+//    Capacity was 34 at 9:00 AM (approx), ran a survey and
+//    flashed the LEDs for a few hours.
+//    Around 10:15, gauge (capacity) was down to 7 but still going strong.
+//    It got down to 5 at 10:23 <== here you have about 1/2 hour left.
+//    Ran all the down to zero and for about 5 minutes at zero (bat volt: 3.265V)
+//    and then the box FINALLY died at about 10:59...
+// The MAX17043 also fires a processor interrupt when capacity gets too low
+//   which the driver-level stuff will shut down all apps and the box
+// This app no longer shuts anything down, but we will send BAT LOW warning at
+// 10% capacity (about 1/2 hour left).
+bool BatteryChecker::GetBatteryVoltageRaw(VoltageStatus& status, int& batteryCapacityPercent)
+{
+	int battCapacity;  // 0% => 100% (yes it does run when at 0%, but not for long...)
+	// Opened once, one pread() per check (see SysfsAttribute.h).
+	if (!m_capacity.ReadInt(battCapacity))
+	{
+		if (m_capacity.GetLastError() == EINVAL)
+		{
+			m_log->LogErr(AT, "Error parsing batt capacity");
+		}
+		else
+		{
+			m_log->LogErr(AT, "Can't read battery capacity", m_capacity.GetLastError());
+		}
+		status = VoltageStatus::BATTERY_VOLTAGE_FAULT;
+		return false;
+	}
+
+	batteryCapacityPercent = battCapacity;
+	// BatteryCapacityLow is now 10% (in BatteryChecker.h);
+	// the device will shut down at 4%; this gives about half an hour
+	// more operation before device turns itself off.
+	status =
+		(batteryCapacityPercent > BatteryCapacityLow)
+		?
+		VoltageStatus::NORMAL_VOLTAGE
+		:
+		VoltageStatus::LOW_VOLTAGE;
+	return true;
+}
+
+bool BatteryChecker::GetBatteryChargeStatus(ChargingStatus& status)
+{
+// Currently, no driver provides the Battery Charger IC's status,
+//   so we read directly from I2C.
+// "i2cdetect -r 0" - shows I2C device at 0x6b ("6b" means not taken by a driver)
+
+// It would be great if the same driver that reads the battery status
+// from the built-in MAX17043 chip (on the I2C bus at 0x6C) could
+// also provide a FS entry for the Batt Charge Chip (at 0x6B)...
+	uint8_t data;
+	bool ok;
+	if (IsSimulated())
+	{
+		// The register value, as tools/batterysim wrote it.
+		int reg = 0;
+		ok = m_simCharger.ReadInt(reg, 16);
+		data = (uint8_t)reg;
+		if (!ok)
+		{
+			m_log->LogErr(AT, "Can't read simulated charger status");
+		}
+	}
+	else
+	{
+		// One write (register number) / repeated start / read transaction.
+		// [This is where it fails if there is no device @0x6b.]
+		ok =
+			m_i2c.Open(BATTERY_CHARGER_ADDRESS)
+			&&
+			m_i2c.ReadRegister(BATTERY_CHARGER_STATUS_REG, data);
+		m_i2c.Close();
+	}
+	if (!ok)
+	{
+		// Failure reason already logged.
+		status = ChargingStatus::NOT_CHARGING;
+		return false;
+	}
+
+	// Bits 5:4: 00 not charging, 01 pre-charge, 10 fast charging,
+	// 11 charge done.
+	status = (ChargingStatus)(((data & 0x30) >> 4) + 1);
+
+	return true;
+}
+
+// One reading of both; false if either can't be read (and there is no
+// point trying again). 'changed': either differs from the last one.
+bool BatteryChecker::_check(bool& changed)
+{
+	int batteryCapacityPercent = 0;
+	VoltageStatus status;
+	ChargingStatus charging;
+
+	bool rv = GetBatteryChargeStatus(charging);
+	changed = charging != m_chargingStatus;
+	m_chargingStatus = charging;
+	if (!rv)
+	{
+		// Can't read, stop checking. Batt Charger chip not present?
+		m_log->LogErr(AT, "BatteryChecker: Stopping, charging status unavailable.");
+		m_voltageStatus = VoltageStatus::BATTERY_VOLTAGE_FAULT;
+		_publish();
+		return false;
+	}
+
+	// Currently, 'status' goes to LOW_VOLTAGE when capacity <= 10%...
+	// If can't get Battery Status, stop checking
+	//   My device for example doesn't have the chip built in yet.
+	rv = GetBatteryVoltageRaw(status, batteryCapacityPercent);
+	changed = changed || status != m_voltageStatus
+		|| batteryCapacityPercent != m_capacityPercent;
+	m_voltageStatus = status;
+	m_capacityPercent = batteryCapacityPercent;
+	if (!rv)
+	{
+		m_log->LogErr(AT, "BatteryChecker: Stopping, capacity unavailable.");
+		_publish();
+		return false;
+	}
+	if (changed)
+	{
+		LOGF_DEBUG(m_log, "Capacity %d%%, voltage status %d, charging status %d",
+			batteryCapacityPercent, status, charging);
+	}
+	_publish();
+	// NEW: I only send the Status up to Android appliance,
+	//   it is up to OS to shutdown when battery low.
+	// NOTE: It is OK if battery is LOW but also CHARGING.
+	return true;
+}
+
+// The latest readings, as one record.
+void BatteryChecker::_publish(void)
+{
+	capacity.Set(m_capacityPercent);
+	pollInterval.Set(m_interval.load());
+	SharedData *shared = SharedMemory::Writable();
+	if (shared == nullptr)
+	{
+		return;
+	}
+	SharedBattery battery;
+	battery.voltageStatus = m_voltageStatus;
+	battery.chargingStatus = m_chargingStatus;
+	battery.capacityPercent = m_capacityPercent;
+	battery.pollIntervalMs = m_interval;
+	battery.updatedMs = SharedDataNowMs();
+	battery.checks = ++m_checks;
+	if (!shared->battery.Write(battery))
+	{
+		sharedStuck.Add();
+	}
+}
+
+// Scheduler callbacks, all on the scheduler thread.
+
+void BatteryChecker::_poll(void)
+{
+	bool changed;
+	if (!_check(changed))
+	{
+		_stopChecking();
+		return;
+	}
+	_adapt(changed);
+}
+
+// Picks the next polling interval from the latest reading.
+void BatteryChecker::_adapt(bool changed)
+{
+	int interval;
+	if (m_capacityPercent <= BatteryCapacityLow + BatteryCapacityNearBand)
+	{
+		interval = BatteryCheckIntervalNear;
+	}
+	else if (changed)
+	{
+		interval = BatteryCheckInterval;
+	}
+	else
+	{
+		interval = min(m_interval * 2,
+			HasUevents() ? BatteryCheckIntervalMaxEvents : BatteryCheckIntervalMax);
+	}
+	if (interval != m_interval)
+	{
+		LOGF_DEBUG(m_log, "Polling every %d ms (was %d)", interval, m_interval.load());
+		m_interval = interval;
+		Scheduler::GetInstance().SetPeriod(m_task, interval);
+	}
+}
+
+// A check failed: stop, as the thread used to. Stop() (or the next
+// Start()) clears the ids and closes the fds.
+void BatteryChecker::_stopChecking(void)
+{
+	Scheduler& scheduler = Scheduler::GetInstance();
+	scheduler.Remove(m_task);
+	scheduler.Remove(m_ueventTask);
+	scheduler.Remove(m_alertTask);
+	m_running = false;
+}
+
+void BatteryChecker::_onUevents(void)
+{
+	// Read everything queued: one check for a burst of events.
+	bool relevant = false;
+	bool alert = false;
+	char buf[4096];
+	for (;;)
+	{
+		struct sockaddr_nl sender;
+		socklen_t senderLen = sizeof(sender);
+		ssize_t n = recvfrom(m_ueventFd, buf, sizeof(buf) - 1, MSG_DONTWAIT,
+			(struct sockaddr *)&sender, &senderLen);
+		if (n < 0)
+		{
+			if (errno == ENOBUFS)
+			{
+				// Overran the socket buffer: some were lost, check anyway.
+				relevant = true;
+				continue;
+			}
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			break;  // EAGAIN: drained.
+		}
+		if (!IsSimulated() && sender.nl_pid != 0)
+		{
+			continue;  // Not from the kernel.
+		}
+		buf[n] = '\0';
+		if (IsSimulated() && strncmp(buf, BATTERY_SIM_ALERT, strlen(BATTERY_SIM_ALERT)) == 0)
+		{
+			alert = true;
+			continue;
+		}
+		// "ACTION@DEVPATH\0KEY=VALUE\0KEY=VALUE\0..."
+		for (const char *field = buf; field < buf + n; field += strlen(field) + 1)
+		{
+			if (strcmp(field, "SUBSYSTEM=power_supply") == 0)
+			{
+				relevant = true;
+				break;
+			}
+		}
+	}
+	if (alert)
+	{
+		_onAlert();
+	}
+	else if (relevant)
+	{
+		LOGF_TRACE(m_log, "power_supply uevent");
+		_poll();
+	}
+}
+
+void BatteryChecker::_onAlert(void)
+{
+	if (m_alertFd >= 0)
+	{
+		struct gpioevent_data event;
+		while (read(m_alertFd, &event, sizeof(event)) == (ssize_t)sizeof(event))
+		{
+		}
+	}
+	LOGF_WARN(m_log, "BatteryChecker: Fuel gauge ALERT, battery low.");
+	_poll();
+}
+
+// The kernel's uevents (or the simulator's socket); -1 if unavailable.
+int BatteryChecker::_openUevents(void)
+{
+	int fd;
+	if (IsSimulated())
+	{
+		fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		string path = m_simDir + "/" BATTERY_SIM_SOCKET;
+		strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+		unlink(path.c_str());
+		if (fd >= 0 && bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+		{
+			close(fd);
+			fd = -1;
+		}
+	}
+	else
+	{
+		fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			NETLINK_KOBJECT_UEVENT);
+		struct sockaddr_nl addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.nl_family = AF_NETLINK;
+		addr.nl_groups = 1;  // The kernel's own (not udev's re-broadcast).
+		if (fd >= 0 && bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+		{
+			close(fd);
+			fd = -1;
+		}
+	}
+	if (fd < 0)
+	{
+		LOGF_INFO(m_log, "No power_supply uevents (%s), polling only", strerror(errno));
+	}
+	return fd;
+}
+
+// Falling edges on the ALERT line; -1 if unavailable (not wired, or
+// the fuel gauge driver has the line).
+int BatteryChecker::_openAlertGpio(void)
+{
+	if (BATTERY_ALERT_GPIO_LINE < 0 || IsSimulated())
+	{
+		return -1;
+	}
+	int chip = open(BATTERY_ALERT_GPIO_CHIP, O_RDONLY | O_CLOEXEC);
+	if (chip < 0)
+	{
+		LOGF_DEBUG(m_log, "No ALERT GPIO: %s: %s", BATTERY_ALERT_GPIO_CHIP, strerror(errno));
+		return -1;
+	}
+	struct gpioevent_request req;
+	memset(&req, 0, sizeof(req));
+	req.lineoffset = BATTERY_ALERT_GPIO_LINE;
+	req.handleflags = GPIOHANDLE_REQUEST_INPUT;
+	req.eventflags = GPIOEVENT_REQUEST_FALLING_EDGE;
+	strncpy(req.consumer_label, "BatteryChecker", sizeof(req.consumer_label) - 1);
+	int rv = ioctl(chip, GPIO_GET_LINEEVENT_IOCTL, &req);
+	int myErr = errno;
+	close(chip);
+	if (rv != 0)
+	{
+		LOGF_DEBUG(m_log, "No ALERT GPIO: line %d: %s", BATTERY_ALERT_GPIO_LINE, strerror(myErr));
+		return -1;
+	}
+	fcntl(req.fd, F_SETFL, fcntl(req.fd, F_GETFL) | O_NONBLOCK);
+	return req.fd;
+}
@@ -0,0 +1,165 @@
+// BatteryChecker.h
+// Battery capacity (MAX17043 fuel gauge, via its driver's sysfs file)
+// and charger status (charger IC at 0x6B, read directly over I2C).
+//
+// Ported from raw/BatteryChecker.cpp. That USED TO take its own
+// I2C_Bus, so every 15 s it open()ed /dev/i2c-0, set the slave
+// address, wrote the register number, read the status in a separate
+// transaction and close()d the adapter again, racing PwmServoDriver's
+// traffic on the same bus. Now it is an I2c on the shared I2cBus
+// (the one PwmServoDriver uses) and each status read is one combined
+// write / read transaction (I2c::ReadRegister()).
+//
+// It USED TO loop on a thread of its own, asleep but for one read
+// every 15 s. Now the checks are a Scheduler task, run on the one
+// thread that runs all the periodic work and, within
+// BatteryCheckJitter, in the same wakeup as the rest.
+//
+// Fixed 15 s polling also meant a low battery could go unnoticed for
+// 15 s, and a wakeup every 15 s when nothing changes. Now a check
+// also runs as soon as
+//   - the kernel sends a power_supply uevent (netlink; the fuel gauge
+//     driver sends one when capacity or status changes, so do
+//     chargers being plugged in), or
+//   - the MAX17043 ALERT line (BATTERY_ALERT_GPIO_LINE) falls,
+// and polling adapts: BatteryCheckIntervalNear close to
+// BatteryCapacityLow, otherwise doubling from BatteryCheckInterval
+// while nothing changes, up to BatteryCheckIntervalMax (or
+// BatteryCheckIntervalMaxEvents when uevents are coming, polling is
+// just a safety net then). Without either event source it is polling
+// alone, as before but adaptive.
+//
+// With BATTERY_SIM_DIR set, everything comes from tools/batterysim
+// instead of the hardware, see BatterySim.h.
+//
+// The results go into SharedMemory (SharedData::battery, all fields
+// of one check in one SeqLock write) for Diagnostics and other
+// processes, and are kept here for the Get...() methods.
+
+#ifndef BATTERY_CHECKER_H_
+#define BATTERY_CHECKER_H_
+
+#include <atomic>
+#include <mutex>
+#include <string>
+
+#include <stdint.h>
+
+#include "I2c.h"
+#include "LogHandle.h"
+#include "SysfsAttribute.h"
+
+using namespace std;
+
+// Stand-ins for the enums in Shadowx_messages.pb.h (not in this tree).
+// ChargingStatus follows the charger's status register, see
+// BatteryChecker::GetBatteryChargeStatus().
+enum VoltageStatus
+{
+	NORMAL_VOLTAGE = 1,
+	LOW_VOLTAGE = 2,
+	BATTERY_VOLTAGE_FAULT = 3
+};
+
+enum ChargingStatus
+{
+	NOT_CHARGING = 1,
+	PRE_CHARGING = 2,
+	FAST_CHARGING = 3,
+	FULLY_CHARGED = 4
+};
+
+#define BATTERY_CHARGER_ADDRESS 0x6B
+// Charger's system status register; bits 5:4 are the charge state.
+#define BATTERY_CHARGER_STATUS_REG 0x08
+#define BATTERY_CAPACITY_FILE "/sys/class/power_supply/battery/capacity"
+#ifndef BATTERY_ALERT_GPIO_CHIP
+#define BATTERY_ALERT_GPIO_CHIP "/dev/gpiochip0"
+#endif
+// MAX17043 ALERT, active low. -1: don't watch it.
+#ifndef BATTERY_ALERT_GPIO_LINE
+#define BATTERY_ALERT_GPIO_LINE 11
+#endif
+
+class BatteryChecker
+{
+public:
+	explicit BatteryChecker(I2cBus& bus = I2cBus::GetInstance());
+	~BatteryChecker();
+	// Starts / stops the checks. Start() reads once right away and
+	// schedules the rest only if that worked.
+	void Start(void);
+	void Stop(void);
+	bool IsRunning(void) const { return m_running.load(); }
+	bool IsSimulated(void) const { return !m_simDir.empty(); }
+	// Event sources Start() got; without them it is polling only.
+	bool HasUevents(void) const { return m_ueventFd >= 0; }
+	bool HasAlertGpio(void) const { return m_alertFd >= 0; }
+	// Current polling interval, milliseconds.
+	int GetPollInterval(void) const { return m_interval.load(); }
+	// Latest readings (what used to go into SharedMemory).
+	VoltageStatus GetVoltageStatus(void) const { return m_voltageStatus.load(); }
+	ChargingStatus GetChargingStatus(void) const { return m_chargingStatus.load(); }
+	int GetCapacityPercent(void) const { return m_capacityPercent.load(); }
+	bool GetBatteryVoltageRaw(VoltageStatus& status, int& batteryCapacityPercent);
+	bool GetBatteryChargeStatus(ChargingStatus& status);
+private:
+	const int BatteryCheckInterval = 15000;  // milliseconds (15 secs)
+	// Near (or below) BatteryCapacityLow:
+	const int BatteryCheckIntervalNear = 5000;
+	// Doubling while nothing changes, up to:
+	const int BatteryCheckIntervalMax = 60000;
+	const int BatteryCheckIntervalMaxEvents = 300000;
+	// How late a check may run to share a wakeup (see Scheduler.h).
+	const int BatteryCheckJitter = 1000;
+	// This is how we USED to get battery voltage:
+	// const char *AdcFile = "/sys/kernel/debug/twl6030_madc";
+
+// ======= BATTERY CAPACITY THRESHOLD for "LOW BATTERY" INDICATOR =======
+
+	// For NanoPi NEO platform, we read battery percent capacity left.
+	// Capacity (fully charged battery) appears to be about 84%,
+	// when not charging, it slowly goes all the way zero.
+	// Zero means battery has no remaining charge.
+	// Driver conveniently provides the capacity value here:
+	// "/sys/class/power_supply/battery/capacity"
+	// We no longer halt the CPU or anything drastic,
+	// that is now up to the OS which gets an ALERT interupt
+	// on GPIO11 when battery is very low.
+	// Device will shutdown when Battery gets to 4% (there's an interrupt for this)
+	// so alert at 10% capacity (about 1/2 hour remaining time).
+	const int BatteryCapacityLow = 10;
+	// "Near": capacity <= BatteryCapacityLow + BatteryCapacityNearBand
+	const int BatteryCapacityNearBand = 5;
+	// (At 5%, you have about one-half hour left!)
+	I2c m_i2c;
+	LogHandle m_log{"BatteryChecker"};
+	bool _check(bool& changed);
+	void _publish(void);
+	void _poll(void);
+	void _adapt(bool changed);
+	void _stopChecking(void);
+	void _stop(void);
+	int _openUevents(void);
+	int _openAlertGpio(void);
+	void _onUevents(void);
+	void _onAlert(void);
+	string m_simDir;  // BATTERY_SIM_DIR, empty: real hardware
+	SysfsAttribute m_capacity;
+	SysfsAttribute m_simCharger;
+	mutex m_mutex;  // Start() / Stop()
+	// Scheduler ids, 0: none
+	atomic<int> m_task;
+	atomic<int> m_ueventTask;
+	atomic<int> m_alertTask;
+	int m_ueventFd;
+	int m_alertFd;
+	atomic<int> m_interval;
+	uint64_t m_checks;
+	atomic<bool> m_running;
+	atomic<VoltageStatus> m_voltageStatus;
+	atomic<ChargingStatus> m_chargingStatus;
+	atomic<int> m_capacityPercent;
+};
+
+#endif // BATTERY_CHECKER_H_
@@ -0,0 +1,25 @@
+// BatterySim.h
+// What BatteryChecker reads instead of the hardware when the
+// environment has BATTERY_SIM_DIR=<dir> (tools/batterysim writes it):
+//
+//   <dir>/capacity     0-100, as BATTERY_CAPACITY_FILE
+//   <dir>/charger      the charger's status register, e.g. "0x20"
+//                      (bits 5:4, see BatteryChecker::GetBatteryChargeStatus())
+//   <dir>/uevent.sock  datagram socket BatteryChecker binds; takes
+//                      uevents in the kernel's format (what the
+//                      netlink socket would deliver), and
+//                      BATTERY_SIM_ALERT for the ALERT GPIO edge.
+//
+// Header only: tools/batterysim doesn't link BatteryChecker.
+
+#ifndef BATTERY_SIM_H_
+#define BATTERY_SIM_H_
+
+#define BATTERY_SIM_DIR_ENV "BATTERY_SIM_DIR"
+#define BATTERY_SIM_CAPACITY "capacity"
+#define BATTERY_SIM_CHARGER "charger"
+#define BATTERY_SIM_SOCKET "uevent.sock"
+// A datagram starting with this is the ALERT edge.
+#define BATTERY_SIM_ALERT "alert@"
+
+#endif  // BATTERY_SIM_H_
@@ -0,0 +1,124 @@
+// BoundedQueue.h
+// Fixed-size, lock-free multi-producer / multi-consumer queue
+// (D. Vyukov's bounded MPMC queue). Items live in place in a
+// preallocated array; TryPush() / TryPop() hand the caller a
+// reference to the claimed slot so nothing is copied twice:
+//
+//     queue.TryPush([&](Item& item) { memcpy(item.text, msg, len); });
+//     queue.TryPop([&](Item& item) { write(fd, item.text, ...); });
+//
+// Used by PendingMessages (log lines the file lock kept out) and by
+// StackTrace's deferred symbolization queue.
+
+#ifndef BOUNDED_QUEUE_H_
+#define BOUNDED_QUEUE_H_
+
+#include <atomic>
+#include <cstddef>
+
+#include <stdint.h>
+
+using namespace std;
+
+// 'Capacity' must be a power of two.
+template<typename T, size_t Capacity>
+class BoundedQueue
+{
+	static_assert((Capacity & (Capacity - 1)) == 0,
+		"BoundedQueue capacity must be a power of two");
+public:
+	BoundedQueue()
+		: m_enqueuePos(0), m_dequeuePos(0)
+	{
+		// Slot 'i' is free for the producer holding ticket 'i':
+		for (size_t i = 0; i < Capacity; i++)
+		{
+			m_cells[i].sequence.store(i, memory_order_relaxed);
+		}
+	}
+
+	// Returns false (and doesn't call 'fill') when full.
+	template<typename F>
+	bool TryPush(F fill)
+	{
+		size_t pos = m_enqueuePos.load(memory_order_relaxed);
+		for (;;)
+		{
+			Cell& cell = m_cells[pos & m_mask];
+			size_t seq = cell.sequence.load(memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+			if (diff == 0)
+			{
+				// Slot is free, try to claim it:
+				if (m_enqueuePos.compare_exchange_weak(pos, pos + 1,
+						memory_order_relaxed))
+				{
+					fill(cell.item);
+					cell.sequence.store(pos + 1, memory_order_release);
+					return true;
+				}
+				// CAS failure reloaded 'pos', go around again.
+			}
+			else if (diff < 0)
+			{
+				return false;  // Full.
+			}
+			else
+			{
+				pos = m_enqueuePos.load(memory_order_relaxed);
+			}
+		}
+	}
+
+	// Returns false (and doesn't call 'consume') when empty.
+	template<typename F>
+	bool TryPop(F consume)
+	{
+		size_t pos = m_dequeuePos.load(memory_order_relaxed);
+		for (;;)
+		{
+			Cell& cell = m_cells[pos & m_mask];
+			size_t seq = cell.sequence.load(memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+			if (diff == 0)
+			{
+				if (m_dequeuePos.compare_exchange_weak(pos, pos + 1,
+						memory_order_relaxed))
+				{
+					consume(cell.item);
+					// Hand the slot back to producers, one lap later:
+					cell.sequence.store(pos + m_mask + 1, memory_order_release);
+					return true;
+				}
+			}
+			else if (diff < 0)
+			{
+				return false;  // Empty.
+			}
+			else
+			{
+				pos = m_dequeuePos.load(memory_order_relaxed);
+			}
+		}
+	}
+
+	bool IsEmpty(void) const
+	{
+		return m_dequeuePos.load(memory_order_acquire)
+			== m_enqueuePos.load(memory_order_acquire);
+	}
+
+private:
+	struct Cell
+	{
+		atomic<size_t> sequence;
+		T item;
+	};
+	static const size_t m_mask = Capacity - 1;
+	Cell m_cells[Capacity];
+	// Producers and consumers each get their own cache line:
+	alignas(64) atomic<size_t> m_enqueuePos;
+	alignas(64) atomic<size_t> m_dequeuePos;
+};
+
+#endif  // BOUNDED_QUEUE_H_
@@ -0,0 +1,342 @@
+// Diagnostics.cpp
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/statvfs.h>
+
+#include "Diagnostics.h"
+#include "Metrics.h"
+#include "Scheduler.h"
+
+Diagnostics::Diagnostics()
+	: m_fd(-1), m_lastError(0), m_msgId(1),
+	m_sendFail(0), m_task(0), m_running(false),
+	m_haveLast(false), m_lastSentMs(0), m_lastMetricsMs(0), m_metricsDue(false),
+	m_retryAtMs(0), m_retryMs(0),
+	m_writeTask(0), m_dropped(0)
+{
+	memset(&m_last, 0, sizeof(m_last));
+}
+
+Diagnostics::~Diagnostics()
+{
+	Stop();
+}
+
+bool Diagnostics::Init(int outbound_fd)
+{
+	m_fd = outbound_fd;
+	return m_fd >= 0;
+}
+
+void Diagnostics::Start(void)
+{
+	lock_guard<mutex> lock(m_mutex);
+	if (m_running || m_fd < 0)
+	{
+		return;
+	}
+	// _failed() stops sending but can't clear m_task (it runs under
+	// m_sendMutex only): finish that stop first.
+	_stop();
+	if (!m_sharedMemory.Open(true))
+	{
+		m_log->LogErr(AT, "Cant Open() SharedMemory, aborting.");
+		return;
+	}
+	m_log->LogInfo("Starting Diagnostics...");
+	{
+		lock_guard<mutex> sendLock(m_sendMutex);
+		m_pending.clear();
+		m_out.clear();
+		m_haveLast = false;  // The first sample goes out at once.
+		m_lastSentMs = SharedDataNowMs();
+		m_lastMetricsMs = m_lastSentMs;
+		m_metricsDue = false;
+		m_retryAtMs = 0;
+		m_retryMs = 0;
+		m_dropped = 0;
+		m_sendFail = 0;
+		m_running = true;
+	}
+	m_task = Scheduler::GetInstance().Add("Diagnostics", DiagnosticsSampleInterval,
+		DiagnosticsJitter, [this]() { _sample(); });
+	if (m_task == 0)
+	{
+		m_log->LogErr(AT, "Diagnostics: Can't schedule the samples.");
+		m_running = false;
+	}
+}
+
+void Diagnostics::Stop(void)
+{
+	lock_guard<mutex> lock(m_mutex);
+	_stop();
+}
+
+// Under m_mutex.
+void Diagnostics::_stop(void)
+{
+	if (m_task == 0)
+	{
+		return;
+	}
+	bool wasRunning;
+	int writeTask;
+	{
+		// From here on the callbacks return at once, and can't add
+		// another write watch.
+		lock_guard<mutex> sendLock(m_sendMutex);
+		wasRunning = m_running;
+		m_running = false;
+		writeTask = m_writeTask;
+		m_writeTask = 0;
+	}
+	// These wait for a callback in progress.
+	Scheduler::GetInstance().Remove(m_task);
+	if (writeTask != 0)
+	{
+		Scheduler::GetInstance().Remove(writeTask);
+	}
+	m_task = 0;
+	if (wasRunning)
+	{
+		m_log->LogInfo("Stopping Diagnostics...");
+	}
+}
+
+// The Scheduler task.
+void Diagnostics::_sample(void)
+{
+	lock_guard<mutex> lock(m_sendMutex);
+	if (!m_running)
+	{
+		return;
+	}
+	uint64_t now = SharedDataNowMs();
+	DiagnosticData msg;
+	_take(msg, now);
+	bool urgent;
+	bool changed = _changed(msg, urgent);
+	bool heartbeat = now - m_lastSentMs >= (uint64_t)DiagnosticsHeartbeat;
+	if (changed || (heartbeat && m_pending.empty() && m_out.empty()))
+	{
+		_queue(msg);
+	}
+	if (now - m_lastMetricsMs >= (uint64_t)DiagnosticsMetricsInterval)
+	{
+		m_metricsDue = true;
+		m_lastMetricsMs = now;
+	}
+	if (urgent || heartbeat || m_metricsDue || m_pending.size() >= DiagnosticsBatchMax
+		|| m_sendFail > 0)
+	{
+		_flush(now);
+	}
+}
+
+void Diagnostics::_take(DiagnosticData& msg, uint64_t now)
+{
+	struct statvfs stats;
+	memset(&msg, 0, sizeof(msg));
+	msg.sampledMs = now;
+	if (statvfs(FilesysPath, &stats) == 0)
+	{
+		msg.availableSpace = stats.f_bavail;
+		msg.totalSpace = stats.f_blocks;
+	}
+	// Both from the same check (see SeqLock.h).
+	SharedBattery battery;
+	if (m_sharedMemory.m_pSharedData->battery.Read(battery)
+		&& battery.checks > 0)
+	{
+		msg.chargeStatus = (ChargingStatus)battery.chargingStatus;
+		msg.batteryStatus = (VoltageStatus)battery.voltageStatus;
+	}
+	else
+	{
+		msg.chargeStatus = ChargingStatus::NOT_CHARGING;
+		msg.batteryStatus = VoltageStatus::BATTERY_VOLTAGE_FAULT;
+	}
+}
+
+// Worth sending? 'urgent': the client should hear about it now.
+bool Diagnostics::_changed(const DiagnosticData& msg, bool& urgent) const
+{
+	urgent = !m_haveLast || msg.chargeStatus != m_last.chargeStatus
+		|| msg.batteryStatus != m_last.batteryStatus;
+	if (urgent)
+	{
+		return true;
+	}
+	uint64_t threshold = msg.totalSpace * DiagnosticsSpaceThreshold / 100;
+	uint64_t moved = msg.availableSpace > m_last.availableSpace
+		? msg.availableSpace - m_last.availableSpace
+		: m_last.availableSpace - msg.availableSpace;
+	return msg.totalSpace != m_last.totalSpace || moved > threshold;
+}
+
+void Diagnostics::_queue(const DiagnosticData& msg)
+{
+	if (m_pending.size() >= DiagnosticsBatchMax)
+	{
+		// The client isn't reading; it wants the latest most.
+		m_pending.erase(m_pending.begin());
+		m_dropped++;
+	}
+	m_msgId++;
+	if (m_msgId > 999999)
+	{
+		m_msgId = 1;
+	}
+	m_pending.push_back(msg);
+	m_pending.back().msgId = m_msgId;
+	m_last = msg;
+	m_haveLast = true;
+}
+
+void Diagnostics::_flush(uint64_t now)
+{
+	if (m_writeTask != 0 || now < m_retryAtMs)
+	{
+		return;  // Waiting for EPOLLOUT, or backing off.
+	}
+	_write(now);
+}
+
+// Sends m_out, then whatever is pending, until done or the socket is
+// full. On the scheduler thread, under m_sendMutex.
+void Diagnostics::_write(uint64_t now)
+{
+	for (;;)
+	{
+		if (m_out.empty())
+		{
+			if (m_pending.empty() && !m_metricsDue)
+			{
+				break;
+			}
+			// The whole batch in one send().
+			for (const DiagnosticData& msg : m_pending)
+			{
+				char line[128];
+				int len = snprintf(line, sizeof(line), "DIAG %d %llu %llu %d %d %llu\n",
+					msg.msgId, (unsigned long long)msg.availableSpace,
+					(unsigned long long)msg.totalSpace, (int)msg.chargeStatus,
+					(int)msg.batteryStatus, (unsigned long long)(now - msg.sampledMs));
+				m_out.append(line, len);
+			}
+			m_pending.clear();
+			if (m_metricsDue)
+			{
+				// Counters as of now, not as of the last sample.
+				m_out += "METRICS ";
+				m_out += Metrics::Compact();
+				m_out += "\n";
+				m_metricsDue = false;
+			}
+		}
+		ssize_t sent = send(m_fd, m_out.data(), m_out.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				// Not a failure; the rest goes when there's room.
+				_watchWritable(true);
+				return;
+			}
+			m_lastError = errno;
+			_watchWritable(false);
+			_failed(now);
+			return;
+		}
+		m_out.erase(0, sent);
+		if (m_out.empty())
+		{
+			m_lastSentMs = now;
+			m_retryMs = 0;
+			if (m_sendFail > 0)
+			{
+				m_log->LogInfo("Diagnostics: Send data to client SUCCESS, resetting fail flag..");
+				m_sendFail = 0;
+			}
+			if (m_dropped > 0)
+			{
+				LOGF_INFO(m_log, "Diagnostics: Dropped %llu samples the client"
+					" wasn't reading.", (unsigned long long)m_dropped);
+				m_dropped = 0;
+			}
+		}
+	}
+	_watchWritable(false);
+}
+
+// The EPOLLOUT watch.
+void Diagnostics::_onWritable(void)
+{
+	lock_guard<mutex> lock(m_sendMutex);
+	if (!m_running)
+	{
+		return;
+	}
+	_write(SharedDataNowMs());
+}
+
+void Diagnostics::_failed(uint64_t now)
+{
+	// Every once in a while send() fails with "Network Unreachable."
+	// ENETUNREACH:
+	//    "A write was attempted on a socket
+	//     and no route to the network is present."
+	// But we know the connection is OK (I think).
+	// FORMER BEHAVIOR was to stop immediately here.
+	// Let us try retry for awhile.
+	// When C & C channel disconnects, OGDH gets a message to shut
+	// me down. I think that when Android senses that diag data is
+	// not coming in that it shuts down the C & C channel and we lose
+	// all connections.
+	// What didn't go stays queued (a partly sent line goes on where
+	// it stopped).
+	m_sendFail++;
+	if (m_sendFail > MaxSendFailures)
+	{
+		LOGF_ERROR(m_log, "Diagnostics: Can't send diag data to client: %s"
+			" after multiple retries. Stopping.", strerror(m_lastError));
+		// m_task is only written while no callback can run (Start()
+		// before it schedules any, Stop() after removing them), so it
+		// is this one's. Start() clears it.
+		Scheduler::GetInstance().Remove(m_task);
+		m_pending.clear();
+		m_out.clear();
+		m_running = false;
+		return;
+	}
+	m_retryMs = m_retryMs == 0 ? DiagnosticsRetryMin
+		: min(m_retryMs * 2, DiagnosticsRetryMax);
+	m_retryAtMs = now + m_retryMs;
+	LOGF_INFO(m_log, "Diagnostics: Could not send data to client: %s"
+		", fail # %d, will retry in %d secs...",
+		strerror(m_lastError), m_sendFail, m_retryMs / 1000);
+}
+
+void Diagnostics::_watchWritable(bool on)
+{
+	if (on && m_writeTask == 0)
+	{
+		// If this fails the next sample tries again.
+		m_writeTask = Scheduler::GetInstance().AddFd("Diagnostics::Write", m_fd,
+			[this]() { _onWritable(); }, EPOLLOUT);
+	}
+	else if (!on && m_writeTask != 0)
+	{
+		// A callback may remove its own watch.
+		Scheduler::GetInstance().Remove(m_writeTask);
+		m_writeTask = 0;
+	}
+}
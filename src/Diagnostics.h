@@ -0,0 +1,126 @@
+// Diagnostics.h
+// Free space and battery state, reported to the client.
+//
+// Ported from raw/Diagnostics.cpp. That USED TO be a ThreadRunnerBase
+// thread of its own that sent the full message every 15 s whether or
+// not anything had changed, and slept 5 s between retries. Now a
+// Scheduler task samples every DiagnosticsSampleInterval (the battery
+// state from SharedMemory, written by BatteryChecker, maybe in another
+// process, as one SeqLock snapshot) and only queues a sample that
+// differs from the last one queued:
+//   - charge or battery status changed: queued and sent at once, so
+//     e.g. battery LOW reaches the client within a sample interval;
+//   - free space moved by DiagnosticsSpaceThreshold % of the total:
+//     queued, sent with the next batch;
+//   - nothing sent for DiagnosticsHeartbeat: the current sample is
+//     queued and everything pending goes out, so the client still
+//     knows we're alive.
+// Every DiagnosticsMetricsInterval the next batch also carries the bus,
+// PWM and logging counters (see Metrics.h), as one line:
+//     METRICS <Metrics::Compact()>\n
+// Up to DiagnosticsBatchMax samples go out in one send(); when more
+// pile up (client not reading) the oldest are dropped.
+//
+// ShadowXMessageSender and the protobuf DiagnosticData aren't in this
+// tree; until they are, DiagnosticData below carries the same fields
+// and goes out on the outbound fd as one text line per sample:
+//     DIAG <msg id> <available blocks> <total blocks> <charge> <battery> <age ms>\n
+// where 'age' is how long the sample waited for its batch to be sent.
+//
+// Sends never block the scheduler thread (MSG_DONTWAIT). A full socket
+// is not a failure: the unsent tail waits for EPOLLOUT (a Scheduler fd
+// watch). A failed send backs off DiagnosticsRetryMin, doubling up to
+// DiagnosticsRetryMax; after MaxSendFailures in a row we stop.
+
+#ifndef DIAGNOSTICS_H_
+#define DIAGNOSTICS_H_
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "BatteryChecker.h"
+#include "LogHandle.h"
+#include "SharedMemory.h"
+
+using namespace std;
+
+// Stand-in for DiagnosticData in Shadowx_messages.pb.h.
+struct DiagnosticData
+{
+	int32_t msgId;
+	uint64_t sampledMs;  // SharedDataNowMs()
+	uint64_t availableSpace;  // statvfs() f_bavail
+	uint64_t totalSpace;  // statvfs() f_blocks
+	ChargingStatus chargeStatus;
+	VoltageStatus batteryStatus;
+};
+
+class Diagnostics
+{
+public:
+	Diagnostics();
+	~Diagnostics();
+	bool Init(int outbound_fd);
+	// Starts / stops sending (Init() first; and the BatteryChecker,
+	// which creates SharedMemory).
+	void Start(void);
+	void Stop(void);
+	bool IsRunning(void) const { return m_running.load(); }
+private:
+	const int DiagnosticsSampleInterval = 2000;  // milliseconds
+	// Same budget as BatteryChecker's, so they share wakeups.
+	const int DiagnosticsJitter = 1000;
+	// The client USED TO get a message every 15 secs; it may take
+	// silence for a dead unit, so don't go quiet for too long.
+	const int DiagnosticsHeartbeat = 60000;  // 1 minute
+	const int DiagnosticsSpaceThreshold = 1;  // % of the total blocks
+	const size_t DiagnosticsBatchMax = 8;
+	const int DiagnosticsMetricsInterval = 300000;  // 5 minutes
+	const int DiagnosticsRetryMin = 2000;
+	const int DiagnosticsRetryMax = 60000;
+	// About fifteen minutes of fails, with the backoff...
+	const int MaxSendFailures = 20;
+	const char *FilesysPath = "/home/root";
+	void _sample(void);
+	void _take(DiagnosticData& msg, uint64_t now);
+	bool _changed(const DiagnosticData& msg, bool& urgent) const;
+	void _queue(const DiagnosticData& msg);
+	void _flush(uint64_t now);
+	void _write(uint64_t now);
+	void _onWritable(void);
+	void _failed(uint64_t now);
+	void _watchWritable(bool on);
+	void _stop(void);
+	// I *read* (only) the battery record; BatteryChecker writes it.
+	SharedMemory m_sharedMemory;
+	int m_fd;
+	int m_lastError;
+	int32_t m_msgId;
+	int m_sendFail;
+	LogHandle m_log{"Diagnostics"};
+	mutex m_mutex;  // Start() / Stop()
+	// Scheduler task id, 0: not started. Also non-zero after
+	// _failed() stopped sending, until Start() or Stop().
+	atomic<int> m_task;
+	atomic<bool> m_running;
+	// Everything below; held by the Scheduler callbacks, and by Stop()
+	// while it turns them off.
+	mutex m_sendMutex;
+	vector<DiagnosticData> m_pending;  // Sampled, not yet formatted
+	string m_out;  // Formatted, not yet (all) sent
+	DiagnosticData m_last;  // Last queued
+	bool m_haveLast;
+	uint64_t m_lastSentMs;
+	uint64_t m_lastMetricsMs;
+	bool m_metricsDue;  // Add a METRICS line to the next batch
+	uint64_t m_retryAtMs;  // Backing off until then
+	int m_retryMs;
+	int m_writeTask;  // EPOLLOUT watch, 0: none
+	uint64_t m_dropped;
+};
+
+#endif  // DIAGNOSTICS_H_
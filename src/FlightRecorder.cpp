@@ -0,0 +1,441 @@
+// FlightRecorder.cpp
+
+#include <execinfo.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Log.h"
+#include "FlightRecorder.h"
+
+#if FLIGHT_RECORDER_SLOTS > 0
+static_assert((FLIGHT_RECORDER_SLOTS & (FLIGHT_RECORDER_SLOTS - 1)) == 0,
+	"FLIGHT_RECORDER_SLOTS must be a power of two");
+static FlightRecord records[FLIGHT_RECORDER_SLOTS];
+#endif
+static atomic<uint64_t> nextTicket(0);
+atomic<bool> FlightRecorder::m_enabled(false);
+
+// Everything the signal handler needs is set up ahead of time:
+static int crashFd = -1;
+#define CRASH_ALT_STACK_SIZE 16384
+static char altStack[CRASH_ALT_STACK_SIZE];
+#define CRASH_MAX_FRAMES 64
+static void *crashFrames[CRASH_MAX_FRAMES];
+
+FlightRecord& FlightRecorder::_claim(uint64_t& ticket)
+{
+#if FLIGHT_RECORDER_SLOTS > 0
+	ticket = nextTicket.fetch_add(1, memory_order_relaxed);
+	FlightRecord& r = records[ticket & (FLIGHT_RECORDER_SLOTS - 1)];
+	// Dump() skips a slot that is being (re)written.
+	r.sequence.store(0, memory_order_relaxed);
+	atomic_signal_fence(memory_order_seq_cst);
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	r.ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	r.tid = Log::ThreadId();
+	return r;
+#else
+	static FlightRecord unused;
+	ticket = 0;
+	return unused;
+#endif
+}
+
+void FlightRecorder::_put(FlightRecord& r, size_t& textUsed, const char *s)
+{
+	if (r.argc >= FLIGHT_RECORDER_ARGS)
+	{
+		return;
+	}
+	if (s == nullptr)
+	{
+		s = "(null)";
+	}
+	r.tags[r.argc] = 's';
+	r.args[r.argc++] = textUsed;
+	if (textUsed < sizeof(r.text))
+	{
+		size_t room = sizeof(r.text) - textUsed - 1;
+		size_t n = strnlen(s, room);
+		memcpy(r.text + textUsed, s, n);
+		r.text[textUsed + n] = 0;
+		textUsed += n + 1;
+	}
+}
+
+// --- Async-signal-safe output. No stdio, no malloc. ---
+
+namespace
+{
+	struct SafeBuf
+	{
+		char data[512];
+		size_t used;
+		void Add(char c)
+		{
+			if (used < sizeof(data))
+			{
+				data[used++] = c;
+			}
+		}
+		void Add(const char *s)
+		{
+			while (*s)
+			{
+				Add(*s++);
+			}
+		}
+		void AddNumber(uint64_t v, int base, int width, char pad, bool upper)
+		{
+			const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+			char tmp[24];
+			int n = 0;
+			do
+			{
+				tmp[n++] = digits[v % base];
+				v /= base;
+			} while (v != 0);
+			for (int i = n; i < width; i++)
+			{
+				Add(pad);
+			}
+			while (n > 0)
+			{
+				Add(tmp[--n]);
+			}
+		}
+		void AddSigned(int64_t v, int width, char pad)
+		{
+			if (v < 0)
+			{
+				Add('-');
+				AddNumber((uint64_t)(-(v + 1)) + 1, 10, width - 1, pad, false);
+			}
+			else
+			{
+				AddNumber((uint64_t)v, 10, width, pad, false);
+			}
+		}
+		void AddDouble(double d, int precision)
+		{
+			if (d != d)
+			{
+				Add("nan");
+				return;
+			}
+			if (d < 0)
+			{
+				Add('-');
+				d = -d;
+			}
+			if (d > 1e18)
+			{
+				Add("<big>");
+				return;
+			}
+			uint64_t scale = 1;
+			for (int i = 0; i < precision; i++)
+			{
+				scale *= 10;
+			}
+			uint64_t whole = (uint64_t)d;
+			uint64_t frac = (uint64_t)((d - (double)whole) * scale + 0.5);
+			if (frac >= scale)
+			{
+				whole++;
+				frac -= scale;
+			}
+			AddNumber(whole, 10, 0, ' ', false);
+			if (precision > 0)
+			{
+				Add('.');
+				AddNumber(frac, 10, precision, '0', false);
+			}
+		}
+		void Flush(int fd)
+		{
+			size_t done = 0;
+			while (done < used)
+			{
+				ssize_t n = write(fd, data + done, used - done);
+				if (n <= 0)
+				{
+					break;
+				}
+				done += n;
+			}
+			used = 0;
+		}
+	};
+
+#if FLIGHT_RECORDER_SLOTS > 0
+	// A small printf(): flags '0', width, precision, length modifiers
+	// ignored; d i u x X p c s f e g.
+	void formatRecord(SafeBuf& out, const FlightRecord& r)
+	{
+		int next = 0;
+		for (const char *p = r.fmt; *p; p++)
+		{
+			if (*p != '%')
+			{
+				out.Add(*p);
+				continue;
+			}
+			p++;
+			if (*p == '%')
+			{
+				out.Add('%');
+				continue;
+			}
+			char pad = ' ';
+			int width = 0;
+			int precision = 6;
+			while (*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0')
+			{
+				if (*p == '0')
+				{
+					pad = '0';
+				}
+				p++;
+			}
+			while (*p >= '0' && *p <= '9')
+			{
+				width = width * 10 + (*p++ - '0');
+			}
+			if (*p == '.')
+			{
+				p++;
+				precision = 0;
+				while (*p >= '0' && *p <= '9')
+				{
+					precision = precision * 10 + (*p++ - '0');
+				}
+			}
+			while (*p && strchr("hlLqjzt", *p))
+			{
+				p++;
+			}
+			if (*p == 0)
+			{
+				break;
+			}
+			if (next >= r.argc || next >= FLIGHT_RECORDER_ARGS)
+			{
+				out.Add("<?>");
+				continue;
+			}
+			char tag = r.tags[next];
+			uint64_t v = r.args[next++];
+			if (tag == 's')
+			{
+				if (*p == 's' && v < sizeof(r.text))
+				{
+					// Bounded: the recorder always nul-terminates.
+					for (size_t i = v; i < sizeof(r.text) && r.text[i]; i++)
+					{
+						out.Add(r.text[i]);
+					}
+				}
+				else
+				{
+					out.Add("<s?>");
+				}
+				continue;
+			}
+			double d;
+			memcpy(&d, &v, sizeof(d));
+			if ((tag == 'i' || tag == 'u') && *p != 'd' && *p != 'i')
+			{
+				v &= 0xffffffffULL;
+			}
+			switch (*p)
+			{
+			case 'd':
+			case 'i':
+				out.AddSigned((tag == 'd') ? (int64_t)d : (int64_t)v, width, pad);
+				break;
+			case 'u':
+				out.AddNumber((tag == 'd') ? (uint64_t)d : v, 10, width, pad, false);
+				break;
+			case 'x':
+			case 'X':
+				out.AddNumber(v, 16, width, pad, *p == 'X');
+				break;
+			case 'p':
+				out.Add("0x");
+				out.AddNumber(v, 16, 0, ' ', false);
+				break;
+			case 'c':
+				out.Add((char)v);
+				break;
+			case 'f':
+			case 'F':
+			case 'e':
+			case 'E':
+			case 'g':
+			case 'G':
+				out.AddDouble((tag == 'd') ? d
+					: (tag == 'i' || tag == 'I') ? (double)(int64_t)v : (double)v,
+					precision);
+				break;
+			default:
+				out.Add("<%?>");
+				break;
+			}
+		}
+	}
+#endif
+
+	const char *signalName(int sig)
+	{
+		switch (sig)
+		{
+		case SIGSEGV: return "SIGSEGV";
+		case SIGBUS:  return "SIGBUS";
+		case SIGILL:  return "SIGILL";
+		case SIGFPE:  return "SIGFPE";
+		case SIGABRT: return "SIGABRT";
+		default:      return "signal";
+		}
+	}
+}
+
+void FlightRecorder::Dump(int fd)
+{
+#if FLIGHT_RECORDER_SLOTS > 0
+	SafeBuf out;
+	out.used = 0;
+	uint64_t end = nextTicket.load(memory_order_acquire);
+	uint64_t start = (end > FLIGHT_RECORDER_SLOTS) ? (end - FLIGHT_RECORDER_SLOTS) : 0;
+	out.Add("--- Flight recorder, last ");
+	out.AddNumber(end - start, 10, 0, ' ', false);
+	out.Add(" of ");
+	out.AddNumber(end, 10, 0, ' ', false);
+	out.Add(" events ---\n");
+	out.Flush(fd);
+	for (uint64_t t = start; t < end; t++)
+	{
+		const FlightRecord& r = records[t & (FLIGHT_RECORDER_SLOTS - 1)];
+		if (r.sequence.load(memory_order_acquire) != t + 1)
+		{
+			continue;  // Being written (or overwritten) right now.
+		}
+		out.Add('[');
+		out.AddNumber(r.ns / 1000000000ULL, 10, 6, ' ', false);
+		out.Add('.');
+		out.AddNumber((r.ns % 1000000000ULL) / 1000, 10, 6, '0', false);
+		out.Add("] tid ");
+		out.AddNumber(r.tid, 10, 0, ' ', false);
+		out.Add(": ");
+		formatRecord(out, r);
+		if (out.used > 0 && out.data[out.used - 1] != '\n')
+		{
+			out.Add('\n');
+		}
+		out.Flush(fd);
+	}
+#else
+	(void)fd;
+#endif
+}
+
+void FlightRecorder::_crashHandler(int sig, siginfo_t *info, void *context)
+{
+	(void)context;
+	int fd = (crashFd >= 0) ? crashFd : STDERR_FILENO;
+	SafeBuf out;
+	out.used = 0;
+	out.Add("\n*** ");
+	out.Add(signalName(sig));
+	out.Add(" (");
+	out.AddNumber(sig, 10, 0, ' ', false);
+	out.Add(") PID: ");
+	out.AddNumber(getpid(), 10, 0, ' ', false);
+	out.Add(" addr: 0x");
+	out.AddNumber((uint64_t)(uintptr_t)info->si_addr, 16, 0, ' ', false);
+	out.Add(" ***\n--- Backtrace (addr2line -e <exe> <offset>) ---\n");
+	out.Flush(fd);
+	// backtrace() was primed in InstallCrashHandler(), and
+	// backtrace_symbols_fd() doesn't malloc.
+	int n = backtrace(crashFrames, CRASH_MAX_FRAMES);
+	backtrace_symbols_fd(crashFrames, n, fd);
+	Dump(fd);
+	if (fd != STDERR_FILENO)
+	{
+		out.Add(signalName(sig));
+		out.Add(": flight recorder written to " FLIGHT_RECORDER_CRASH_FILE "\n");
+		out.Flush(STDERR_FILENO);
+	}
+	// SA_RESETHAND put the default action back: die (and dump core)
+	// the way we would have without the handler.
+	raise(sig);
+}
+
+void FlightRecorder::SetEnabled(bool enabled)
+{
+	m_enabled.store(enabled, memory_order_relaxed);
+}
+
+namespace
+{
+	struct ThreadAltStack
+	{
+		ThreadAltStack()
+			: stack(new char[CRASH_ALT_STACK_SIZE])
+		{
+			stack_t ss;
+			ss.ss_sp = stack;
+			ss.ss_size = CRASH_ALT_STACK_SIZE;
+			ss.ss_flags = 0;
+			sigaltstack(&ss, nullptr);
+		}
+		~ThreadAltStack()
+		{
+			stack_t ss;
+			memset(&ss, 0, sizeof(ss));
+			ss.ss_flags = SS_DISABLE;
+			sigaltstack(&ss, nullptr);
+			delete[] stack;
+		}
+		char *stack;
+	};
+}
+
+void FlightRecorder::InstallAltStack(void)
+{
+	static thread_local ThreadAltStack threadAltStack;
+	(void)threadAltStack;
+}
+
+bool FlightRecorder::InstallCrashHandler(void)
+{
+	// Not O_TRUNC: keep earlier crashes, the file is small.
+	crashFd = open(FLIGHT_RECORDER_CRASH_FILE, O_WRONLY | O_APPEND | O_CREAT,
+		S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+	// First backtrace() call dlopen()s libgcc_s, do it now:
+	backtrace(crashFrames, 1);
+	// A stack overflow SIGSEGV needs a stack to run the handler on.
+	stack_t ss;
+	ss.ss_sp = altStack;
+	ss.ss_size = sizeof(altStack);
+	ss.ss_flags = 0;
+	sigaltstack(&ss, nullptr);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = _crashHandler;
+	sa.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESETHAND;
+	sigemptyset(&sa.sa_mask);
+	const int signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+	bool ok = true;
+	for (int sig : signals)
+	{
+		if (sigaction(sig, &sa, nullptr) != 0)
+		{
+			ok = false;
+		}
+	}
+	SetEnabled(true);
+	return ok && crashFd >= 0;
+}
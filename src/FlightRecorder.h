@@ -0,0 +1,162 @@
+// FlightRecorder.h
+// In-RAM "flight recorder" of the most recent events, dumped only if
+// the process crashes.
+//
+// Log only writes what it was asked to, and I2c / PwmServoDriver log
+// at trace level, which is normally off; so after a SIGSEGV the log
+// file says nothing about what led up to it. Once enabled, every
+// LOGF_*() call (at ANY level, filtered out or not) and every line Log
+// does write is also recorded here: a format string pointer, up to
+// FLIGHT_RECORDER_ARGS raw argument values and a time stamp in one of
+// FLIGHT_RECORDER_SLOTS fixed slots. No formatting, no lock, no
+// syscall (clock_gettime() is a vDSO call).
+//
+// Recording is off until InstallCrashHandler() (nothing would ever
+// read it) or SetEnabled(true). While it is off a filtered out LOGF_*()
+// costs what LOG_*() does, one relaxed load more: its arguments are
+// not evaluated. While it is on they are (not formatted), so keep
+// LOGF_*() arguments cheap.
+//
+// InstallCrashHandler() opens FLIGHT_RECORDER_CRASH_FILE up front and
+// catches SIGSEGV, SIGBUS, SIGILL, SIGFPE and SIGABRT; the handler
+// writes the signal, a raw backtrace and the ring (oldest first) to
+// that fd using only async-signal-safe calls, then re-raises the
+// signal so the process still dies (and dumps core) as before.
+// The handler runs on an alternate signal stack, so a stack overflow
+// is caught too; sigaltstack() is per thread, so every thread calls
+// InstallAltStack() when it starts (Log's own threads and the
+// Scheduler's do), the installing thread gets one from
+// InstallCrashHandler().
+//
+// -DFLIGHT_RECORDER_SLOTS=0 compiles the recorder out: LOGF_*() don't
+// call Record() at all.
+
+#ifndef FLIGHT_RECORDER_H_
+#define FLIGHT_RECORDER_H_
+
+#include <atomic>
+#include <string>
+#include <type_traits>
+
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+using namespace std;
+
+// Must be a power of two (or 0).
+#ifndef FLIGHT_RECORDER_SLOTS
+#define FLIGHT_RECORDER_SLOTS 256
+#endif
+#define FLIGHT_RECORDER_ARGS 4
+// String arguments are copied (nul-terminated, back to back) here:
+#define FLIGHT_RECORDER_TEXT_LEN 48
+
+struct FlightRecord
+{
+	atomic<uint64_t> sequence;  // Ticket + 1 once complete, 0 while written
+	uint64_t ns;                // CLOCK_MONOTONIC
+	const char *fmt;            // printf() format, string literal
+	uint32_t tid;
+	uint8_t argc;
+	char tags[FLIGHT_RECORDER_ARGS];  // 'i' 'I' 'u' 'U' 'd' 's' (value == text offset)
+	uint64_t args[FLIGHT_RECORDER_ARGS];
+	char text[FLIGHT_RECORDER_TEXT_LEN];
+};
+
+class FlightRecorder
+{
+public:
+	// 'fmt' must outlive the process (a string literal / LogFormat).
+	template<typename... Args>
+	static void Record(const char *fmt, Args... args)
+	{
+#if FLIGHT_RECORDER_SLOTS > 0
+		if (!IsEnabled())
+		{
+			return;
+		}
+		uint64_t ticket;
+		FlightRecord& r = _claim(ticket);
+		r.fmt = fmt;
+		r.argc = 0;
+		r.text[0] = 0;
+		size_t textUsed = 0;
+		int expand[] = { 0, (_put(r, textUsed, args), 0)... };
+		(void)expand;
+		(void)textUsed;  // No args: nothing _put().
+		r.sequence.store(ticket + 1, memory_order_release);
+#else
+		(void)fmt;
+#endif
+	}
+	static bool IsEnabled(void)
+	{
+#if FLIGHT_RECORDER_SLOTS > 0
+		return m_enabled.load(memory_order_relaxed);
+#else
+		return false;
+#endif
+	}
+	static void SetEnabled(bool enabled);
+	// Opens FLIGHT_RECORDER_CRASH_FILE, installs the signal handlers
+	// (and an alternate stack for the calling thread) and enables
+	// recording.
+	static bool InstallCrashHandler(void);
+	// An alternate signal stack for the calling thread, freed when it
+	// exits; call first thing in a thread's procedure.
+	static void InstallAltStack(void);
+	// Async-signal-safe: writes the ring, oldest first, to 'fd'.
+	static void Dump(int fd);
+private:
+	static FlightRecord& _claim(uint64_t& ticket);
+	template<typename T>
+	static typename enable_if<is_integral<T>::value || is_enum<T>::value>::type
+	_put(FlightRecord& r, size_t& textUsed, T v)
+	{
+		(void)textUsed;
+		if (r.argc < FLIGHT_RECORDER_ARGS)
+		{
+			// Upper case: 64 bit, so "%x" of a negative int prints
+			// 8 digits the way printf() does.
+			r.tags[r.argc] = (sizeof(T) > 4)
+				? (is_signed<T>::value ? 'I' : 'U')
+				: (is_signed<T>::value ? 'i' : 'u');
+			r.args[r.argc++] = is_signed<T>::value
+				? (uint64_t)(int64_t)v : (uint64_t)v;
+		}
+	}
+	static void _put(FlightRecord& r, size_t& textUsed, double v)
+	{
+		(void)textUsed;
+		if (r.argc < FLIGHT_RECORDER_ARGS)
+		{
+			r.tags[r.argc] = 'd';
+			memcpy(&r.args[r.argc++], &v, sizeof(v));
+		}
+	}
+	static void _put(FlightRecord& r, size_t& textUsed, const char *s);
+	static void _put(FlightRecord& r, size_t& textUsed, char *s)
+	{
+		_put(r, textUsed, (const char *)s);
+	}
+	static void _put(FlightRecord& r, size_t& textUsed, const string& s)
+	{
+		_put(r, textUsed, s.c_str());
+	}
+	template<typename T>
+	static void _put(FlightRecord& r, size_t& textUsed, T *p)
+	{
+		(void)textUsed;
+		if (r.argc < FLIGHT_RECORDER_ARGS)
+		{
+			r.tags[r.argc] = 'U';
+			r.args[r.argc++] = (uint64_t)(uintptr_t)p;
+		}
+	}
+	static void _crashHandler(int sig, siginfo_t *info, void *context);
+	static atomic<bool> m_enabled;
+};
+
+#endif  // FLIGHT_RECORDER_H_
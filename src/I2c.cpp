@@ -8,101 +8,239 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
-#include <linux/i2c-dev.h> 
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
 
 #include "I2c.h"
+#include "Metrics.h"
+#include "SharedMemory.h"
 
-bool I2c::Open(uint8_t slave_address)
-{
-	if (!OpenDevice())
-	{
-		return false;
-	}
-
-	if (!SetSlaveAddress(slave_address))
-	{
-		Close();
-		return false;
-	}
+static MetricCounter transfers("i2c_transfers_total", "I2C transfers (I2C_RDWR ioctls)");
+static MetricCounter failures("i2c_failures_total", "I2C transfers that failed");
+static MetricCounter bytesMoved("i2c_bytes_total", "Bytes moved by successful I2C transfers");
+static MetricHistogram latency("i2c_transfer_us", "I2C transfer time, microseconds");
+static MetricCounter sharedStuck("i2c_shared_stuck_total",
+	"Bus counters not published, SharedData record held by a stuck writer");
 
-	return true;
+I2cBus& I2cBus::GetInstance(void)
+{
+	// Never deleted, see LogRing::GetInstance().
+	static I2cBus *instance = new I2cBus(I2C_BUS_DEVICE);
+	return *instance;
 }
 
-bool I2c::Close()
+I2cBus::I2cBus(const char *path)
+	: m_path(path)
 {
-	if (m_fh > 0)
-	{
-		close(m_fh);
-	}
-	return true;
 }
 
-bool I2c::OpenDevice()
+bool I2cBus::_open(void)
 {
-	// 'i2c_bus' is "/dev/i2c-1" (Gumstix, legacy...)
+	lock_guard<mutex> lock(m_openMutex);
+	if (m_fh >= 0)
+	{
+		return true;
+	}
+	// 'm_path' is "/dev/i2c-1" (Gumstix, legacy...)
 	//  Sadly we say Goodbye and Good Riddance to the stodgy, slow Gumstix platform.
 	//      NEW: is "/dev/i2c-0" (NanoPi NEO PLUS platform  [2018]
-	m_fh = open(i2c_bus, O_RDWR);
-
-	if (m_fh < 0)
+	int fh = open(m_path, O_RDWR | O_CLOEXEC);
+	if (fh < 0)
 	{
 		int myErr = errno;
 		string s("Error: Can't open I2C bus: ");
-		s += i2c_bus;
+		s += m_path;
 		s += ": ";
 		s += strerror(myErr);
-		LogErr(AT, s);
+		m_log->LogErr(AT, s);
 		return false;
 	}
-
+	m_fh.store(fh);
 	return true;
 }
 
-bool I2c::SetSlaveAddress(uint8_t address)
+bool I2cBus::Transfer(i2c_msg *msgs, int count, int *error, bool splits)
 {
-	if (m_fh < 0)
+	if (m_fh < 0 && !_open())
 	{
-		LogErr(AT, "Error: SetSlaveAddress, i2c bus is not open");
+		transfers.Add();
+		failures.Add();
+		if (error != nullptr)
+		{
+			*error = ENODEV;
+		}
 		return false;
 	}
-	// This WAS simply I2C_SLAVE
-	// (_FORCE allows userspace access if another driver has ownership).
-	if (ioctl(m_fh, I2C_SLAVE_FORCE, address) < 0)
+	i2c_rdwr_ioctl_data data;
+	data.msgs = msgs;
+	data.nmsgs = count;
+	uint64_t startUs = Metrics::NowUs();
+	// Returns the number of messages transferred.
+	bool ok = ioctl(m_fh, I2C_RDWR, &data) == count;
+	int myErr = errno;
+	latency.Observe(Metrics::NowUs() - startUs);
+	size_t bytes = 0;
+	for (int i = 0; i < count; i++)
 	{
-		int myErr = errno;
-		string s("Error: Can't set slave address: ");
-		s += strerror(myErr);
-		LogErr(AT, s);
+		bytes += msgs[i].len;
+	}
+	transfers.Add();
+	if (ok)
+	{
+		bytesMoved.Add(bytes);
+	}
+	else
+	{
+		failures.Add();
+	}
+	SharedData *shared = SharedMemory::Writable();
+	if (shared != nullptr)
+	{
+		bool published = shared->bus.Modify([&](SharedBus& bus)
+		{
+			bus.transfers++;
+			bus.failures += ok ? 0 : 1;
+			bus.bytes += ok ? bytes : 0;
+			bus.updatedMs = SharedDataNowMs();
+		});
+		if (!published)
+		{
+			sharedStuck.Add();
+		}
+	}
+	if (!ok)
+	{
+		if (error != nullptr)
+		{
+			*error = myErr;
+		}
+		if (!splits || myErr != EOPNOTSUPP)
+		{
+			LOGF_ERROR(m_log, "Error: I2C transfer to 0x%02x failed: %s",
+				msgs[0].addr, strerror(myErr));
+		}
 		return false;
 	}
+	return true;
+}
 
+bool I2cBus::WriteRegisters(uint16_t address, uint8_t reg, const uint8_t *data, size_t len,
+	size_t unit)
+{
+	uint8_t buf[I2C_MAX_MESSAGE];
+	if (unit < 1 || unit > I2C_MAX_MESSAGE - 1)
+	{
+		LOGF_ERROR(m_log, "WriteRegisters: bad unit %u", (unsigned)unit);
+		return false;
+	}
+	size_t done = 0;
+	while (done < len)
+	{
+		// Whole units; at least one even if a smaller write was
+		// refused before (the limit may have come from another unit).
+		size_t fits = (m_maxWrite.load() - 1) / unit * unit;
+		size_t chunk = min(len - done, max(fits, unit));
+		buf[0] = (uint8_t)(reg + done);
+		memcpy(buf + 1, data + done, chunk);
+		i2c_msg msg = { address, 0, (uint16_t)(chunk + 1), buf };
+		int error = 0;
+		if (Transfer(&msg, 1, &error, true))
+		{
+			done += chunk;
+			continue;
+		}
+		if (error != EOPNOTSUPP)
+		{
+			return false;
+		}
+		if (chunk <= unit)
+		{
+			LOGF_ERROR(m_log, "I2C adapter refused a %u byte write, can't"
+				" split it (unit %u bytes)", (unsigned)(chunk + 1), (unsigned)unit);
+			return false;
+		}
+		// Too long for this adapter: halve and try that part again.
+		size_t limit = max(chunk / 2 / unit, (size_t)1) * unit + 1;
+		size_t current = m_maxWrite.load();
+		while (limit < current && !m_maxWrite.compare_exchange_weak(current, limit))
+		{
+		}
+		LOGF_WARN(m_log, "I2C adapter refused a %u byte write, splitting"
+			" writes to %u bytes", (unsigned)(chunk + 1), (unsigned)m_maxWrite.load());
+	}
+	return true;
+}
+
+I2c::I2c(I2cBus& bus)
+	: m_bus(bus)
+{
+}
+
+bool I2c::Open(uint8_t slave_address)
+{
+	PROFILE_SCOPE("I2c::Open");
+	LOGF_TRACE(m_log, "Open 0x%02x", slave_address);
+	// The bus itself is opened by the first transfer and stays open.
+	m_address = slave_address;
+	return true;
+}
+
+bool I2c::Close()
+{
+	m_address = -1;
 	return true;
 }
 
 bool I2c::WriteByte(uint8_t data)
 {
-	if (write(m_fh, &data, 1) != 1)
+	PROFILE_SCOPE("I2c::WriteByte");
+	LOGF_TRACE(m_log, "WriteByte 0x%02x", data);
+	if (m_address < 0)
 	{
-		int myErr = errno;
-		string s("Error requesting I2C status: ");
-		s += strerror(myErr);
-		LogErr(AT, s);
+		m_log->LogErr(AT, "Error: WriteByte, no device Open()");
 		return false;
 	}
-	return true;
+	i2c_msg msg = { (uint16_t)m_address, 0, 1, &data };
+	return m_bus.Transfer(&msg, 1);
 }
 
 bool I2c::ReadByte(uint8_t &data)
 {
+	PROFILE_SCOPE("I2c::ReadByte");
+	if (m_address < 0)
+	{
+		m_log->LogErr(AT, "Error: ReadByte, no device Open()");
+		return false;
+	}
 	uint8_t buf;
-	if (read(m_fh, &buf, 1) != 1)
+	i2c_msg msg = { (uint16_t)m_address, I2C_M_RD, 1, &buf };
+	if (!m_bus.Transfer(&msg, 1))
 	{
-		int myErr = errno;
-		string s("Error reading I2C status: ");
-		s += strerror(myErr);
-		LogErr(AT, s);
 		return false;
 	}
 	data = buf;
+	LOGF_TRACE(m_log, "ReadByte 0x%02x", data);
+	return true;
+}
+
+bool I2c::WriteRead(const uint8_t *out, size_t outLen, uint8_t *in, size_t inLen)
+{
+	PROFILE_SCOPE("I2c::WriteRead");
+	if (m_address < 0)
+	{
+		m_log->LogErr(AT, "Error: WriteRead, no device Open()");
+		return false;
+	}
+	i2c_msg msgs[2] =
+	{
+		{ (uint16_t)m_address, 0, (uint16_t)outLen, (uint8_t *)out },
+		{ (uint16_t)m_address, I2C_M_RD, (uint16_t)inLen, in }
+	};
+	if (!m_bus.Transfer(msgs, 2))
+	{
+		return false;
+	}
+	LOGF_TRACE(m_log, "WriteRead 0x%02x: %u out, %u in", m_address,
+		(unsigned)outLen, (unsigned)inLen);
 	return true;
 }
@@ -1,34 +1,107 @@
 // I2c.h
+// I2cBus is the adapter (/dev/i2c-N): opened once and shared by every
+// device on it. I2c is one device (slave address) on that bus.
+//
+// I2c::Open() USED TO open() the adapter and set the slave address
+// with ioctl(I2C_SLAVE_FORCE) on every call, and Close() closed it
+// again. Now the adapter fd is opened on first use and stays open;
+// every transfer is one ioctl(I2C_RDWR) that carries its own slave
+// address, so devices (PwmServoDriver, BatteryChecker) on different
+// threads share the fd without any per-fd "current address" to race
+// on. Open() / Close() only select / forget the device address.
+//
+// WriteRead() is a combined transaction: write (e.g. a register
+// number), repeated start, read; nothing else on the bus can get in
+// between, unlike a WriteByte() followed by a ReadByte().
+//
+// I2cBus::WriteRegisters() writes a block of registers (e.g. all 16
+// PCA9685 channels, 64 bytes) as one message. Messages aren't split to
+// any fixed size up front, only once the adapter has refused one as
+// too long (EOPNOTSUPP: a controller quirk, e.g. a small FIFO); from
+// then on blocks go out in pieces that fit, each with its own register
+// number. A piece is a whole number of the caller's 'unit' (4 for a
+// PCA9685 channel: ON_L ON_H OFF_L OFF_H), so a channel is never half
+// written; if the adapter refuses even one unit the write fails.
 
 #ifndef I2C_H_
 #define I2C_H_
 
+#include <atomic>
 #include <iostream>
+#include <mutex>
 #include <string>
 #include <sstream>
 
+#include <stddef.h>
 #include <stdint.h>
 
-#include "Log.h"
+#include "LogHandle.h"
 
 #define SLAVE_ADDRESS   0x54
 
-class I2c : public Log
+// 2018: The new NanoPi NEO PLUS platform has ONE I2C bus, it is /dev/i2c-0:
+//       NOTE: This WAS i2c-2 in Shx 2, and ic2-1 in Gumstix original
+// /dev/i2c-1 on rpi3
+#ifndef I2C_BUS_DEVICE
+#define I2C_BUS_DEVICE "/dev/i2c-1"
+#endif
+
+// i2c-dev refuses longer messages.
+#define I2C_MAX_MESSAGE 8192
+
+struct i2c_msg;
+
+class I2cBus
+{
+public:
+	// The I2C_BUS_DEVICE adapter.
+	static I2cBus& GetInstance(void);
+	const char *Path(void) const { return m_path; }
+	// One ioctl(I2C_RDWR): 'msgs' go out back to back with repeated
+	// starts. Opens the adapter the first time. 'error' (optional):
+	// errno on failure, e.g. ENXIO when nothing answers the address.
+	// 'splits': the caller splits a message the adapter refuses as too
+	// long (EOPNOTSUPP) and reports it; don't log that as an error.
+	bool Transfer(i2c_msg *msgs, int count, int *error = nullptr, bool splits = false);
+	// 'data' to registers 'reg', 'reg' + 1, ... of the device at
+	// 'address' (which must auto increment). If it has to be split,
+	// only at multiples of 'unit' bytes.
+	bool WriteRegisters(uint16_t address, uint8_t reg, const uint8_t *data, size_t len,
+		size_t unit = 1);
+	// Longest write (register number included) the adapter has not
+	// refused; I2C_MAX_MESSAGE until it refuses one.
+	size_t GetMaxWrite(void) const { return m_maxWrite.load(); }
+private:
+	explicit I2cBus(const char *path);
+	I2cBus(I2cBus const& copy);  // Not allowed
+	I2cBus& operator=(I2cBus const& copy);  // Not allowed
+	bool _open(void);
+	const char *m_path;
+	mutex m_openMutex;
+	atomic<int> m_fh{-1};
+	atomic<size_t> m_maxWrite{I2C_MAX_MESSAGE};
+	LogHandle m_log{"I2c"};
+};
+
+class I2c
 {
 public:
-	I2c() { SetLogName("I2c"); }
+	explicit I2c(I2cBus& bus = I2cBus::GetInstance());
 	bool Open(uint8_t slave_address);
 	bool Close();
 	bool WriteByte(uint8_t data);
 	bool ReadByte(uint8_t &data);
+	// Write 'out', repeated start, read 'inLen' bytes into 'in'.
+	bool WriteRead(const uint8_t *out, size_t outLen, uint8_t *in, size_t inLen);
+	bool ReadRegister(uint8_t reg, uint8_t &value)
+	{
+		return WriteRead(&reg, 1, &value, 1);
+	}
+	I2cBus& Bus(void) const { return m_bus; }
 private:
-	// 2018: The new NanoPi NEO PLUS platform has ONE I2C bus, it is /dev/i2c-0:
-	//       NOTE: This WAS i2c-2 in Shx 2, and ic2-1 in Gumstix original
-	// /dev/i2c-1 on rpi3
-	const char *i2c_bus = "/dev/i2c-1";
-	int m_fh = -1;
-	bool OpenDevice();
-	bool SetSlaveAddress(uint8_t address);
+	I2cBus& m_bus;
+	int m_address = -1;  // -1: not Open()
+	LogHandle m_log{"I2c"};
 };
 
 #endif // __I2C_BUS_H__
@@ -4,9 +4,9 @@
 // For this reason define the LOGFILE_NAME=xxx in the MAKEFILE
 // for each individual project. (USED TO BE #define'd in here).
 
-// NB: For GetStackTrace() to work properly, *MUST*
+// NB: For GetStackTrace() / LogErrWithStack() to work properly, *MUST*
 // include '-rdynamic' in CFLAGS in Makefile and then this
-// will showfunc name, else just shows 'lanshark_2..._bin() [0x(ofst)]
+// will showfunc name, else just shows 'module : ?'.
 
 #ifndef LOG_H_
 #define LOG_H_
@@ -18,7 +18,7 @@
 #include <cstring>
 #include <fstream>
 #include <vector>
-#include <mutex>
+#include <atomic>
 
 #include <cstdio>
 
@@ -34,7 +34,17 @@
 #include <execinfo.h>
 #include <cxxabi.h>
 #include <time.h>
+#include <sys/syscall.h>
 
+#include "FlightRecorder.h"
+#include "LogBinary.h"
+#include "LogFile.h"
+#include "LogRateLimiter.h"
+#include "LogRing.h"
+#include "LogSink.h"
+#include "PendingMessages.h"
+#include "Profile.h"
+#include "StackTrace.h"
 #include "TextColor.h"
 
 using namespace std;
@@ -59,8 +69,121 @@ using namespace std;
 
 #endif
 
+#ifndef MAX_LOG_FILE_SIZE
 #define MAX_LOG_FILE_SIZE 65535
 #define KEEP_LAST_LOG_SIZE 32767
+#endif
+
+// Binary mode (see LogBinary.h) writes here instead. When it reaches
+// MAX_BINARY_LOG_SIZE it is renamed to LOG_BINARY_FILE ".1", so the
+// two together use about the same flash as the text log.
+#ifndef LOG_BINARY_FILE
+#define LOG_BINARY_FILE LOGFILE_NAME ".bin"
+#endif
+#ifndef MAX_BINARY_LOG_SIZE
+#define MAX_BINARY_LOG_SIZE KEEP_LAST_LOG_SIZE
+#endif
+
+// FlightRecorder::InstallCrashHandler() appends crash dumps here.
+#ifndef FLIGHT_RECORDER_CRASH_FILE
+#define FLIGHT_RECORDER_CRASH_FILE LOGFILE_NAME ".crash"
+#endif
+
+// Severity levels. Plain #defines (not only an enum) so that
+// LOG_COMPILE_MIN_LEVEL can be set from the makefile, e.g.
+// -DLOG_COMPILE_MIN_LEVEL=LOG_LEVEL_INFO compiles out every
+// LOG_TRACE() / LOG_DEBUG() call site entirely.
+#define LOG_LEVEL_TRACE 0
+#define LOG_LEVEL_DEBUG 1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_WARN  3
+#define LOG_LEVEL_ERROR 4
+#define LOG_LEVEL_OFF   5
+
+#ifndef LOG_COMPILE_MIN_LEVEL
+#define LOG_COMPILE_MIN_LEVEL LOG_LEVEL_TRACE
+#endif
+
+// Runtime threshold for owners that haven't been given one;
+// the environment variable LOG_LEVEL overrides it, either for every
+// owner ("LOG_LEVEL=debug") or per owner
+// ("LOG_LEVEL=info,I2c=trace,PwmServoDriver=debug").
+#ifndef LOG_DEFAULT_LEVEL
+#define LOG_DEFAULT_LEVEL LOG_LEVEL_INFO
+#endif
+
+enum LogLevel
+{
+	LogLevelTrace = LOG_LEVEL_TRACE,
+	LogLevelDebug = LOG_LEVEL_DEBUG,
+	LogLevelInfo = LOG_LEVEL_INFO,
+	LogLevelWarn = LOG_LEVEL_WARN,
+	LogLevelError = LOG_LEVEL_ERROR,
+	LogLevelOff = LOG_LEVEL_OFF
+};
+
+// Leveled logging with lazy arguments. 'expr' is anything that can
+// be streamed into a stringstream:
+//     LOG_TRACE(m_log, "WriteByte 0x" << hex << (int)data);
+// Nothing in 'expr' is evaluated unless the level is compiled in
+// AND the owner's runtime threshold lets it through (one relaxed
+// atomic load).
+// Warnings and errors are also rate limited per call site (see
+// LogRateLimiter.h) before 'expr' is evaluated.
+#define LOG_AT_LEVEL(log, level, expr) do { \
+	if ((level) >= LOG_COMPILE_MIN_LEVEL && (log).IsEnabled(level) \
+		&& (log).PassesRateLimit((LogLevel)(level), AT)) \
+	{ \
+		stringstream log_ss_; \
+		log_ss_ << expr; \
+		(log).Emit((LogLevel)(level), AT, log_ss_.str().c_str()); \
+	} \
+} while (0)
+
+#define LOG_TRACE(log, expr) LOG_AT_LEVEL(log, LOG_LEVEL_TRACE, expr)
+#define LOG_DEBUG(log, expr) LOG_AT_LEVEL(log, LOG_LEVEL_DEBUG, expr)
+#define LOG_INFO(log, expr)  LOG_AT_LEVEL(log, LOG_LEVEL_INFO, expr)
+#define LOG_WARN(log, expr)  LOG_AT_LEVEL(log, LOG_LEVEL_WARN, expr)
+#define LOG_ERROR(log, expr) LOG_AT_LEVEL(log, LOG_LEVEL_ERROR, expr)
+
+// printf-style leveled logging that can use binary mode:
+//     LOGF_TRACE(m_log, "WriteByte 0x%02x", data);
+// Arguments must be printf-compatible (no std::string). Same rate
+// limiting as LOG_AT_LEVEL(); in binary mode the arguments are stored
+// raw and never formatted on the device.
+// A call filtered out by level or rate limit still goes into the
+// in-RAM flight recorder if that is enabled (see FlightRecorder.h),
+// raw, never formatted; otherwise its arguments are not evaluated, as
+// with LOG_AT_LEVEL(). EmitF() records the ones that get through.
+#if FLIGHT_RECORDER_SLOTS > 0
+#define LOGF_RECORD(fmt, ...) do { \
+	if (FlightRecorder::IsEnabled()) \
+	{ \
+		FlightRecorder::Record(fmt, ##__VA_ARGS__); \
+	} \
+} while (0)
+#else
+#define LOGF_RECORD(fmt, ...) do { } while (0)
+#endif
+
+#define LOGF_AT_LEVEL(log, level, fmt, ...) do { \
+	if ((level) >= LOG_COMPILE_MIN_LEVEL && (log).IsEnabled(level) \
+		&& (log).PassesRateLimit((LogLevel)(level), AT)) \
+	{ \
+		static LogFormat log_format_ = { fmt, AT, (level), { 0 } }; \
+		(log).EmitF(log_format_, ##__VA_ARGS__); \
+	} \
+	else \
+	{ \
+		LOGF_RECORD(fmt, ##__VA_ARGS__); \
+	} \
+} while (0)
+
+#define LOGF_TRACE(log, fmt, ...) LOGF_AT_LEVEL(log, LOG_LEVEL_TRACE, fmt, ##__VA_ARGS__)
+#define LOGF_DEBUG(log, fmt, ...) LOGF_AT_LEVEL(log, LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+#define LOGF_INFO(log, fmt, ...)  LOGF_AT_LEVEL(log, LOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+#define LOGF_WARN(log, fmt, ...)  LOGF_AT_LEVEL(log, LOG_LEVEL_WARN, fmt, ##__VA_ARGS__)
+#define LOGF_ERROR(log, fmt, ...) LOGF_AT_LEVEL(log, LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
 
 enum LogInfoColors
 {
@@ -72,62 +195,108 @@ enum LogInfoColors
 	LogInfoWhite
 };
 
-// ALL Log instances have access to the list of "Pending Messages
-// waiting to be written. Please put a mutex around access to this.
-class PendingMessages
-{
-private:
-	PendingMessages() { }
-	PendingMessages(PendingMessages const& copy);  // Not allowed
-	PendingMessages& operator=(PendingMessages const& copy);  // Not allowed
-	vector<string>m_pendingMessages;
-	static PendingMessages *m_instance;
-public:
-	vector<string>& GetPending(void)
-	{
-		return m_pendingMessages;
-	}
-
-	static PendingMessages *GetInstance(void)
-	{
-		if (m_instance == nullptr)
-		{
-			m_instance = new PendingMessages();
-		}
-		return m_instance;
-	}
-};
-
 class Log
 {
 public:
 	Log(const char *owner);
 	Log();
 	void SetLogName(const char *owner);
+	const string& GetLogName(void) const { return m_logOwnerName; }  // "xyz: "
 	void LogErr(const char *at, int errnum);
 	void LogErr(const char *at, const char *msg, int errnum);
 	void LogErr(const char *at, const char *msg);
 	void LogErr(const char *at, const string& msg);
 	void LogErr(const char *at, const stringstream& msg);
+	// Error line followed by the caller's stack trace. Cheap for the
+	// caller: the trace is symbolized and logged by a background thread.
+	void LogErrWithStack(const char *at, const char *msg);
 	void LogInfo(const char *msg);
 	void LogInfo(const string& msg);
 	void LogInfo(const stringstream& msg);
+	void LogAt(LogLevel level, const char *at, const char *msg);
+	void LogAt(LogLevel level, const char *at, const string& msg);
+	void LogAt(LogLevel level, const char *at, const stringstream& msg);
+	bool IsEnabled(int level) const
+	{
+		return level >= m_level.load(memory_order_relaxed);
+	}
+	void SetLevel(LogLevel level);
+	// "trace" ... "off" (any case) to LOG_LEVEL_xxx.
+	static bool LevelFromName(const char *name, int& level);
+	// For LOG_AT_LEVEL(): warnings and errors from the same 'at' are
+	// limited to LOG_RATE_BURST per LOG_RATE_WINDOW_MS. If lines were
+	// suppressed, logs the "repeated N times" summary before returning.
+	bool PassesRateLimit(LogLevel level, const char *at);
+	// Logs the summaries of call sites that have gone quiet since
+	// their lines were suppressed (every one if 'all'). Run every
+	// LOG_RATE_WINDOW_MS by a Scheduler task, and at exit.
+	static void FlushRateLimited(bool all = false);
+	// Logs unconditionally; caller has already checked the level
+	// and the rate limit.
+	void Emit(LogLevel level, const char *at, const char *msg)
+	{
+		_logIt(msg, at, level);
+	}
+	// For LOGF_AT_LEVEL(): binary record or snprintf()'d text line.
+	template<typename... Args>
+	void EmitF(LogFormat& format, Args... args)
+	{
+		// Raw, before it is formatted (so _logIt() doesn't).
+		FlightRecorder::Record(format.fmt, args...);
+		if (LogBinary::IsEnabled())
+		{
+			LogBinaryRecord r(LogBinaryMessage, format.level);
+			uint16_t fmtId = LogBinary::FormatId(format);
+			uint16_t ownerId = _binaryOwnerId();
+			uint32_t tid = ThreadId();
+			uint64_t seq = _nextSequence();
+			timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			uint64_t ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+			r.PutRaw(&fmtId, sizeof(fmtId));
+			r.PutRaw(&ownerId, sizeof(ownerId));
+			r.PutRaw(&tid, sizeof(tid));
+			r.PutRaw(&seq, sizeof(seq));
+			r.PutRaw(&ns, sizeof(ns));
+			logBinaryPutArgs(r, args...);
+			r.Finish();
+			LogBinary::Write(r);
+			return;
+		}
+		char msg[LOG_RING_TEXT_LEN];
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-security"
+		snprintf(msg, sizeof(msg), format.fmt, args...);
+#pragma GCC diagnostic pop
+		_logIt(msg, format.at, (LogLevel)format.level, false);
+	}
 	void LogHeader(const char *header_msg, LogInfoColors blockColor);
 	void LogEndHeader(void);
 	const string GetStackTrace(const char *who);
+	// "mm/dd/yy hh:mm:ss.dddd: "
+	static void FillTime(char *buf);
+	// Kernel thread id (gettid()), cached per thread.
+	static uint32_t ThreadId(void);
 protected:
 	string m_logOwnerName;
 private:
-	int m_sequenceNumber = 0;
 	LogInfoColors m_infoColor = LogInfoColors::LogInfoYellow;
-	bool m_isInited = false;
-	struct flock m_flock;
-	void _initFlock(void);
-	int _open();
-	bool _close(int fd);
-	void FillTime(char *buf);
-	void _logIt(const char *msg, const char *at, bool isAnError);
-	mutex m_mutex;
+	atomic<int> m_level;
+	atomic<uint32_t> m_binaryOwnerId;
+	uint16_t _binaryOwnerId(void);
+	// LogOwners id + 1 (0: not looked up yet), for FlushRateLimited().
+	atomic<uint32_t> m_handleId;
+	uint16_t _handleId(void);
+	void _logRepeats(const char *at, LogLevel level, uint32_t count, int64_t sinceMs);
+	static void _startRateFlush(void);
+	static void _rateFlushAtExit(void);
+	static void _rateFlushAtForkChild(void);
+	static uint64_t _nextSequence(void);
+	// 'record': also put the line in the flight recorder (LOGF_*()
+	// calls already did).
+	void _logIt(const char *msg, const char *at, LogLevel level,
+		bool record = true);
+	void _levelFromEnvironment(const char *owner);
 	static const constexpr char* const m_infoColors[] =
 	{
 		TEXT_YELLOW,
@@ -0,0 +1,285 @@
+// LogArchive.cpp
+
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <zlib.h>
+
+#include "Log.h"
+#include "LogArchive.h"
+#include "Metrics.h"
+
+static MetricCounter archiveDropped("log_archive_dropped_total",
+	"Chunks of rotated log history not archived");
+
+LogArchive& LogArchive::GetInstance(void)
+{
+	// Never deleted, see LogRing::GetInstance().
+	static LogArchive *instance = new LogArchive();
+	return *instance;
+}
+
+LogArchive::LogArchive()
+	: m_compressorStarted(false), m_keepRunning(true), m_dropped(0)
+{
+	pthread_atfork(nullptr, nullptr, _atForkChild);
+}
+
+string LogArchive::GenerationPath(int generation)
+{
+	return string(LogFile::Path()) + "." + to_string(generation) + ".gz";
+}
+
+string LogArchive::IndexPath(int generation)
+{
+	return GenerationPath(generation) + LOG_INDEX_SUFFIX;
+}
+
+bool LogArchive::Add(const char *data, size_t len)
+{
+	if (!IsEnabled() || len == 0)
+	{
+		return false;
+	}
+	if (!m_compressorStarted.load(memory_order_acquire))
+	{
+		_startCompressor();
+	}
+	{
+		lock_guard<mutex> lock(m_mutex);
+		// Checked under the lock: _atExit() stops the compressor under
+		// it too, and nothing queued after that would be compressed.
+		if (!m_keepRunning.load(memory_order_acquire))
+		{
+			// Trimmed by LogRing's _atExit() after ours stopped the
+			// compressor: do it myself.
+			vector<char> chunk(data, data + len);
+			vector<char> gz;
+			return _archive(chunk, gz);
+		}
+		if (m_queue.size() >= LOG_ARCHIVE_QUEUE_CHUNKS)
+		{
+			m_dropped.fetch_add(1, memory_order_relaxed);
+			archiveDropped.Add();
+			return false;
+		}
+		m_queue.emplace_back(data, data + len);
+	}
+	m_wakeup.notify_one();
+	return true;
+}
+
+uint64_t LogArchive::GetDroppedCount(void) const
+{
+	return m_dropped.load(memory_order_relaxed);
+}
+
+void LogArchive::_startCompressor(void)
+{
+	static mutex startMutex;
+	lock_guard<mutex> lock(startMutex);
+	if (m_compressorStarted.load(memory_order_relaxed))
+	{
+		return;
+	}
+	// LogRing registers its atexit() handler first, so ours runs
+	// before the ring's final drain (which can still trim).
+	LogRing::GetInstance();
+	static int atExitInstalled = atexit(_atExit);
+	(void)atExitInstalled;
+	m_compressor = thread(&LogArchive::_compressorThreadProc, this);
+	m_compressorStarted.store(true, memory_order_release);
+}
+
+void LogArchive::_compressorThreadProc(void)
+{
+	FlightRecorder::InstallAltStack();
+	// Linux: setpriority() on a TID affects only this thread.
+	setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), LOG_ARCHIVE_NICE);
+	vector<char> gz;
+	uint64_t droppedReported = 0;
+	for (;;)
+	{
+		vector<char> chunk;
+		{
+			unique_lock<mutex> lock(m_mutex);
+			m_wakeup.wait(lock, [this]()
+			{
+				return !m_queue.empty()
+					|| !m_keepRunning.load(memory_order_acquire);
+			});
+			if (m_queue.empty())
+			{
+				break;  // Stopping, and nothing left.
+			}
+			chunk.swap(m_queue.front());
+			m_queue.pop_front();
+		}
+		uint64_t dropped = m_dropped.load(memory_order_relaxed);
+		if (dropped != droppedReported)
+		{
+			// Say where history is missing, as a whole log line so
+			// the index and logquery see it.
+			char timeNow[128];
+			Log::FillTime(timeNow);
+			char note[256];
+			int n = snprintf(note, sizeof(note),
+				"<E> LogArchive: %03llu TID: %u PID: %d PPID: %d %s"
+				"%llu chunk(s) of history dropped, compressor behind\r\n",
+				(unsigned long long)LogRing::GetInstance().NextSequence(),
+				Log::ThreadId(), (int)getpid(), (int)getppid(), timeNow,
+				(unsigned long long)(dropped - droppedReported));
+			chunk.insert(chunk.begin(), note, note + n);
+			droppedReported = dropped;
+		}
+		_archive(chunk, gz);
+	}
+}
+
+// Compresses, indexes and appends one chunk. 'gz' is scratch.
+bool LogArchive::_archive(const vector<char>& chunk, vector<char>& gz)
+{
+	if (!_compress(chunk, gz))
+	{
+		m_dropped.fetch_add(1, memory_order_relaxed);
+		archiveDropped.Add();
+		return false;
+	}
+	LogIndexEntry entry;
+	LogIndex::Build(chunk.data(), chunk.size(), entry);
+	_append(gz, entry);
+	return true;
+}
+
+// One complete gzip member, so chunks appended by different processes
+// (or cut short by a power failure) never corrupt each other.
+bool LogArchive::_compress(const vector<char>& chunk, vector<char>& gz)
+{
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	// 15 + 16: 32 KB window, gzip header and trailer.
+	if (deflateInit2(&z, LOG_ARCHIVE_LEVEL, Z_DEFLATED, 15 + 16, 8,
+		Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		return false;
+	}
+	gz.resize(deflateBound(&z, chunk.size()));
+	z.next_in = (Bytef *)chunk.data();
+	z.avail_in = chunk.size();
+	z.next_out = (Bytef *)gz.data();
+	z.avail_out = gz.size();
+	int rv = deflate(&z, Z_FINISH);
+	gz.resize(z.total_out);
+	deflateEnd(&z);
+	return rv == Z_STREAM_END;
+}
+
+// Opens and flock()s generation 1, making sure it is still the file at
+// that path (another process may have rotated it meanwhile).
+int LogArchive::_openLocked(void)
+{
+	string path = GenerationPath(1);
+	for (int tries = 0; tries < 8; tries++)
+	{
+		int fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+			S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+		if (fd < 0)
+		{
+			return -1;
+		}
+		while (flock(fd, LOCK_EX) != 0 && errno == EINTR)
+		{
+		}
+		struct stat opened;
+		struct stat named;
+		if (fstat(fd, &opened) == 0 && stat(path.c_str(), &named) == 0
+			&& opened.st_ino == named.st_ino && opened.st_dev == named.st_dev)
+		{
+			return fd;
+		}
+		close(fd);
+	}
+	return -1;
+}
+
+void LogArchive::_append(const vector<char>& gz, LogIndexEntry& entry)
+{
+	int fd = _openLocked();
+	if (fd < 0)
+	{
+		m_dropped.fetch_add(1, memory_order_relaxed);
+		archiveDropped.Add();
+		return;
+	}
+	entry.offset = lseek(fd, 0, SEEK_END);
+	entry.length = gz.size();
+	if (write(fd, gz.data(), gz.size()) == (ssize_t)gz.size())
+	{
+		// Under the same lock, so entries stay in member order. A
+		// member without an entry (power failure in between) is
+		// still found by a reader that scans the .gz itself.
+		int idx = open(IndexPath(1).c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+			S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+		if (idx >= 0)
+		{
+			write(idx, &entry, sizeof(entry));
+			close(idx);
+		}
+	}
+	off_t size = lseek(fd, 0, SEEK_END);
+	if (size >= LOG_ARCHIVE_GENERATION_SIZE)
+	{
+		// Still holding the lock on generation 1.
+		_rotate();
+	}
+	close(fd);
+}
+
+// .N-1.gz -> .N.gz ... .1.gz -> .2.gz; the oldest is replaced.
+void LogArchive::_rotate(void)
+{
+	for (int n = LOG_ARCHIVE_GENERATIONS; n > 1; n--)
+	{
+		rename(GenerationPath(n - 1).c_str(), GenerationPath(n).c_str());
+		rename(IndexPath(n - 1).c_str(), IndexPath(n).c_str());
+	}
+	if (LOG_ARCHIVE_GENERATIONS == 1)
+	{
+		unlink(GenerationPath(1).c_str());
+		unlink(IndexPath(1).c_str());
+	}
+}
+
+void LogArchive::_atExit(void)
+{
+	// Compress whatever is still queued before the process goes away.
+	LogArchive& archive = GetInstance();
+	if (!archive.m_compressorStarted.load(memory_order_acquire))
+	{
+		return;
+	}
+	{
+		lock_guard<mutex> lock(archive.m_mutex);
+		archive.m_keepRunning.store(false, memory_order_release);
+	}
+	archive.m_wakeup.notify_one();
+	if (archive.m_compressor.joinable())
+	{
+		archive.m_compressor.join();
+	}
+}
+
+void LogArchive::_atForkChild(void)
+{
+	LogArchive& archive = GetInstance();
+	// The compressor thread doesn't exist in the child; forget it
+	// without joining. The parent compresses what it queued.
+	new (&archive.m_compressor) thread();
+	new (&archive.m_mutex) mutex();
+	new (&archive.m_wakeup) condition_variable();
+	archive.m_queue.clear();
+	archive.m_compressorStarted.store(false, memory_order_relaxed);
+	archive.m_keepRunning.store(true, memory_order_relaxed);
+}
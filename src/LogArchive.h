@@ -0,0 +1,96 @@
+// LogArchive.h
+// Compressed history of what LogFile trims off the log file.
+//
+// LogFile::_trim() USED TO throw away everything but the last
+// KEEP_LAST_LOG_SIZE bytes whenever the file passed MAX_LOG_FILE_SIZE,
+// so there was never more than ~64 KB of history. The cap is about
+// flash, not CPU, and log text compresses ~8-10x. Now the trimmed
+// head is handed to LogArchive, and a low priority thread gzip's it
+// (zlib, one gzip member per chunk) onto the end of
+//     LOGFILE_NAME ".1.gz"
+// When that passes LOG_ARCHIVE_GENERATION_SIZE it becomes ".2.gz",
+// and so on; the oldest of LOG_ARCHIVE_GENERATIONS is deleted. With
+// the defaults that is ~512 KB of flash for several MB of history.
+// Everything, oldest first:
+//     zcat i2c.log.4.gz i2c.log.3.gz i2c.log.2.gz i2c.log.1.gz; cat i2c.log
+// LogFile trims just after a line end, so every chunk holds whole
+// lines. Each one is indexed in LOGFILE_NAME ".1.gz.idx" (see
+// LogIndex.h); tools/logquery uses that to inflate only the chunks
+// that can match a time range / owner.
+//
+// Adding a chunk only copies it into a short queue; a logger never
+// waits for the compressor. If the queue is full the chunk is dropped
+// and counted, and the next chunk archived starts with a line saying
+// so. Any process that trims can archive; the archive file
+// itself is flock()ed while a chunk is appended or generations rotate.
+//
+// Set LOG_ARCHIVE_GENERATIONS to 0 to trim the old way.
+
+#ifndef LOG_ARCHIVE_H_
+#define LOG_ARCHIVE_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+
+#include "LogIndex.h"
+
+using namespace std;
+
+#ifndef LOG_ARCHIVE_GENERATIONS
+#define LOG_ARCHIVE_GENERATIONS 4
+#endif
+// Compressed bytes per generation file.
+#ifndef LOG_ARCHIVE_GENERATION_SIZE
+#define LOG_ARCHIVE_GENERATION_SIZE (128 * 1024)
+#endif
+// Chunks (~KEEP_LAST_LOG_SIZE each) waiting for the compressor.
+#define LOG_ARCHIVE_QUEUE_CHUNKS 4
+// zlib level, 1 (fast) .. 9 (small).
+#define LOG_ARCHIVE_LEVEL 6
+// The compressor runs at this nice value:
+#define LOG_ARCHIVE_NICE 19
+
+class LogArchive
+{
+public:
+	static LogArchive& GetInstance(void);
+	static bool IsEnabled(void) { return LOG_ARCHIVE_GENERATIONS > 0; }
+	// Queues a copy of 'len' bytes trimmed off the log file. Never
+	// blocks on the compressor; returns false if the chunk was dropped.
+	bool Add(const char *data, size_t len);
+	// Chunks dropped because the queue was full (or zlib failed).
+	uint64_t GetDroppedCount(void) const;
+	// LogFile::Path() ".<generation>.gz"
+	static string GenerationPath(int generation);
+	// GenerationPath() LOG_INDEX_SUFFIX
+	static string IndexPath(int generation);
+private:
+	LogArchive();
+	LogArchive(LogArchive const& copy);  // Not allowed
+	LogArchive& operator=(LogArchive const& copy);  // Not allowed
+	void _startCompressor(void);
+	void _compressorThreadProc(void);
+	bool _archive(const vector<char>& chunk, vector<char>& gz);
+	bool _compress(const vector<char>& chunk, vector<char>& gz);
+	void _append(const vector<char>& gz, LogIndexEntry& entry);
+	int _openLocked(void);
+	void _rotate(void);
+	static void _atExit(void);
+	static void _atForkChild(void);
+	mutex m_mutex;  // m_queue
+	condition_variable m_wakeup;
+	deque<vector<char>> m_queue;
+	thread m_compressor;
+	atomic<bool> m_compressorStarted;
+	atomic<bool> m_keepRunning;
+	atomic<uint64_t> m_dropped;
+};
+
+#endif  // LOG_ARCHIVE_H_
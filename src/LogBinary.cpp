@@ -0,0 +1,239 @@
+// LogBinary.cpp
+
+#include <mutex>
+#include <set>
+#include <vector>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/file.h>
+
+#include "Log.h"
+#include "LogBinary.h"
+
+atomic<bool> LogBinary::m_enabled(getenv("LOG_BINARY") != nullptr
+	&& strcmp(getenv("LOG_BINARY"), "0") != 0);
+
+// Registration only happens once per call site / owner / process,
+// a plain mutex is fine for it.
+static mutex registerMutex;
+static atomic<uint32_t> nextFormatId(1);
+static atomic<uint32_t> nextOwnerId(1);
+static atomic<uint32_t> cachedPid(0);
+static atomic<uint32_t> processRecordPid(0);
+
+static void resetPidInChild(void)
+{
+	cachedPid.store(0, memory_order_relaxed);
+}
+
+LogBinaryRecord::LogBinaryRecord(LogBinaryRecordType type, int level)
+{
+	LogBinaryHeader *h = reinterpret_cast<LogBinaryHeader *>(m_buf);
+	h->length = 0;
+	h->type = (uint8_t)type;
+	h->level = (uint8_t)level;
+	h->pid = LogBinary::Pid();
+	m_used = sizeof(LogBinaryHeader);
+}
+
+void LogBinaryRecord::PutRaw(const void *p, size_t n)
+{
+	if (m_used + n > sizeof(m_buf))
+	{
+		m_truncated = true;
+		n = sizeof(m_buf) - m_used;
+	}
+	memcpy(m_buf + m_used, p, n);
+	m_used += n;
+}
+
+void LogBinaryRecord::Put(const char *s)
+{
+	if (s == nullptr)
+	{
+		s = "(null)";
+	}
+	size_t n = strnlen(s, LOG_BINARY_MAX_STRING);
+	uint16_t len = (uint16_t)n;
+	if (m_used + 1 + sizeof(len) + n > sizeof(m_buf))
+	{
+		m_truncated = true;
+		return;
+	}
+	m_buf[m_used++] = 's';
+	memcpy(m_buf + m_used, &len, sizeof(len));
+	m_used += sizeof(len);
+	memcpy(m_buf + m_used, s, n);
+	m_used += n;
+}
+
+void LogBinaryRecord::Finish(void)
+{
+	reinterpret_cast<LogBinaryHeader *>(m_buf)->length = (uint16_t)m_used;
+}
+
+void LogBinary::SetEnabled(bool enabled)
+{
+	m_enabled.store(enabled, memory_order_relaxed);
+}
+
+uint32_t LogBinary::Pid(void)
+{
+	uint32_t pid = cachedPid.load(memory_order_relaxed);
+	if (pid == 0)
+	{
+		static int atForkInstalled =
+			pthread_atfork(nullptr, nullptr, resetPidInChild);
+		(void)atForkInstalled;
+		pid = (uint32_t)getpid();
+		cachedPid.store(pid, memory_order_relaxed);
+	}
+	return pid;
+}
+
+// Caller holds registerMutex.
+void LogBinary::_ensureProcessRecord(void)
+{
+	uint32_t pid = Pid();
+	if (processRecordPid.load(memory_order_relaxed) == pid)
+	{
+		return;
+	}
+	processRecordPid.store(pid, memory_order_relaxed);
+	// A fork()ed child keeps its parent's format and owner ids; the
+	// decoder follows 'ppid' to find their definitions.
+	LogBinaryRecord r(LogBinaryProcess, 0);
+	uint32_t ppid = (uint32_t)getppid();
+	r.PutRaw(&ppid, sizeof(ppid));
+	r.Finish();
+	Write(r);
+}
+
+uint16_t LogBinary::FormatId(LogFormat& format)
+{
+	uint32_t id = format.id.load(memory_order_acquire);
+	if (id != 0)
+	{
+		return (uint16_t)id;
+	}
+	lock_guard<mutex> lock(registerMutex);
+	id = format.id.load(memory_order_relaxed);
+	if (id == 0)
+	{
+		_ensureProcessRecord();
+		id = nextFormatId.fetch_add(1, memory_order_relaxed);
+		LogBinaryRecord r(LogBinaryFormat, format.level);
+		uint16_t fmtId = (uint16_t)id;
+		uint16_t atLength = (uint16_t)strlen(format.at);
+		r.PutRaw(&fmtId, sizeof(fmtId));
+		r.PutRaw(&atLength, sizeof(atLength));
+		r.PutRaw(format.at, atLength);
+		r.PutRaw(format.fmt, strlen(format.fmt));
+		r.Finish();
+		Write(r);
+		// Published only after the definition is in the stream, so
+		// no other thread can log a message that uses it first.
+		format.id.store(id, memory_order_release);
+	}
+	return (uint16_t)id;
+}
+
+uint16_t LogBinary::RegisterOwner(const string& name)
+{
+	lock_guard<mutex> lock(registerMutex);
+	_ensureProcessRecord();
+	uint16_t id = (uint16_t)nextOwnerId.fetch_add(1, memory_order_relaxed);
+	LogBinaryRecord r(LogBinaryOwner, 0);
+	r.PutRaw(&id, sizeof(id));
+	r.PutRaw(name.c_str(), name.length());
+	r.Finish();
+	Write(r);
+	return id;
+}
+
+void LogBinary::Write(const LogBinaryRecord& record)
+{
+	if (LogRing::GetInstance().Append(record.Data(), record.Length(),
+			LogRingBinary))
+	{
+		return;
+	}
+	// No ring (or it is full): write it myself.
+	WriteToFile(record.Data(), record.Length());
+}
+
+// Every 'P', 'O' and 'F' record that has gone to the file, so each
+// new generation can start with them. Bounded by the number of call
+// sites and owners (times processes), not by traffic.
+static mutex definitionsMutex;
+static set<string> definitionSet;
+static vector<string> definitions;
+
+void LogBinary::_rememberDefinitions(const char *records, size_t len)
+{
+	size_t pos = 0;
+	while (pos + sizeof(LogBinaryHeader) <= len)
+	{
+		const LogBinaryHeader *h =
+			reinterpret_cast<const LogBinaryHeader *>(records + pos);
+		if (h->length < sizeof(LogBinaryHeader) || pos + h->length > len)
+		{
+			break;
+		}
+		if (h->type != LogBinaryMessage)
+		{
+			string def(records + pos, h->length);
+			if (definitionSet.insert(def).second)
+			{
+				definitions.push_back(def);
+			}
+		}
+		pos += h->length;
+	}
+}
+
+void LogBinary::WriteToFile(const char *records, size_t len)
+{
+	lock_guard<mutex> lock(definitionsMutex);
+	_rememberDefinitions(records, len);
+
+	int fd = open(LOG_BINARY_FILE, O_RDWR | O_APPEND | O_CREAT,
+				S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+	if (fd < 0)
+	{
+		return;
+	}
+	// flock(), not fcntl(): the fallback path in other processes may
+	// be writing too, and nobody else uses fcntl() on this file.
+	flock(fd, LOCK_EX);
+	off_t size = lseek(fd, 0, SEEK_END);
+	if (size > MAX_BINARY_LOG_SIZE)
+	{
+		// Keep one previous generation. Records never straddle the
+		// cut, unlike the text log's "keep the last 32 KB".
+		rename(LOG_BINARY_FILE, LOG_BINARY_FILE ".1");
+		flock(fd, LOCK_UN);
+		close(fd);
+		fd = open(LOG_BINARY_FILE, O_RDWR | O_APPEND | O_CREAT,
+				S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+		if (fd < 0)
+		{
+			return;
+		}
+		flock(fd, LOCK_EX);
+		size = lseek(fd, 0, SEEK_END);
+	}
+	if (size == 0)
+	{
+		string head(LOG_BINARY_MAGIC);
+		for (auto &def : definitions)
+		{
+			head += def;
+		}
+		write(fd, head.data(), head.length());
+	}
+	write(fd, records, len);
+	flock(fd, LOCK_UN);
+	close(fd);
+}
@@ -0,0 +1,181 @@
+// LogBinary.h
+// Optional binary log mode.
+//
+// Formatting text on the device (stringstreams, strftime-ish time
+// stamps, "PID: xxx PPID: xxx") costs more than the control work we
+// are logging about. In binary mode the LOGF_*() macros store only
+// a format id, owner id, sequence number, time stamp and the raw
+// argument values; tools/logdecode turns LOG_BINARY_FILE back into
+// the usual "<E> OWNER: SEQ TID: ... PID: ..." text on the host.
+//
+// Each LOGF_*() call site owns a static LogFormat. The first time it
+// is used in binary mode it gets an id and a definition record ('F')
+// goes into the stream ahead of the first message that uses it; owners
+// ('O') and processes ('P') are defined the same way. All ids are per
+// process, the decoder keys them on the PID in each record.
+//
+// Binary mode is off by default; turn it on with
+// LogBinary::SetEnabled(true) or LOG_BINARY=1 in the environment.
+// In text mode LOGF_*() simply snprintf()s and logs normally; in
+// binary mode nothing is echoed to the console.
+//
+// Record layout (native byte order, every record starts with
+// LogBinaryHeader, 'length' includes the header):
+//   'P' process:  uint32 ppid
+//   'O' owner:    uint16 ownerId, name bytes
+//   'F' format:   uint16 fmtId, uint16 atLength, at bytes, fmt bytes
+//   'M' message:  uint16 fmtId, uint16 ownerId, uint32 tid, uint64 seq,
+//                 uint64 realtime ns, then tagged arguments:
+//                 'i' int32, 'I' int64, 'u' uint32, 'U' uint64,
+//                 'd' double, 'p' pointer (uint64),
+//                 's' uint16 length + bytes
+// The file itself starts with the 8 bytes LOG_BINARY_MAGIC.
+
+#ifndef LOG_BINARY_H_
+#define LOG_BINARY_H_
+
+#include <atomic>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+#include <stdint.h>
+
+using namespace std;
+
+#define LOG_BINARY_MAGIC "LOGBIN2\n"
+#define LOG_BINARY_MAX_RECORD 500  // == LOG_RING_TEXT_LEN
+// Longest string argument stored; longer ones are cut short.
+#define LOG_BINARY_MAX_STRING 128
+
+enum LogBinaryRecordType
+{
+	LogBinaryProcess = 'P',
+	LogBinaryOwner = 'O',
+	LogBinaryFormat = 'F',
+	LogBinaryMessage = 'M'
+};
+
+struct LogBinaryHeader
+{
+	uint16_t length;
+	uint8_t type;
+	uint8_t level;
+	uint32_t pid;
+};
+
+// One per LOGF_*() call site (function-local static).
+struct LogFormat
+{
+	const char *fmt;
+	const char *at;
+	int level;
+	atomic<uint32_t> id;
+};
+
+// Builds one record in a stack buffer. If the arguments don't fit
+// the record is marked truncated and the remaining ones are dropped.
+class LogBinaryRecord
+{
+public:
+	LogBinaryRecord(LogBinaryRecordType type, int level);
+	void PutRaw(const void *p, size_t n);
+	void Put(int8_t v) { _putTagged('i', (int32_t)v); }
+	void Put(int16_t v) { _putTagged('i', (int32_t)v); }
+	void Put(int32_t v) { _putTagged('i', v); }
+	void Put(int64_t v) { _putTagged('I', v); }
+	void Put(uint8_t v) { _putTagged('u', (uint32_t)v); }
+	void Put(uint16_t v) { _putTagged('u', (uint32_t)v); }
+	void Put(uint32_t v) { _putTagged('u', v); }
+	void Put(uint64_t v) { _putTagged('U', v); }
+	void Put(float v) { _putTagged('d', (double)v); }
+	void Put(double v) { _putTagged('d', v); }
+	void Put(const char *s);
+	void Put(char *s) { Put((const char *)s); }
+	void Put(const string& s) { Put(s.c_str()); }
+	template<typename T>
+	void Put(T *p) { _putTagged('p', (uint64_t)(uintptr_t)p); }
+	// Everything else integral (char, long, long long, bool, ...):
+	template<typename T>
+	typename enable_if<is_integral<T>::value || is_enum<T>::value>::type
+	Put(T v)
+	{
+		if (is_signed<T>::value)
+		{
+			Put((int64_t)v);
+		}
+		else
+		{
+			Put((uint64_t)v);
+		}
+	}
+	const char *Data(void) const { return m_buf; }
+	size_t Length(void) const { return m_used; }
+	bool IsTruncated(void) const { return m_truncated; }
+	void Finish(void);
+private:
+	template<typename T>
+	void _putTagged(char tag, T v)
+	{
+		if (m_used + 1 + sizeof(v) > sizeof(m_buf))
+		{
+			m_truncated = true;
+			return;
+		}
+		m_buf[m_used++] = tag;
+		memcpy(m_buf + m_used, &v, sizeof(v));
+		m_used += sizeof(v);
+	}
+	char m_buf[LOG_BINARY_MAX_RECORD];
+	size_t m_used;
+	bool m_truncated = false;
+};
+
+class LogBinary
+{
+public:
+	static bool IsEnabled(void)
+	{
+		return m_enabled.load(memory_order_relaxed);
+	}
+	static void SetEnabled(bool enabled);
+	// Returns the site's id, assigning it and emitting its 'F' record
+	// the first time.
+	static uint16_t FormatId(LogFormat& format);
+	// Assigns an owner id and emits its 'O' record.
+	static uint16_t RegisterOwner(const string& name);
+	// Sends a finished record to LOG_BINARY_FILE (via LogRing when
+	// it is available).
+	static void Write(const LogBinaryRecord& record);
+	// Cached getpid(), reset in fork()ed children.
+	static uint32_t Pid(void);
+	// Used by the file writer (and the fallback path) only:
+	// appends records to LOG_BINARY_FILE, rotating it to ".1" when it
+	// gets too big and re-writing every definition record seen so far
+	// at the start of the new file so it decodes on its own.
+	static void WriteToFile(const char *records, size_t len);
+private:
+	static void _ensureProcessRecord(void);
+	static void _rememberDefinitions(const char *records, size_t len);
+	static atomic<bool> m_enabled;
+};
+
+template<typename T>
+inline void logBinaryPutArgs(LogBinaryRecord& r, T first)
+{
+	r.Put(first);
+}
+
+template<typename T, typename... Args>
+inline void logBinaryPutArgs(LogBinaryRecord& r, T first, Args... rest)
+{
+	r.Put(first);
+	logBinaryPutArgs(r, rest...);
+}
+
+inline void logBinaryPutArgs(LogBinaryRecord& r)
+{
+	(void)r;
+}
+
+#endif  // LOG_BINARY_H_
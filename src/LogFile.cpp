@@ -0,0 +1,162 @@
+// LogFile.cpp
+
+#include <limits.h>
+
+#include "Log.h"
+#include "LogArchive.h"
+#include "LogFile.h"
+
+static char logFilePath[PATH_MAX];
+
+static bool initPath(void)
+{
+	if (logFilePath[0] == 0)  // SetPath() wins over the environment.
+	{
+		const char *env = getenv("LOG_FILE");
+		LogFile::SetPath((env != nullptr && env[0] != 0) ? env : LOGFILE_NAME);
+	}
+	return true;
+}
+
+const char *LogFile::Path(void)
+{
+	static bool inited = initPath();
+	(void)inited;
+	return logFilePath;
+}
+
+void LogFile::SetPath(const char *path)
+{
+	snprintf(logFilePath, sizeof(logFilePath), "%s", path);
+}
+
+int LogFile::Open(bool wait)
+{
+	// We READ this file iff log size > 64 KB...
+	int fd = open(Path(), O_RDWR | O_APPEND | O_CREAT,
+				S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+	if (fd < 0)
+	{
+		cout << "ERROR - LOGGER CANNOT OPEN LOGFILE!" << endl;
+		return -1;
+	}
+
+	struct flock fl;
+	fl.l_type = F_WRLCK;  // Exclusive lock
+	fl.l_whence = SEEK_SET;
+	fl.l_start = 0;
+	fl.l_len = 0;  // 0 == "Lock to end of file"
+	fl.l_pid = getpid();
+	// A write lock here prevents others from accessing Logfile
+	// until I release it.
+	// fcntl(F_SETLKW) BLOCKS until another guy releases their lock
+	//    (or EINTR).
+	// (vs. F_SETLK which returns immediately with EAGAIN)
+	int rv;
+	do
+	{
+		rv = fcntl(fd, wait ? F_SETLKW : F_SETLK, &fl);
+	} while (rv == -1 && wait && errno == EINTR);
+	if (rv == -1)
+	{
+		// Someone else is writing. Caller will add to PendingMessages
+		// and return. Later someone will eventually clear out the pendings
+		close(fd);
+		return -1;
+	}
+
+	_trim(fd);
+	return fd;
+}
+
+void LogFile::_trim(int fd)
+{
+	// Keep log file < 64 KB.
+	// If > 64 KB, read it, erase the file and then write the
+	// latest (up to) 32KB back; left with a <= 32 KB log file.
+	// The cut is just after a line end, and what is cut off the
+	// front goes to the compressed archive (see LogArchive.h)
+	// rather than being thrown away.
+	off_t fileSize = lseek(fd, 0, SEEK_END);
+	if (fileSize > MAX_LOG_FILE_SIZE)
+	{
+		vector<char> buf(fileSize);
+		ssize_t bytesRead = pread(fd, buf.data(), fileSize, 0);
+		size_t cut = 0;
+		if (bytesRead > KEEP_LAST_LOG_SIZE)
+		{
+			cut = bytesRead - KEEP_LAST_LOG_SIZE;
+			const char *nl = (const char *)memchr(buf.data() + cut, '\n',
+				bytesRead - cut);
+			if (nl != nullptr)
+			{
+				cut = nl - buf.data() + 1;
+			}
+		}
+		if (cut > 0 && LogArchive::IsEnabled())
+		{
+			LogArchive::GetInstance().Add(buf.data(), cut);
+		}
+		ftruncate(fd, 0);  // truncate to zero bytes.
+		if (bytesRead > (ssize_t)cut)
+		{
+			write(fd, buf.data() + cut, bytesRead - cut);
+		}
+	}
+}
+
+// Caller holds the file lock on 'fd'.
+void LogFile::WritePending(int fd, const string& owner)
+{
+	PendingMessages& pending = PendingMessages::GetInstance();
+	char buf[PENDING_MESSAGE_MAX_LEN];
+	size_t len;
+	while (pending.Pop(buf, sizeof(buf), len))
+	{
+		write(fd, buf, len);
+	}
+	string dropped = TakeDroppedLine(owner);
+	if (!dropped.empty())
+	{
+		write(fd, dropped.c_str(), dropped.length());
+	}
+}
+
+string LogFile::TakeDroppedLine(const string& owner)
+{
+	PendingMessages& pending = PendingMessages::GetInstance();
+	uint64_t dropped = pending.TakeUnreportedDrops();
+	if (dropped == 0)
+	{
+		return string();
+	}
+	char timeNow[128];
+	Log::FillTime(timeNow);
+	stringstream s;
+	s << "<E> " << owner << "--- PID: " << getpid() <<
+		" PPID: " << getppid() << " " << timeNow << dropped <<
+		" pending log message(s) dropped, log file was locked (" <<
+		pending.GetDeferredCount() << " deferred in total)\r\n";
+	return s.str();
+}
+
+void LogFile::Close(int fd)
+{
+	// Release the file lock we obtained in Open():
+	struct flock fl;
+	fl.l_type = F_UNLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = 0;
+	fl.l_len = 0;
+	fl.l_pid = getpid();
+	if (fcntl(fd, F_SETLK, &fl) == -1)
+	{
+		int myErr = errno;
+		stringstream s;
+		s << "ERROR releasing file lock: ";
+		s << strerror(myErr);
+		s << endl;
+		_RED(s.str());
+	}
+	close(fd);
+}
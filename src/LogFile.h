@@ -0,0 +1,41 @@
+// LogFile.h
+// Opening, locking and size-limiting the log file (LOGFILE_NAME).
+// This USED TO BE Log::_open() / Log::_close(); it is shared now
+// by Log (direct writes) and LogRing's writer thread (batched writes).
+
+#ifndef LOG_FILE_H_
+#define LOG_FILE_H_
+
+#include <string>
+
+#include <sys/types.h>
+
+using namespace std;
+
+class LogFile
+{
+public:
+	// Opens LOGFILE_NAME for append and takes the exclusive fcntl()
+	// write lock on it. If 'wait' is false and another thread or
+	// process holds the lock, returns -1 immediately.
+	// Trims the file back to KEEP_LAST_LOG_SIZE when it has grown
+	// past MAX_LOG_FILE_SIZE.
+	static int Open(bool wait);
+	// Releases the lock and closes 'fd'.
+	static void Close(int fd);
+	// Writes out (and empties) PendingMessages, plus one line saying
+	// how many were dropped since the last call. Caller holds the lock.
+	static void WritePending(int fd, const string& owner);
+	// The "N pending log message(s) dropped" line for the drops since
+	// the last call, "" if none.
+	static string TakeDroppedLine(const string& owner);
+	// LOGFILE_NAME unless LOG_FILE in the environment or SetPath()
+	// says otherwise. Set it before the first line is logged; lines
+	// that go through LogRing land in the writer process's file.
+	static const char *Path(void);
+	static void SetPath(const char *path);
+private:
+	static void _trim(int fd);
+};
+
+#endif  // LOG_FILE_H_
@@ -0,0 +1,32 @@
+// LogHandle.cpp
+
+#include "LogHandle.h"
+
+mutex LogOwners::m_mutex;
+atomic<int> LogOwners::m_count(0);
+atomic<Log *> LogOwners::m_owners[LOG_MAX_OWNERS];
+
+uint16_t LogOwners::Intern(const char *owner)
+{
+	lock_guard<mutex> lock(m_mutex);
+	int count = m_count.load(memory_order_relaxed);
+	for (int i = 0; i < count; i++)
+	{
+		// m_logOwnerName is "xyz: "
+		const string& name = m_owners[i].load(memory_order_relaxed)->GetLogName();
+		size_t len = strlen(owner);
+		if (name.length() == len + 2 && name.compare(0, len, owner) == 0)
+		{
+			return (uint16_t)i;
+		}
+	}
+	if (count >= LOG_MAX_OWNERS)
+	{
+		// Still logs, under the first owner's name.
+		return 0;
+	}
+	// Never deleted: handles in static objects may log at exit.
+	m_owners[count].store(new Log(owner), memory_order_release);
+	m_count.store(count + 1, memory_order_relaxed);
+	return (uint16_t)count;
+}
@@ -0,0 +1,82 @@
+// LogHandle.h
+// Logging without deriving from (or holding) a Log.
+//
+// I2c USED TO inherit Log, so every bus object and every driver built
+// on one carried an owner name string, a sequence counter, a level
+// and so on. A LogHandle is just a 16 bit id into a process-wide
+// registry of interned owners; all handles for "I2c" share one Log:
+//
+//     class MyDriver
+//     {
+//         LogHandle m_log{"MyDriver"};
+//         ...
+//         LOGF_DEBUG(m_log, "reg 0x%02x", reg);
+//         m_log->LogErr(AT, "Can't talk to it");
+//
+// The LOG_*() / LOGF_*() macros take a handle or a Log alike.
+// Interning takes a mutex (once per handle constructed); using a
+// handle never does.
+
+#ifndef LOG_HANDLE_H_
+#define LOG_HANDLE_H_
+
+#include <atomic>
+#include <mutex>
+
+#include <stdint.h>
+
+#include "Log.h"
+
+using namespace std;
+
+#define LOG_MAX_OWNERS 256
+
+class LogOwners
+{
+public:
+	// Returns the id for 'owner', creating its Log the first time.
+	static uint16_t Intern(const char *owner);
+	static Log& Get(uint16_t id)
+	{
+		return *m_owners[id].load(memory_order_acquire);
+	}
+private:
+	static mutex m_mutex;
+	static atomic<int> m_count;
+	static atomic<Log *> m_owners[LOG_MAX_OWNERS];
+};
+
+class LogHandle
+{
+public:
+	explicit LogHandle(const char *owner)
+		: m_id(LogOwners::Intern(owner))
+	{
+	}
+	uint16_t Id(void) const { return m_id; }
+	Log& Get(void) const { return LogOwners::Get(m_id); }
+	// For the rest of Log's API: m_log->LogErr(AT, ...).
+	Log *operator->(void) const { return &Get(); }
+	// What the LOG_*() / LOGF_*() macros use:
+	bool IsEnabled(int level) const
+	{
+		return Get().IsEnabled(level);
+	}
+	bool PassesRateLimit(LogLevel level, const char *at) const
+	{
+		return Get().PassesRateLimit(level, at);
+	}
+	void Emit(LogLevel level, const char *at, const char *msg) const
+	{
+		Get().Emit(level, at, msg);
+	}
+	template<typename... Args>
+	void EmitF(LogFormat& format, Args... args) const
+	{
+		Get().EmitF(format, args...);
+	}
+private:
+	uint16_t m_id;
+};
+
+#endif  // LOG_HANDLE_H_
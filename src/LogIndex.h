@@ -0,0 +1,243 @@
+// LogIndex.h
+// Sidecar index for the compressed log archive (see LogArchive.h).
+//
+// Every gzip member LogArchive appends to LOGFILE_NAME ".1.gz" gets one
+// fixed size LogIndexEntry appended to LOGFILE_NAME ".1.gz.idx" (both
+// rotate together): where the member is, the time range and sequence
+// range of its lines, and a 64 bit owner bitmap (bit = hash of the
+// owner name, so two owners can share a bit: a set bit means "may
+// contain", a clear bit means "doesn't"). A reader (tools/logquery)
+// looks at the entries only and inflates just the members that can
+// hold what it was asked for.
+//
+// Header only: the writer (LogArchive) and the reader share it, and
+// the reader doesn't link with Log.
+
+#ifndef LOG_INDEX_H_
+#define LOG_INDEX_H_
+
+#include <cstdio>
+#include <cstring>
+
+#include <stdint.h>
+#include <time.h>
+
+#define LOG_INDEX_SUFFIX ".idx"
+#define LOG_INDEX_VERSION 1
+// FileSink puts this in front of a line it had to defer (see
+// LogFile::WritePending()); the line is otherwise as logged.
+#define LOG_INDEX_DEFERRED_PREFIX " * "
+#define LOG_INDEX_DEFERRED_PREFIX_LEN 3
+
+#pragma pack(push, 1)
+struct LogIndexEntry
+{
+	uint16_t version;      // LOG_INDEX_VERSION
+	uint16_t reserved;
+	uint32_t length;       // Of the gzip member, bytes
+	uint64_t offset;       // Of the gzip member in the .gz file
+	int64_t firstTime;     // Lines' times, UTC seconds (min / max),
+	int64_t lastTime;      // 0 if none had a time
+	uint64_t firstSeq;     // Lines' sequence numbers (min / max)
+	uint64_t lastSeq;
+	uint64_t owners;       // LogIndex::OwnerBit() of every owner
+	uint32_t lines;
+	uint32_t reserved2;
+};
+#pragma pack(pop)
+
+// The parts of one text log line the index cares about:
+//   <E> OWNER: SEQ TID: xxx PID: xxx PPID: xxx mm/dd/yy hh:mm:ss.dddd: ...
+// or the same after LOG_INDEX_DEFERRED_PREFIX.
+struct LogIndexLine
+{
+	bool deferred;         // Had LOG_INDEX_DEFERRED_PREFIX
+	char level;            // 'E', 'I', ...
+	const char *owner;     // Not terminated
+	size_t ownerLen;
+	uint64_t seq;
+	int64_t time;          // UTC seconds, 0 if not found
+};
+
+class LogIndex
+{
+public:
+	// FNV-1a of the owner name, folded to one of 64 bits.
+	static uint64_t OwnerBit(const char *owner, size_t len)
+	{
+		uint32_t h = 2166136261u;
+		for (size_t i = 0; i < len; i++)
+		{
+			h = (h ^ (uint8_t)owner[i]) * 16777619u;
+		}
+		return 1ULL << ((h ^ (h >> 16)) & 63);
+	}
+	// "mm/dd/yy hh:mm:ss" (Log::FillTime(), UTC) to seconds.
+	static bool ParseTime(const char *s, int64_t& t)
+	{
+		struct tm tm;
+		memset(&tm, 0, sizeof(tm));
+		int mon, day, year;
+		if (sscanf(s, "%2d/%2d/%2d %2d:%2d:%2d", &mon, &day, &year,
+			&tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+		{
+			return false;
+		}
+		tm.tm_mon = mon - 1;
+		tm.tm_mday = day;
+		tm.tm_year = year + 100;
+		t = (int64_t)timegm(&tm);
+		return true;
+	}
+	// Returns false if 'line' (length 'len', no need to be terminated)
+	// isn't a Log line, e.g. a stack trace continuation.
+	static bool ParseLine(const char *line, size_t len, LogIndexLine& out)
+	{
+		out.deferred = len >= LOG_INDEX_DEFERRED_PREFIX_LEN
+			&& memcmp(line, LOG_INDEX_DEFERRED_PREFIX, LOG_INDEX_DEFERRED_PREFIX_LEN) == 0;
+		if (out.deferred)
+		{
+			line += LOG_INDEX_DEFERRED_PREFIX_LEN;
+			len -= LOG_INDEX_DEFERRED_PREFIX_LEN;
+		}
+		if (len < 8 || line[0] != '<' || line[2] != '>' || line[3] != ' ')
+		{
+			return false;
+		}
+		out.level = line[1];
+		// The owner name is free text: find " TID: ", then walk back
+		// over the sequence number to the ": " that ends the owner.
+		const char *tid = (const char *)memmem(line, len, " TID: ", 6);
+		if (tid == nullptr)
+		{
+			return false;
+		}
+		const char *digits = tid;
+		while (digits > line + 4 && digits[-1] >= '0' && digits[-1] <= '9')
+		{
+			digits--;
+		}
+		if (digits == tid || digits < line + 6 || digits[-1] != ' ' || digits[-2] != ':')
+		{
+			return false;
+		}
+		out.owner = line + 4;
+		out.ownerLen = (digits - 2) - out.owner;
+		out.seq = 0;
+		for (const char *p = digits; p < tid; p++)
+		{
+			out.seq = out.seq * 10 + (*p - '0');
+		}
+		out.time = 0;
+		size_t rest = len - (tid - line);
+		const char *ppid = (const char *)memmem(tid, rest, " PPID: ", 7);
+		if (ppid != nullptr)
+		{
+			const char *p = ppid + 7;
+			const char *end = line + len;
+			while (p < end && *p >= '0' && *p <= '9')
+			{
+				p++;
+			}
+			// "mm/dd/yy hh:mm:ss" is 17 characters.
+			if (p + 18 <= end && *p == ' ')
+			{
+				char stamp[18];
+				memcpy(stamp, p + 1, 17);
+				stamp[17] = 0;
+				int64_t t;
+				if (ParseTime(stamp, t))
+				{
+					out.time = t;
+				}
+			}
+		}
+		return true;
+	}
+	// Folds every line of 'text' into 'entry' (offset / length are the
+	// caller's).
+	static void Build(const char *text, size_t len, LogIndexEntry& entry)
+	{
+		memset(&entry, 0, sizeof(entry));
+		entry.version = LOG_INDEX_VERSION;
+		size_t start = 0;
+		while (start < len)
+		{
+			const char *nl = (const char *)memchr(text + start, '\n', len - start);
+			size_t end = (nl != nullptr) ? (nl - text + 1) : len;
+			LogIndexLine line;
+			if (ParseLine(text + start, end - start, line))
+			{
+				entry.owners |= OwnerBit(line.owner, line.ownerLen);
+				if (line.time != 0)
+				{
+					if (entry.firstTime == 0 || line.time < entry.firstTime)
+					{
+						entry.firstTime = line.time;
+					}
+					if (line.time > entry.lastTime)
+					{
+						entry.lastTime = line.time;
+					}
+				}
+				if (entry.firstSeq == 0 || line.seq < entry.firstSeq)
+				{
+					entry.firstSeq = line.seq;
+				}
+				if (line.seq > entry.lastSeq)
+				{
+					entry.lastSeq = line.seq;
+				}
+			}
+			entry.lines++;
+			start = end;
+		}
+	}
+	// A line as Log writes it and its deferred form must parse the
+	// same; false (and what differs on stderr) if not.
+	// 'logquery -t' runs this.
+	static bool SelfCheck(void)
+	{
+		static const char plain[] =
+			"<E> I2c: 042 TID: 811 PID: 800 PPID: 1 "
+			"03/14/26 10:15:09.1234: I2c:139: write failed\r\n";
+		char deferred[sizeof(plain) + LOG_INDEX_DEFERRED_PREFIX_LEN];
+		snprintf(deferred, sizeof(deferred), "%s%s", LOG_INDEX_DEFERRED_PREFIX, plain);
+		LogIndexLine a, b;
+		if (!ParseLine(plain, strlen(plain), a) || a.deferred)
+		{
+			fprintf(stderr, "LogIndex: can't parse: %s", plain);
+			return false;
+		}
+		if (!ParseLine(deferred, strlen(deferred), b) || !b.deferred)
+		{
+			fprintf(stderr, "LogIndex: can't parse deferred: %s", deferred);
+			return false;
+		}
+		if (a.level != b.level || a.ownerLen != b.ownerLen
+			|| memcmp(a.owner, b.owner, a.ownerLen) != 0
+			|| a.seq != b.seq || a.time != b.time)
+		{
+			fprintf(stderr, "LogIndex: deferred line parses differently\n");
+			return false;
+		}
+		if (a.level != 'E' || a.ownerLen != 3 || memcmp(a.owner, "I2c", 3) != 0
+			|| a.seq != 42 || a.time != 1773483309)
+		{
+			fprintf(stderr, "LogIndex: parsed %c '%.*s' %llu %lld\n", a.level,
+				(int)a.ownerLen, a.owner, (unsigned long long)a.seq, (long long)a.time);
+			return false;
+		}
+		LogIndexEntry e;
+		Build(deferred, strlen(deferred), e);
+		if (e.lines != 1 || e.firstSeq != 42 || e.firstTime != a.time
+			|| e.owners != OwnerBit(a.owner, a.ownerLen))
+		{
+			fprintf(stderr, "LogIndex: deferred line not indexed\n");
+			return false;
+		}
+		return true;
+	}
+};
+
+#endif  // LOG_INDEX_H_
@@ -0,0 +1,148 @@
+// LogRateLimiter.cpp
+
+#include <time.h>
+
+#include "LogRateLimiter.h"
+
+static int64_t nowMs(void)
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int64_t wallMs(void)
+{
+	timespec ts;
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+LogRateLimiter& LogRateLimiter::GetInstance(void)
+{
+	static LogRateLimiter instance;
+	return instance;
+}
+
+LogRateLimiter::LogRateLimiter()
+	: m_totalSuppressed(0)
+{
+	for (size_t i = 0; i < LOG_RATE_SITES; i++)
+	{
+		m_sites[i].at.store(nullptr, memory_order_relaxed);
+		m_sites[i].windowStartMs.store(0, memory_order_relaxed);
+		m_sites[i].passed.store(0, memory_order_relaxed);
+		m_sites[i].suppressed.store(0, memory_order_relaxed);
+		m_sites[i].firstSuppressedMs.store(0, memory_order_relaxed);
+		m_sites[i].owner.store(0, memory_order_relaxed);
+		m_sites[i].level.store(0, memory_order_relaxed);
+	}
+}
+
+LogRateLimiter::Site *LogRateLimiter::_find(const char *at)
+{
+	// Fibonacci hash of the literal's address:
+	size_t h = (size_t)(((uintptr_t)at >> 3) * 0x9E3779B97F4A7C15ULL);
+	for (int i = 0; i < m_maxProbes; i++)
+	{
+		Site *site = &m_sites[(h + i) & m_mask];
+		const char *current = site->at.load(memory_order_acquire);
+		if (current == at)
+		{
+			return site;
+		}
+		if (current == nullptr)
+		{
+			if (site->at.compare_exchange_strong(current, at,
+					memory_order_acq_rel))
+			{
+				return site;
+			}
+			if (current == at)
+			{
+				return site;  // Another thread claimed it for us.
+			}
+		}
+	}
+	return nullptr;
+}
+
+bool LogRateLimiter::_newWindow(Site *site, int64_t start, int64_t now,
+	LogRateRepeats& repeats)
+{
+	// Only the thread that moves the window reports and resets it.
+	if (!site->windowStartMs.compare_exchange_strong(start, now,
+			memory_order_relaxed))
+	{
+		return false;
+	}
+	repeats.at = site->at.load(memory_order_relaxed);
+	repeats.owner = site->owner.load(memory_order_relaxed);
+	repeats.level = site->level.load(memory_order_relaxed);
+	repeats.sinceMs = site->firstSuppressedMs.load(memory_order_relaxed);
+	repeats.count = site->suppressed.exchange(0, memory_order_relaxed);
+	site->passed.store(0, memory_order_relaxed);
+	return true;
+}
+
+bool LogRateLimiter::Check(const char *at, uint16_t owner, int level,
+	LogRateRepeats& repeats)
+{
+	repeats.count = 0;
+	Site *site = _find(at);
+	if (site == nullptr)
+	{
+		// Table full: better to log too much than to lose the line.
+		return true;
+	}
+
+	int64_t now = nowMs();
+	int64_t start = site->windowStartMs.load(memory_order_relaxed);
+	if (now - start >= LOG_RATE_WINDOW_MS)
+	{
+		_newWindow(site, start, now, repeats);
+	}
+
+	if (site->passed.fetch_add(1, memory_order_relaxed) < LOG_RATE_BURST
+		|| repeats.count > 0)
+	{
+		return true;
+	}
+	// For TakeExpired(), which has no line of its own to go by.
+	site->owner.store(owner, memory_order_relaxed);
+	site->level.store(level, memory_order_relaxed);
+	if (site->suppressed.fetch_add(1, memory_order_relaxed) == 0)
+	{
+		site->firstSuppressedMs.store(wallMs(), memory_order_relaxed);
+	}
+	m_totalSuppressed.fetch_add(1, memory_order_relaxed);
+	return false;
+}
+
+void LogRateLimiter::TakeExpired(const function<void(const LogRateRepeats&)>& report,
+	bool all)
+{
+	int64_t now = nowMs();
+	for (size_t i = 0; i < LOG_RATE_SITES; i++)
+	{
+		Site *site = &m_sites[i];
+		if (site->at.load(memory_order_acquire) == nullptr
+			|| site->suppressed.load(memory_order_relaxed) == 0)
+		{
+			continue;
+		}
+		int64_t start = site->windowStartMs.load(memory_order_relaxed);
+		LogRateRepeats repeats;
+		if ((all || now - start >= LOG_RATE_WINDOW_MS)
+			&& _newWindow(site, start, now, repeats)
+			&& repeats.count > 0)
+		{
+			report(repeats);
+		}
+	}
+}
+
+uint64_t LogRateLimiter::GetSuppressedCount(void) const
+{
+	return m_totalSuppressed.load(memory_order_relaxed);
+}
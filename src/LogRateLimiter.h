@@ -0,0 +1,88 @@
+// LogRateLimiter.h
+// Per-call-site rate limiting for warnings and errors.
+//
+// When the I2C bus drops out every WriteByte() / ReadByte() fails and
+// logs; at 100 Hz that rotates the 64 KB log continuously and buries
+// everything else. Each call site (keyed on its AT string literal,
+// whose address is unique per site) may log LOG_RATE_BURST lines per
+// LOG_RATE_WINDOW_MS; the rest are counted and the next line that gets
+// through is preceded by one "... repeated 4,312 times since 14:02:11"
+// (when the first of them was suppressed).
+//
+// That USED TO wait for the site's next line, so a count could describe
+// a storm from hours earlier, and one that just stopped was never
+// reported. Now Log also collects them (TakeExpired()) every window
+// from a Scheduler task, and at exit.
+//
+// Check() is lock-free: a hash probe on the literal's address and a
+// couple of relaxed atomic ops, so failing paths stay cheap.
+
+#ifndef LOG_RATE_LIMITER_H_
+#define LOG_RATE_LIMITER_H_
+
+#include <atomic>
+#include <functional>
+
+#include <stdint.h>
+
+using namespace std;
+
+// Must be a power of two.
+#define LOG_RATE_SITES 256
+#ifndef LOG_RATE_WINDOW_MS
+#define LOG_RATE_WINDOW_MS 10000
+#endif
+#ifndef LOG_RATE_BURST
+#define LOG_RATE_BURST 5
+#endif
+
+// Lines suppressed at one call site, and since when.
+struct LogRateRepeats
+{
+	const char *at;
+	uint16_t owner;  // LogOwners id of the owner that logged there last
+	int level;
+	uint32_t count;
+	int64_t sinceMs;  // CLOCK_REALTIME of the first one
+};
+
+class LogRateLimiter
+{
+public:
+	static LogRateLimiter& GetInstance(void);
+	// Returns true if the line from 'at' should be logged. When a new
+	// window opens after lines were suppressed, 'repeats.count' is set
+	// to how many were suppressed (otherwise 0).
+	bool Check(const char *at, uint16_t owner, int level, LogRateRepeats& repeats);
+	// Hands every site whose window is over (any window at all if
+	// 'all', at exit) and has a count to 'report', and starts it a new
+	// window.
+	void TakeExpired(const function<void(const LogRateRepeats&)>& report,
+		bool all = false);
+	// Total lines suppressed since start up, all sites:
+	uint64_t GetSuppressedCount(void) const;
+private:
+	LogRateLimiter();
+	LogRateLimiter(LogRateLimiter const& copy);  // Not allowed
+	LogRateLimiter& operator=(LogRateLimiter const& copy);  // Not allowed
+	struct Site
+	{
+		atomic<const char *> at;
+		atomic<int64_t> windowStartMs;
+		atomic<uint32_t> passed;
+		atomic<uint32_t> suppressed;
+		atomic<int64_t> firstSuppressedMs;
+		atomic<uint16_t> owner;
+		atomic<int> level;
+	};
+	Site *_find(const char *at);
+	// Moves the window on from 'start' to 'now'; false if another
+	// thread did first. Otherwise fills in 'repeats'.
+	bool _newWindow(Site *site, int64_t start, int64_t now, LogRateRepeats& repeats);
+	Site m_sites[LOG_RATE_SITES];
+	atomic<uint64_t> m_totalSuppressed;
+	static const size_t m_mask = LOG_RATE_SITES - 1;
+	static const int m_maxProbes = 8;
+};
+
+#endif  // LOG_RATE_LIMITER_H_
@@ -0,0 +1,472 @@
+// LogRing.cpp
+
+#include <cstring>
+#include <new>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "Log.h"
+#include "LogFile.h"
+#include "LogRing.h"
+#include "LogStream.h"
+#include "PendingMessages.h"
+
+// Largest batch the writer hands to a single write() call:
+#define LOG_RING_BATCH_SIZE 16384
+// Writer re-checks the ring at least this often even without a wakeup:
+#define LOG_RING_IDLE_WAIT_MS 100
+
+static int64_t nowMs(void)
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void futexWait(atomic<uint32_t> *addr, uint32_t expected, int timeoutMs)
+{
+	timespec ts;
+	ts.tv_sec = timeoutMs / 1000;
+	ts.tv_nsec = (timeoutMs % 1000) * 1000000L;
+	// NOT FUTEX_PRIVATE_FLAG: the word lives in memory shared
+	// between processes.
+	syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), FUTEX_WAIT,
+		expected, &ts, nullptr, 0);
+}
+
+static void futexWake(atomic<uint32_t> *addr)
+{
+	syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), FUTEX_WAKE,
+		1, nullptr, nullptr, 0);
+}
+
+LogRing& LogRing::GetInstance(void)
+{
+	// Never deleted: Log calls made from other static destructors
+	// must still find a valid object. _atExit() stops the writer.
+	static LogRing *instance = new LogRing();
+	return *instance;
+}
+
+LogRing::LogRing()
+	: m_writerFd(-1), m_nextElectionMs(0), m_electing(false), m_keepRunning(true),
+	m_localSequence(0)
+{
+	// Writer or not (or not even attached), see _atExit().
+	atexit(_atExit);
+	if (_attach())
+	{
+		// A fork()ed child shares our open file description and so
+		// our flock(); it must not think it is the writer (it has
+		// no writer thread) nor keep the lock alive after we die.
+		pthread_atfork(nullptr, nullptr, _atForkChild);
+		_tryBecomeWriter();
+	}
+}
+
+bool LogRing::_attach(void)
+{
+	const size_t size = sizeof(LogRingShared);
+	bool creator = true;
+	int fd = shm_open(LOG_RING_SHM_NAME, O_RDWR | O_CREAT | O_EXCL, 0666);
+	if (fd < 0)
+	{
+		if (errno != EEXIST)
+		{
+			return false;
+		}
+		creator = false;
+		fd = shm_open(LOG_RING_SHM_NAME, O_RDWR, 0);
+		if (fd < 0)
+		{
+			return false;
+		}
+	}
+
+	if (creator)
+	{
+		// Other users' processes log here too; don't let umask
+		// lock them out.
+		fchmod(fd, 0666);
+		if (ftruncate(fd, size) != 0)
+		{
+			close(fd);
+			shm_unlink(LOG_RING_SHM_NAME);
+			return false;
+		}
+	}
+	else
+	{
+		// The creator may not have sized the segment yet.
+		struct stat st;
+		int64_t giveUp = nowMs() + 1000;
+		while (fstat(fd, &st) == 0 && (size_t)st.st_size < size)
+		{
+			if (nowMs() > giveUp)
+			{
+				close(fd);
+				return false;
+			}
+			usleep(1000);
+		}
+	}
+
+	void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+	{
+		return false;
+	}
+	LogRingShared *shared = static_cast<LogRingShared *>(p);
+
+	if (creator)
+	{
+		// ftruncate() gave us zeroed memory; set up what isn't zero.
+		shared->version = LOG_RING_VERSION;
+		for (uint64_t i = 0; i < LOG_RING_SLOTS; i++)
+		{
+			shared->slots[i].sequence.store(i, memory_order_relaxed);
+		}
+		shared->writerPid.store(0, memory_order_relaxed);
+		shared->magic.store(m_magic, memory_order_release);
+	}
+	else
+	{
+		int64_t giveUp = nowMs() + 1000;
+		while (shared->magic.load(memory_order_acquire) != m_magic)
+		{
+			if (nowMs() > giveUp)
+			{
+				munmap(p, size);
+				return false;
+			}
+			usleep(1000);
+		}
+		if (shared->version != LOG_RING_VERSION)
+		{
+			// Left over from an older build; use the fallback path.
+			munmap(p, size);
+			return false;
+		}
+	}
+	m_shared = shared;
+	return true;
+}
+
+void LogRing::_tryBecomeWriter(void)
+{
+	if (m_electing.exchange(true, memory_order_acquire))
+	{
+		return;  // Another thread of mine is already trying.
+	}
+	m_nextElectionMs.store(nowMs() + m_electionIntervalMs, memory_order_relaxed);
+	if (m_writerFd < 0)
+	{
+		int fd = open(LOG_RING_WRITER_LOCK, O_RDWR | O_CREAT | O_CLOEXEC,
+			S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+		if (fd >= 0)
+		{
+			if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+			{
+				m_shared->writerPid.store(getpid(), memory_order_relaxed);
+				m_writer = thread(&LogRing::_writerThreadProc, this);
+				m_writerFd = fd;
+				// Every line passes through us now, serve them live.
+				LogStream::GetInstance().Start();
+			}
+			else
+			{
+				close(fd);
+			}
+		}
+	}
+	m_electing.store(false, memory_order_release);
+}
+
+uint64_t LogRing::NextSequence(void)
+{
+	LogRingShared *shared = m_shared;
+	if (shared != nullptr)
+	{
+		return shared->logSequence.fetch_add(1, memory_order_relaxed) + 1;
+	}
+	return m_localSequence.fetch_add(1, memory_order_relaxed) + 1;
+}
+
+bool LogRing::Append(const char *msg, size_t len, LogRingKind kind)
+{
+	LogRingShared *shared = m_shared;
+	if (shared == nullptr || len > LOG_RING_TEXT_LEN)
+	{
+		return false;
+	}
+	if (m_writerFd.load(memory_order_relaxed) < 0
+		&& nowMs() >= m_nextElectionMs.load(memory_order_relaxed))
+	{
+		// The old writer may have died; flock() tells us cheaply.
+		_tryBecomeWriter();
+	}
+
+	uint64_t pos = shared->enqueuePos.load(memory_order_relaxed);
+	LogRingSlot *slot;
+	for (;;)
+	{
+		slot = &shared->slots[pos & m_mask];
+		uint64_t seq = slot->sequence.load(memory_order_acquire);
+		int64_t diff = (int64_t)(seq - pos);
+		if (diff == 0)
+		{
+			if (shared->enqueuePos.compare_exchange_weak(pos, pos + 1,
+					memory_order_relaxed))
+			{
+				break;
+			}
+		}
+		else if (diff < 0)
+		{
+			// Full, writer can't keep up (or there is no writer).
+			return false;
+		}
+		else
+		{
+			pos = shared->enqueuePos.load(memory_order_relaxed);
+		}
+	}
+
+	memcpy(slot->text, msg, len);
+	slot->length = (uint16_t)len;
+	slot->kind = (uint16_t)kind;
+	// Publish. This only fails if the writer decided we had died
+	// while holding the slot and skipped it (see _drain()).
+	uint64_t expected = pos;
+	if (!slot->sequence.compare_exchange_strong(expected, pos + 1,
+			memory_order_release, memory_order_relaxed))
+	{
+		return false;
+	}
+
+	atomic_thread_fence(memory_order_seq_cst);
+	if (shared->writerSleeping.load(memory_order_relaxed) != 0)
+	{
+		shared->wakeup.fetch_add(1, memory_order_release);
+		futexWake(&shared->wakeup);
+	}
+	return true;
+}
+
+void LogRing::AppendPending(const string& owner)
+{
+	PendingMessages& pending = PendingMessages::GetInstance();
+	char buf[PENDING_MESSAGE_MAX_LEN];
+	size_t len;
+	while (pending.Pop(buf, sizeof(buf), len))
+	{
+		if (!Append(buf, len))
+		{
+			// Full again: back in the queue (behind anything pushed
+			// meanwhile) for the next try.
+			pending.Push(buf, len);
+			return;
+		}
+	}
+	string dropped = LogFile::TakeDroppedLine(owner);
+	if (!dropped.empty())
+	{
+		Append(dropped.c_str(), dropped.length());
+	}
+}
+
+void LogRing::_wakeWriter(void)
+{
+	m_shared->wakeup.fetch_add(1, memory_order_release);
+	futexWake(&m_shared->wakeup);
+}
+
+// Only ever called by the (single) writer thread, so dequeuePos
+// needs no CAS. Copies as many whole lines / records as fit into
+// 'text' and 'binary'.
+void LogRing::_drain(vector<char>& text, size_t& textUsed,
+	vector<char>& binary, size_t& binaryUsed)
+{
+	textUsed = 0;
+	binaryUsed = 0;
+	uint64_t pos = m_shared->dequeuePos.load(memory_order_relaxed);
+	for (;;)
+	{
+		LogRingSlot& slot = m_shared->slots[pos & m_mask];
+		uint64_t seq = slot.sequence.load(memory_order_acquire);
+		if (seq == pos + 1)
+		{
+			// Published line.
+			vector<char>& buf = (slot.kind == LogRingBinary) ? binary : text;
+			size_t& used = (slot.kind == LogRingBinary) ? binaryUsed : textUsed;
+			if (used + slot.length > buf.size())
+			{
+				break;
+			}
+			memcpy(buf.data() + used, slot.text, slot.length);
+			used += slot.length;
+			slot.sequence.store(pos + LOG_RING_SLOTS, memory_order_release);
+		}
+		else if (seq == pos)
+		{
+			if (m_shared->enqueuePos.load(memory_order_acquire) <= pos)
+			{
+				break;  // Empty.
+			}
+			// A producer claimed this slot but hasn't published yet.
+			// Normally it is microseconds away; if it stays like this
+			// the producer died mid-Append(), skip the slot.
+			if (m_stuckPos != pos)
+			{
+				m_stuckPos = pos;
+				m_stuckSinceMs = nowMs();
+				break;
+			}
+			if (nowMs() - m_stuckSinceMs < m_stuckSlotMs)
+			{
+				break;
+			}
+			uint64_t expected = pos;
+			if (!slot.sequence.compare_exchange_strong(expected,
+					pos + LOG_RING_SLOTS, memory_order_acq_rel))
+			{
+				continue;  // Published just now after all, re-read it.
+			}
+			m_shared->dropped.fetch_add(1, memory_order_relaxed);
+		}
+		else if ((int64_t)(seq - (pos + 1)) > 0)
+		{
+			// A previous writer consumed and released this slot but
+			// died before it advanced dequeuePos.
+		}
+		else
+		{
+			break;
+		}
+		pos++;
+		m_shared->dequeuePos.store(pos, memory_order_release);
+	}
+}
+
+void LogRing::_writerThreadProc(void)
+{
+	FlightRecorder::InstallAltStack();
+	vector<char> text(LOG_RING_BATCH_SIZE);
+	vector<char> binary(LOG_RING_BATCH_SIZE);
+	for (;;)
+	{
+		size_t textUsed;
+		size_t binaryUsed;
+		_drain(text, textUsed, binary, binaryUsed);
+		if (textUsed > 0)
+		{
+			// Non-ring users of the log file (older builds) still
+			// take the fcntl() lock per message; we take it once
+			// per batch and are willing to wait for it.
+			int fd = LogFile::Open(true);
+			if (fd >= 0)
+			{
+				// Lines this process couldn't get into the ring:
+				LogFile::WritePending(fd, "LogRing: ");
+				write(fd, text.data(), textUsed);
+				LogFile::Close(fd);
+			}
+			LogStream::GetInstance().Publish(text.data(), textUsed);
+		}
+		if (binaryUsed > 0)
+		{
+			LogBinary::WriteToFile(binary.data(), binaryUsed);
+		}
+		if (textUsed > 0 || binaryUsed > 0)
+		{
+			continue;
+		}
+		if (!m_keepRunning.load(memory_order_acquire))
+		{
+			break;
+		}
+
+		uint32_t wakeup = m_shared->wakeup.load(memory_order_acquire);
+		m_shared->writerSleeping.store(1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		uint64_t pos = m_shared->dequeuePos.load(memory_order_relaxed);
+		if (m_shared->slots[pos & m_mask].sequence.load(memory_order_acquire)
+			!= pos + 1)
+		{
+			futexWait(&m_shared->wakeup, wakeup, LOG_RING_IDLE_WAIT_MS);
+		}
+		m_shared->writerSleeping.store(0, memory_order_relaxed);
+	}
+}
+
+void LogRing::_atExit(void)
+{
+	// Drain what is left and stop the writer so the next process to
+	// log is free to take over immediately.
+	LogRing& ring = GetInstance();
+	if (ring.m_writerFd.load() < 0)
+	{
+		// Not the writer: what this process still has deferred goes
+		// to the file itself, or it is lost with the process.
+		if (!PendingMessages::GetInstance().IsEmpty())
+		{
+			int fd = LogFile::Open(true);
+			if (fd >= 0)
+			{
+				LogFile::WritePending(fd, "LogRing: ");
+				LogFile::Close(fd);
+			}
+		}
+		return;
+	}
+	ring.m_keepRunning.store(false, memory_order_release);
+	ring._wakeWriter();
+	if (ring.m_writer.joinable())
+	{
+		ring.m_writer.join();
+	}
+	LogStream::GetInstance().Stop();
+	int fd = LogFile::Open(true);
+	if (fd >= 0)
+	{
+		LogFile::WritePending(fd, "LogRing: ");
+		LogFile::Close(fd);
+	}
+	ring.m_shared->writerPid.store(0, memory_order_relaxed);
+	close(ring.m_writerFd);
+	ring.m_writerFd = -1;
+	// Keep further (static destructor) Log calls on the fallback path,
+	// numbered after everything already in the file.
+	ring.m_localSequence.store(
+		ring.m_shared->logSequence.load(memory_order_relaxed));
+	ring.m_shared = nullptr;
+}
+
+void LogRing::_atForkChild(void)
+{
+	LogRing& ring = GetInstance();
+	if (ring.m_writerFd.load() >= 0)
+	{
+		// Closing our copy of the fd does not release the parent's
+		// flock(), the parent still holds its own reference.
+		close(ring.m_writerFd);
+		ring.m_writerFd = -1;
+		// The std::thread object refers to a thread that doesn't
+		// exist in the child; forget it without joining.
+		new (&ring.m_writer) thread();
+	}
+	ring.m_electing.store(false, memory_order_relaxed);
+	ring.m_keepRunning.store(true, memory_order_relaxed);
+}
@@ -0,0 +1,127 @@
+// LogRing.h
+// Cross-process log ring.
+//
+// Every process that uses Log.cpp (ShadowX, headlessController, ...)
+// maps the same POSIX shared memory segment and appends its finished
+// log lines to it; a process never touches LOGFILE_NAME itself on the
+// normal path. Exactly one process is elected "writer" (it holds an
+// flock() on LOG_RING_WRITER_LOCK; the kernel drops that lock when
+// the process dies so another process takes over), and a thread in
+// that process drains the ring and writes it to LOGFILE_NAME in batches,
+// taking the fcntl() file lock once per batch instead of once per line.
+//
+// If the segment can't be mapped, the ring is full or a line is too
+// long for a slot, Append() returns false and Log falls back to the old
+// per-message fcntl()/PendingMessages path.
+
+#ifndef LOG_RING_H_
+#define LOG_RING_H_
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+
+using namespace std;
+
+#ifndef LOG_RING_SHM_NAME
+#define LOG_RING_SHM_NAME "/i2c_log_ring"
+#endif
+// Next to the segment itself, so every process using the ring agrees
+// on it whatever log file (LOG_FILE) each one was started with.
+#ifndef LOG_RING_WRITER_LOCK
+#define LOG_RING_WRITER_LOCK "/dev/shm" LOG_RING_SHM_NAME ".writer"
+#endif
+
+// Must be a power of two.
+#define LOG_RING_SLOTS 1024
+#define LOG_RING_TEXT_LEN 500
+// Bump when LogRingShared's layout changes; a process that finds a
+// segment with a different version won't use it.
+#define LOG_RING_VERSION 3
+
+// What a slot holds, and so which file the writer puts it in:
+enum LogRingKind
+{
+	LogRingText = 0,    // A finished text line for LOGFILE_NAME
+	LogRingBinary       // A LogBinary record for LOG_BINARY_FILE
+};
+
+struct LogRingSlot
+{
+	atomic<uint64_t> sequence;
+	uint16_t length;
+	uint16_t kind;
+	char text[LOG_RING_TEXT_LEN];
+};
+
+struct LogRingShared
+{
+	atomic<uint32_t> magic;
+	uint32_t version;
+	alignas(64) atomic<uint64_t> enqueuePos;
+	alignas(64) atomic<uint64_t> dequeuePos;
+	// Futex word the writer sleeps on when the ring is empty:
+	alignas(64) atomic<uint32_t> wakeup;
+	atomic<uint32_t> writerSleeping;
+	atomic<int32_t> writerPid;
+	// Lines lost because the ring was full or a producer died
+	// half way through an Append():
+	atomic<uint64_t> dropped;
+	// Log sequence numbers, shared by every process (see
+	// NextSequence()):
+	alignas(64) atomic<uint64_t> logSequence;
+	LogRingSlot slots[LOG_RING_SLOTS];
+};
+
+class LogRing
+{
+public:
+	static LogRing& GetInstance(void);
+	// Copies one finished log line (or binary record) into the ring.
+	// Never blocks.
+	bool Append(const char *msg, size_t len, LogRingKind kind = LogRingText);
+	bool IsAttached(void) const { return m_shared != nullptr; }
+	bool IsWriter(void) const { return m_writerFd.load(memory_order_relaxed) >= 0; }
+	// Next log sequence number, 1, 2, ... One relaxed fetch_add on a
+	// counter in the segment, so numbers are unique and ordered across
+	// every owner, thread and process; a process-local counter when
+	// the segment isn't mapped.
+	uint64_t NextSequence(void);
+	// Moves this process's PendingMessages (lines the fallback path
+	// couldn't write) into the ring, stopping if it fills up. Without
+	// it a process that isn't the writer would keep them until its
+	// next fallback write, which may never come.
+	void AppendPending(const string& owner);
+private:
+	LogRing();
+	LogRing(LogRing const& copy);  // Not allowed
+	LogRing& operator=(LogRing const& copy);  // Not allowed
+	bool _attach(void);
+	void _tryBecomeWriter(void);
+	void _writerThreadProc(void);
+	void _drain(vector<char>& text, size_t& textUsed,
+		vector<char>& binary, size_t& binaryUsed);
+	void _wakeWriter(void);
+	static void _atExit(void);
+	static void _atForkChild(void);
+	LogRingShared *m_shared = nullptr;
+	atomic<int> m_writerFd;
+	// Non-writers re-try the election at most this often:
+	atomic<int64_t> m_nextElectionMs;
+	atomic<bool> m_electing;
+	atomic<bool> m_keepRunning;
+	atomic<uint64_t> m_localSequence;
+	thread m_writer;
+	// Writer thread only:
+	uint64_t m_stuckPos = UINT64_MAX;
+	int64_t m_stuckSinceMs = 0;
+	static const uint64_t m_mask = LOG_RING_SLOTS - 1;
+	static const uint32_t m_magic = 0x4C4F4752;  // "LOGR"
+	static const int m_electionIntervalMs = 1000;
+	static const int m_stuckSlotMs = 1000;
+};
+
+#endif  // LOG_RING_H_
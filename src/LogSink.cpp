@@ -0,0 +1,489 @@
+// LogSink.cpp
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "Log.h"
+#include "LogIndex.h"
+#include "LogSink.h"
+#include "Metrics.h"
+#include "PendingMessages.h"
+#include "Scheduler.h"
+
+static MetricCounter syslogDropped("log_syslog_dropped_total",
+	"Log lines syslog never got (queue full, no syslogd)");
+
+// RFC 5424 severities (not <syslog.h>: its LOG_INFO etc. collide
+// with ours).
+static const int syslogSeverity[] =
+{
+	7,  // Trace  -> debug
+	7,  // Debug  -> debug
+	6,  // Info   -> informational
+	4,  // Warn   -> warning
+	3   // Error  -> error
+};
+
+LogSink::LogSink(const char *name, int level)
+	: m_name(name), m_level(level)
+{
+}
+
+LogSink::~LogSink()
+{
+}
+
+void LogSink::SetLevel(int level)
+{
+	m_level.store(level, memory_order_relaxed);
+}
+
+// --- Console ---
+
+ConsoleSink::ConsoleSink()
+	: LogSink("console", LOG_LEVEL_INFO)
+{
+	m_out.reserve(LOG_CONSOLE_BUFFER_SIZE);
+	m_err.reserve(LOG_CONSOLE_BUFFER_SIZE);
+}
+
+void ConsoleSink::Write(const LogSinkRecord& record)
+{
+	lock_guard<mutex> lock(m_mutex);
+	// Errors in red, warnings in yellow, info in the current
+	// header color (see Log::LogHeader()).
+	if (record.level >= LogLevelError)
+	{
+		m_err += TEXT_RED;
+		m_err += record.msg;
+		m_err += TEXT_NORMAL "\n";
+	}
+	else if (record.level == LogLevelWarn)
+	{
+		m_err += TEXT_YELLOW;
+		m_err += record.msg;
+		m_err += TEXT_NORMAL "\n";
+	}
+	else
+	{
+		m_out += record.color;
+		m_out += record.msg;
+		m_out += TEXT_NORMAL "\n";
+	}
+	if (record.level >= LogLevelError
+		|| m_out.length() + m_err.length() >= LOG_CONSOLE_BUFFER_SIZE)
+	{
+		_flushLocked();
+	}
+}
+
+void ConsoleSink::Flush(void)
+{
+	lock_guard<mutex> lock(m_mutex);
+	_flushLocked();
+}
+
+void ConsoleSink::_flushLocked(void)
+{
+	// Anybody else printing with cout (Main, ...) goes first.
+	if (!m_out.empty() || !m_err.empty())
+	{
+		cout.flush();
+	}
+	if (!m_out.empty())
+	{
+		write(STDOUT_FILENO, m_out.data(), m_out.length());
+		m_out.clear();
+	}
+	if (!m_err.empty())
+	{
+		write(STDERR_FILENO, m_err.data(), m_err.length());
+		m_err.clear();
+	}
+}
+
+void ConsoleSink::AfterFork(void)
+{
+	// The parent prints what it buffered.
+	new (&m_mutex) mutex();
+	m_out.clear();
+	m_err.clear();
+}
+
+// --- File ---
+
+FileSink::FileSink()
+	: LogSink("file", LOG_LEVEL_TRACE)
+{
+}
+
+void FileSink::Write(const LogSinkRecord& record)
+{
+	const string& line = record.line;
+	// Normal path: hand the line to the cross-process ring, the
+	// elected writer process puts it in the file.
+	LogRing& ring = LogRing::GetInstance();
+	if (ring.Append(line.c_str(), line.length()))
+	{
+		// Lines deferred while the ring was full follow it in.
+		if (!PendingMessages::GetInstance().IsEmpty())
+		{
+			ring.AppendPending(record.owner);
+		}
+		return;
+	}
+
+	// Fallback: no ring (or it is full / line too long), write it
+	// myself if I can get the file lock without waiting.
+	int fd = LogFile::Open(false);
+	if (fd >= 0)
+	{
+		// Write any pending error / info messages first.
+		// These are added to PendingMessages if LogFile::Open()
+		// fails so we don't block a thread or process
+		// if somebody else has an exclusive open on the log file.
+		LogFile::WritePending(fd, record.owner);
+		write(fd, line.c_str(), line.length());
+		LogFile::Close(fd);
+	}
+	else
+	{
+		// Couldn't get exclusive file write access, another
+		// thread is writing. Add to "Pending" and I will clear
+		// this out (see above) when I get exclusive access.
+		// The queue is bounded; if it is full the oldest
+		// pending message is dropped (and counted).
+		string pend(LOG_INDEX_DEFERRED_PREFIX);  // Logging was deferred
+		pend += line;
+		PendingMessages::GetInstance().Push(pend.c_str(), pend.length());
+	}
+}
+
+// --- Syslog ---
+
+SyslogSink::SyslogSink()
+	: LogSink("syslog", LOG_LEVEL_OFF), m_fd(-1), m_dropped(0)
+{
+	char host[256];
+	if (gethostname(host, sizeof(host)) != 0)
+	{
+		host[0] = 0;
+	}
+	host[sizeof(host) - 1] = 0;
+	m_hostName = (host[0] != 0) ? host : "-";
+	m_appName = program_invocation_short_name;
+	if (m_appName.empty())
+	{
+		m_appName = "-";
+	}
+}
+
+bool SyslogSink::_connect(void)
+{
+	// Caller holds m_sendMutex.
+	if (m_fd >= 0)
+	{
+		return true;
+	}
+	int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+	{
+		return false;
+	}
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, LOG_SYSLOG_SOCKET, sizeof(addr.sun_path) - 1);
+	if (connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0)
+	{
+		close(fd);
+		return false;
+	}
+	m_fd = fd;
+	return true;
+}
+
+void SyslogSink::Write(const LogSinkRecord& record)
+{
+	// <PRI>1 TIMESTAMP HOSTNAME APP-NAME PROCID MSGID - MSG
+	// MSGID is the owner ("I2c"), MSG is "[AT: ]msg".
+	int level = (record.level <= LogLevelError) ? record.level : LogLevelError;
+	timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	struct tm tim;
+	gmtime_r(&ts.tv_sec, &tim);
+	string owner(record.owner);  // "xyz: "
+	if (owner.length() >= 2)
+	{
+		owner.resize(owner.length() - 2);
+	}
+	for (auto &c : owner)
+	{
+		if (c <= ' ' || c > '~')
+		{
+			c = '_';
+		}
+	}
+	if (owner.empty())
+	{
+		owner = "-";
+	}
+	const char *at = "";
+	if (record.at != nullptr && level != LogLevelInfo)
+	{
+		const char *p = strrchr(record.at, '/');
+		at = (p != nullptr) ? (p + 1) : record.at;
+	}
+	bool queued = m_queue.TryPush([&](Datagram& d)
+	{
+		int n = snprintf(d.text, sizeof(d.text),
+			"<%d>1 %04d-%02d-%02dT%02d:%02d:%02d.%06ldZ %s %s %d %.32s - %s%s",
+			LOG_SYSLOG_FACILITY * 8 + syslogSeverity[level],
+			tim.tm_year + 1900, tim.tm_mon + 1, tim.tm_mday,
+			tim.tm_hour, tim.tm_min, tim.tm_sec, ts.tv_nsec / 1000,
+			m_hostName.c_str(), m_appName.c_str(), (int)getpid(),
+			owner.c_str(), at, record.msg);
+		d.length = (n < 0) ? 0
+			: ((size_t)n >= sizeof(d.text)) ? (sizeof(d.text) - 1) : n;
+	});
+	if (!queued)
+	{
+		m_dropped.fetch_add(1, memory_order_relaxed);
+		syslogDropped.Add();
+	}
+	if (record.level >= LogLevelError)
+	{
+		Flush();
+	}
+}
+
+void SyslogSink::Flush(void)
+{
+	if (m_queue.IsEmpty())
+	{
+		return;
+	}
+	lock_guard<mutex> lock(m_sendMutex);
+	if (!_connect())
+	{
+		// No syslogd: throw the queue away rather than let it fill.
+		while (m_queue.TryPop([&](Datagram&) { m_dropped.fetch_add(1); }))
+		{
+			syslogDropped.Add();
+		}
+		return;
+	}
+	// Up to LOG_SYSLOG_QUEUE_SIZE datagrams in one system call.
+	static Datagram batch[LOG_SYSLOG_QUEUE_SIZE];
+	static iovec iov[LOG_SYSLOG_QUEUE_SIZE];
+	static mmsghdr msgs[LOG_SYSLOG_QUEUE_SIZE];
+	int count = 0;
+	while (count < LOG_SYSLOG_QUEUE_SIZE
+		&& m_queue.TryPop([&](Datagram& d) { batch[count] = d; }))
+	{
+		iov[count].iov_base = batch[count].text;
+		iov[count].iov_len = batch[count].length;
+		memset(&msgs[count], 0, sizeof(msgs[count]));
+		msgs[count].msg_hdr.msg_iov = &iov[count];
+		msgs[count].msg_hdr.msg_iovlen = 1;
+		count++;
+	}
+	int sent = 0;
+	while (sent < count)
+	{
+		int n = sendmmsg(m_fd, msgs + sent, count - sent, MSG_DONTWAIT);
+		if (n > 0)
+		{
+			sent += n;
+		}
+		else if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		else
+		{
+			if (n < 0 && errno != EAGAIN)
+			{
+				// syslogd restarted: reconnect next time.
+				close(m_fd);
+				m_fd = -1;
+			}
+			m_dropped.fetch_add(count - sent, memory_order_relaxed);
+			syslogDropped.Add(count - sent);
+			break;
+		}
+	}
+}
+
+void SyslogSink::AfterFork(void)
+{
+	// Keep the socket (it is fine to share), just the lock is suspect.
+	new (&m_sendMutex) mutex();
+}
+
+uint64_t SyslogSink::GetDroppedCount(void) const
+{
+	return m_dropped.load(memory_order_relaxed);
+}
+
+// --- LogSinks ---
+
+LogSinks& LogSinks::GetInstance(void)
+{
+	// Never deleted, see LogRing::GetInstance().
+	static LogSinks *instance = new LogSinks();
+	return *instance;
+}
+
+LogSinks::LogSinks()
+	: m_count(0), m_flushTask(0), m_flusherStarted(false), m_keepRunning(true)
+{
+	for (auto &sink : m_sinks)
+	{
+		sink.store(nullptr, memory_order_relaxed);
+	}
+	Add(&m_console);
+	Add(&m_file);
+	Add(&m_syslog);
+	const char *env = getenv("LOG_SINKS");
+	if (env != nullptr)
+	{
+		Configure(env);
+	}
+	pthread_atfork(nullptr, nullptr, _atForkChild);
+}
+
+bool LogSinks::Add(LogSink *sink)
+{
+	int i = m_count.fetch_add(1, memory_order_relaxed);
+	if (i >= LOG_MAX_SINKS)
+	{
+		m_count.fetch_sub(1, memory_order_relaxed);
+		return false;
+	}
+	m_sinks[i].store(sink, memory_order_release);
+	return true;
+}
+
+LogSink *LogSinks::Find(const char *name)
+{
+	int count = m_count.load(memory_order_acquire);
+	for (int i = 0; i < count && i < LOG_MAX_SINKS; i++)
+	{
+		LogSink *sink = m_sinks[i].load(memory_order_acquire);
+		if (sink != nullptr && strcasecmp(sink->Name(), name) == 0)
+		{
+			return sink;
+		}
+	}
+	return nullptr;
+}
+
+void LogSinks::Configure(const char *spec)
+{
+	stringstream items(spec);
+	string item;
+	while (getline(items, item, ','))
+	{
+		size_t eq = item.find('=');
+		if (eq == string::npos)
+		{
+			continue;
+		}
+		int level;
+		LogSink *sink = Find(item.substr(0, eq).c_str());
+		if (sink != nullptr && Log::LevelFromName(item.substr(eq + 1).c_str(), level))
+		{
+			sink->SetLevel(level);
+		}
+	}
+}
+
+void LogSinks::Write(const LogSinkRecord& record)
+{
+	int count = m_count.load(memory_order_acquire);
+	for (int i = 0; i < count && i < LOG_MAX_SINKS; i++)
+	{
+		LogSink *sink = m_sinks[i].load(memory_order_acquire);
+		if (sink != nullptr && sink->Accepts(record.level))
+		{
+			sink->Write(record);
+		}
+	}
+	if (!m_flusherStarted.load(memory_order_acquire))
+	{
+		_startFlusher();
+	}
+	else if (!m_keepRunning.load(memory_order_relaxed) || m_flushTask == 0)
+	{
+		// Logged from a static destructor after _atExit(), or the
+		// Scheduler couldn't start: nobody is going to flush for us.
+		Flush();
+	}
+}
+
+void LogSinks::Flush(void)
+{
+	int count = m_count.load(memory_order_acquire);
+	for (int i = 0; i < count && i < LOG_MAX_SINKS; i++)
+	{
+		LogSink *sink = m_sinks[i].load(memory_order_acquire);
+		if (sink != nullptr)
+		{
+			sink->Flush();
+		}
+	}
+}
+
+void LogSinks::_startFlusher(void)
+{
+	lock_guard<mutex> lock(m_flusherMutex);
+	if (m_flusherStarted.load(memory_order_relaxed) || !m_keepRunning.load())
+	{
+		return;
+	}
+	// LogRing's atexit() handler is registered first so it runs
+	// after ours; our final flush can still use the ring. The
+	// Scheduler registers its own after ours, so it has stopped
+	// running the flush task by the time we flush.
+	LogRing::GetInstance();
+	static int atExitInstalled = atexit(_atExit);
+	(void)atExitInstalled;
+	// A quarter of the interval late is fine for console output.
+	m_flushTask = Scheduler::GetInstance().Add("LogSinks::Flush",
+		LOG_CONSOLE_FLUSH_MS, LOG_CONSOLE_FLUSH_MS / 4, [this]() { Flush(); });
+	m_flusherStarted.store(true, memory_order_release);
+}
+
+void LogSinks::_atExit(void)
+{
+	LogSinks& sinks = GetInstance();
+	{
+		lock_guard<mutex> lock(sinks.m_flusherMutex);
+		sinks.m_keepRunning.store(false);
+	}
+	if (sinks.m_flushTask != 0)
+	{
+		Scheduler::GetInstance().Remove(sinks.m_flushTask);
+	}
+	sinks.Flush();
+}
+
+void LogSinks::_atForkChild(void)
+{
+	LogSinks& sinks = GetInstance();
+	// The Scheduler drops the parent's tasks in the child; the next
+	// Write() adds the flush task again.
+	new (&sinks.m_flusherMutex) mutex();
+	sinks.m_flushTask = 0;
+	sinks.m_flusherStarted.store(false, memory_order_relaxed);
+	int count = sinks.m_count.load(memory_order_acquire);
+	for (int i = 0; i < count && i < LOG_MAX_SINKS; i++)
+	{
+		LogSink *sink = sinks.m_sinks[i].load(memory_order_acquire);
+		if (sink != nullptr)
+		{
+			sink->AfterFork();
+		}
+	}
+}
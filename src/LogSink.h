@@ -0,0 +1,168 @@
+// LogSink.h
+// Where finished log lines go.
+//
+// Log::_logIt() USED TO write every line to std::cout / cerr (one
+// flush per line) and to LOGFILE_NAME, period. Now it hands the line
+// to LogSinks, which passes it on to each registered sink whose own
+// level lets it through:
+//
+//   ConsoleSink  colored text to stdout / stderr, buffered; flushed
+//                every LOG_CONSOLE_FLUSH_MS, when the buffer fills or
+//                right away for an error. Level Info by default (as
+//                before, trace / debug never reached the console).
+//   FileSink     the log file via LogRing / LogFile, as before.
+//                Level Trace by default.
+//   SyslogSink   RFC 5424 datagrams to the local syslog socket
+//                (/dev/log). Queued and sent in batches (sendmmsg(),
+//                MSG_DONTWAIT) so a slow or missing syslogd never
+//                blocks a caller; lines it can't take are dropped and
+//                counted. Off by default.
+//
+// Configure at run time with LogSinks::Configure() or the
+// environment, same level names as LOG_LEVEL:
+//     LOG_SINKS="console=off,syslog=info"       (headless unit)
+// and the file with LOG_FILE=/path/to/file (default LOGFILE_NAME).
+// The owner's level (LOG_LEVEL) is checked first, a sink can only
+// narrow it further.
+
+#ifndef LOG_SINK_H_
+#define LOG_SINK_H_
+
+#include <atomic>
+#include <mutex>
+#include <string>
+
+#include <stdint.h>
+
+#include "BoundedQueue.h"
+
+using namespace std;
+
+#define LOG_MAX_SINKS 8
+#define LOG_CONSOLE_FLUSH_MS 250
+#define LOG_CONSOLE_BUFFER_SIZE 4096
+// Must be a power of two.
+#define LOG_SYSLOG_QUEUE_SIZE 64
+#define LOG_SYSLOG_MAX_LEN 480
+#ifndef LOG_SYSLOG_SOCKET
+#define LOG_SYSLOG_SOCKET "/dev/log"
+#endif
+// RFC 5424 facility: 1 == user-level messages.
+#ifndef LOG_SYSLOG_FACILITY
+#define LOG_SYSLOG_FACILITY 1
+#endif
+
+// One finished log line, as Log::_logIt() built it.
+struct LogSinkRecord
+{
+	int level;             // LogLevel
+	const string& owner;   // "xyz: "
+	const char *at;        // AT, or nullptr
+	const char *msg;       // The message alone
+	const string& line;    // "<E> xyz: 001 PID: ... msg\r\n"
+	const char *color;     // Console color for an Info line
+};
+
+class LogSink
+{
+public:
+	LogSink(const char *name, int level);
+	virtual ~LogSink();
+	const char *Name(void) const { return m_name; }
+	bool Accepts(int level) const
+	{
+		return level >= m_level.load(memory_order_relaxed);
+	}
+	void SetLevel(int level);
+	// Called only when Accepts(record.level).
+	virtual void Write(const LogSinkRecord& record) = 0;
+	// Called every LOG_CONSOLE_FLUSH_MS (a Scheduler task) and at
+	// exit.
+	virtual void Flush(void) { }
+	// In a fork()ed child, drop anything that only made sense in the
+	// parent (locks, sockets).
+	virtual void AfterFork(void) { }
+private:
+	const char *m_name;
+	atomic<int> m_level;
+};
+
+class ConsoleSink : public LogSink
+{
+public:
+	ConsoleSink();
+	void Write(const LogSinkRecord& record) override;
+	void Flush(void) override;
+	void AfterFork(void) override;
+private:
+	void _flushLocked(void);
+	mutex m_mutex;
+	string m_out;  // stdout (info)
+	string m_err;  // stderr (warnings, errors)
+};
+
+class FileSink : public LogSink
+{
+public:
+	FileSink();
+	void Write(const LogSinkRecord& record) override;
+};
+
+class SyslogSink : public LogSink
+{
+public:
+	SyslogSink();
+	void Write(const LogSinkRecord& record) override;
+	void Flush(void) override;
+	void AfterFork(void) override;
+	uint64_t GetDroppedCount(void) const;
+private:
+	struct Datagram
+	{
+		uint16_t length;
+		char text[LOG_SYSLOG_MAX_LEN];
+	};
+	bool _connect(void);
+	BoundedQueue<Datagram, LOG_SYSLOG_QUEUE_SIZE> m_queue;
+	mutex m_sendMutex;
+	int m_fd;
+	atomic<uint64_t> m_dropped;
+	string m_hostName;
+	string m_appName;
+};
+
+class LogSinks
+{
+public:
+	static LogSinks& GetInstance(void);
+	// Passes the line to every sink that accepts its level.
+	void Write(const LogSinkRecord& record);
+	// Adds a sink of your own; it is never removed (SetLevel(Off) to
+	// stop it) and must live for the rest of the process.
+	bool Add(LogSink *sink);
+	// "name=level[,name=level]...", e.g. "console=off,syslog=warn".
+	void Configure(const char *spec);
+	LogSink *Find(const char *name);
+	ConsoleSink& Console(void) { return m_console; }
+	FileSink& File(void) { return m_file; }
+	SyslogSink& Syslog(void) { return m_syslog; }
+	void Flush(void);
+private:
+	LogSinks();
+	LogSinks(LogSinks const& copy);  // Not allowed
+	LogSinks& operator=(LogSinks const& copy);  // Not allowed
+	void _startFlusher(void);
+	static void _atExit(void);
+	static void _atForkChild(void);
+	ConsoleSink m_console;
+	FileSink m_file;
+	SyslogSink m_syslog;
+	atomic<LogSink *> m_sinks[LOG_MAX_SINKS];
+	atomic<int> m_count;
+	mutex m_flusherMutex;
+	int m_flushTask;  // Scheduler task id, 0: none
+	atomic<bool> m_flusherStarted;
+	atomic<bool> m_keepRunning;
+};
+
+#endif  // LOG_SINK_H_
@@ -0,0 +1,323 @@
+// LogStream.cpp
+
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "Log.h"
+#include "LogStream.h"
+
+LogStream& LogStream::GetInstance(void)
+{
+	// Never deleted, see LogRing::GetInstance().
+	static LogStream *instance = new LogStream();
+	return *instance;
+}
+
+LogStream::LogStream()
+	: m_lastSequence(0), m_listenFd(-1), m_wakeFd(-1), m_running(false)
+{
+	pthread_atfork(nullptr, nullptr, _atForkChild);
+}
+
+bool LogStream::Start(void)
+{
+	if (m_running.load())
+	{
+		return true;
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+	{
+		return false;
+	}
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, LOG_STREAM_SOCKET, sizeof(addr.sun_path) - 1);
+	// We are the elected writer, so any socket file left there
+	// belongs to a writer that has died.
+	unlink(LOG_STREAM_SOCKET);
+	if (bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 4) != 0)
+	{
+		close(fd);
+		return false;
+	}
+	chmod(LOG_STREAM_SOCKET, 0666);
+	m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m_wakeFd < 0)
+	{
+		close(fd);
+		unlink(LOG_STREAM_SOCKET);
+		return false;
+	}
+	m_listenFd = fd;
+	m_running.store(true);
+	m_server = thread(&LogStream::_serverThreadProc, this);
+	return true;
+}
+
+void LogStream::Stop(void)
+{
+	if (!m_running.exchange(false))
+	{
+		return;
+	}
+	_wake();
+	if (m_server.joinable())
+	{
+		m_server.join();
+	}
+	lock_guard<mutex> lock(m_mutex);
+	for (auto &client : m_clients)
+	{
+		close(client.fd);
+	}
+	m_clients.clear();
+	close(m_listenFd);
+	m_listenFd = -1;
+	close(m_wakeFd);
+	m_wakeFd = -1;
+	unlink(LOG_STREAM_SOCKET);
+}
+
+void LogStream::Publish(const char *lines, size_t len)
+{
+	if (!m_running.load(memory_order_relaxed))
+	{
+		return;
+	}
+	{
+		lock_guard<mutex> lock(m_mutex);
+		size_t start = 0;
+		while (start < len)
+		{
+			const char *nl = (const char *)memchr(lines + start, '\n', len - start);
+			size_t end = (nl != nullptr) ? (nl - lines + 1) : len;
+			Line line;
+			line.text.assign(lines + start, end - start);
+			line.sequence = SequenceOf(line.text.data(), line.text.length());
+			if (line.sequence == 0)
+			{
+				line.sequence = m_lastSequence;  // A continuation line
+			}
+			m_lastSequence = line.sequence;
+			for (auto &client : m_clients)
+			{
+				if (client.subscribed)
+				{
+					client.out += line.text;
+				}
+			}
+			m_backlog.push_back(move(line));
+			if (m_backlog.size() > LOG_STREAM_BACKLOG_LINES)
+			{
+				m_backlog.pop_front();
+			}
+			start = end;
+		}
+	}
+	_wake();
+}
+
+void LogStream::_wake(void)
+{
+	uint64_t one = 1;
+	if (m_wakeFd >= 0)
+	{
+		write(m_wakeFd, &one, sizeof(one));
+	}
+}
+
+void LogStream::_subscribe(Client& client)
+{
+	// Caller holds m_mutex. 'request' is a whole line.
+	client.subscribed = true;
+	uint64_t from;
+	if (sscanf(client.request.c_str(), "FROM %llu", (unsigned long long *)&from) != 1)
+	{
+		return;  // "LIVE" (or nonsense): new lines only.
+	}
+	// "FROM 0" asks for whatever there is, so nothing is missing.
+	if (from > 0 && !m_backlog.empty() && from < m_backlog.front().sequence)
+	{
+		client.out += "# GAP " + to_string(from) + " "
+			+ to_string(m_backlog.front().sequence) + "\r\n";
+	}
+	for (auto &line : m_backlog)
+	{
+		if (line.sequence >= from)
+		{
+			client.out += line.text;
+		}
+	}
+}
+
+void LogStream::_accept(void)
+{
+	for (;;)
+	{
+		int fd = accept4(m_listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			return;
+		}
+		lock_guard<mutex> lock(m_mutex);
+		if (m_clients.size() >= LOG_STREAM_MAX_CLIENTS)
+		{
+			close(fd);
+			continue;
+		}
+		Client client;
+		client.fd = fd;
+		client.subscribed = false;
+		m_clients.push_back(client);
+	}
+}
+
+// Returns false when the client should be dropped.
+bool LogStream::_read(Client& client)
+{
+	char buf[LOG_STREAM_MAX_REQUEST];
+	ssize_t n = recv(client.fd, buf, sizeof(buf), MSG_DONTWAIT);
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+	{
+		return false;  // Gone.
+	}
+	if (n < 0 || client.subscribed)
+	{
+		return true;  // Anything after the request is ignored.
+	}
+	client.request.append(buf, n);
+	if (client.request.find('\n') != string::npos)
+	{
+		_subscribe(client);
+	}
+	else if (client.request.length() >= LOG_STREAM_MAX_REQUEST)
+	{
+		return false;
+	}
+	return true;
+}
+
+// Returns false when the client should be dropped.
+bool LogStream::_write(Client& client)
+{
+	while (!client.out.empty())
+	{
+		ssize_t n = send(client.fd, client.out.data(), client.out.length(),
+			MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n > 0)
+		{
+			client.out.erase(0, n);
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n < 0 && errno == EAGAIN)
+		{
+			// Too far behind: let it reconnect with FROM rather than
+			// buffer without limit here.
+			return client.out.length() <= LOG_STREAM_CLIENT_BUFFER;
+		}
+		return false;
+	}
+	return true;
+}
+
+void LogStream::_serverThreadProc(void)
+{
+	FlightRecorder::InstallAltStack();
+	vector<pollfd> fds;
+	while (m_running.load())
+	{
+		fds.clear();
+		fds.push_back({ m_listenFd, POLLIN, 0 });
+		fds.push_back({ m_wakeFd, POLLIN, 0 });
+		{
+			lock_guard<mutex> lock(m_mutex);
+			for (auto &client : m_clients)
+			{
+				short events = POLLIN;
+				if (!client.out.empty())
+				{
+					events |= POLLOUT;
+				}
+				fds.push_back({ client.fd, events, 0 });
+			}
+		}
+		if (poll(fds.data(), fds.size(), -1) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			break;
+		}
+		if (fds[1].revents & POLLIN)
+		{
+			uint64_t count;
+			read(m_wakeFd, &count, sizeof(count));
+		}
+		if (fds[0].revents & POLLIN)
+		{
+			_accept();
+		}
+		lock_guard<mutex> lock(m_mutex);
+		// Clients only change in this thread, so fds[i + 2] is still
+		// m_clients[i]. Newly accepted ones have no events yet.
+		for (size_t i = 0; i < m_clients.size(); )
+		{
+			Client& client = m_clients[i];
+			short revents = (i + 2 < fds.size()) ? fds[i + 2].revents : 0;
+			bool keep = true;
+			if (revents & (POLLIN | POLLHUP | POLLERR))
+			{
+				keep = _read(client);
+			}
+			if (keep)
+			{
+				keep = _write(client);
+			}
+			if (!keep)
+			{
+				close(client.fd);
+				m_clients.erase(m_clients.begin() + i);
+				if (i + 2 < fds.size())
+				{
+					fds.erase(fds.begin() + i + 2);
+				}
+				continue;
+			}
+			i++;
+		}
+	}
+}
+
+void LogStream::_atForkChild(void)
+{
+	// The child is not the writer: no server thread, and it must not
+	// hold on to the parent's sockets.
+	LogStream& stream = GetInstance();
+	if (!stream.m_running.load())
+	{
+		return;
+	}
+	new (&stream.m_server) thread();
+	new (&stream.m_mutex) mutex();
+	for (auto &client : stream.m_clients)
+	{
+		close(client.fd);
+	}
+	stream.m_clients.clear();
+	stream.m_backlog.clear();
+	close(stream.m_listenFd);
+	stream.m_listenFd = -1;
+	close(stream.m_wakeFd);
+	stream.m_wakeFd = -1;
+	stream.m_running.store(false);
+}
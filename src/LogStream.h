@@ -0,0 +1,128 @@
+// LogStream.h
+// Live log lines for local clients, pushed rather than polled.
+//
+// LOGFILE_NAME lives under /home/pi so the Android app can read it,
+// but a reader has to keep re-reading the file to find new lines, and
+// LogFile trims it from 64 KB back to 32 KB, which breaks naive tailing.
+// Instead, the LogRing writer process (which sees every line from
+// every process) serves them on a Unix stream socket,
+// LOG_STREAM_SOCKET, as they are written.
+//
+// Protocol (text, one request line from the client):
+//     "FROM <seq>\n"  Replay every line still in the backlog (the last
+//                     LOG_STREAM_BACKLOG_LINES) with a sequence number
+//                     >= seq, then stream new ones. "FROM 0" replays
+//                     the whole backlog.
+//     "LIVE\n"        New lines only.
+// Lines are sent exactly as they go into the file ("<E> xyz: SEQ
+// TID: ...\r\n"). If lines a client asked for have already left the
+// backlog, it first gets "# GAP <seq> <first seq available>\r\n" (not
+// for "FROM 0") and should fill the gap from the file. Lines without
+// a sequence number (stack traces) go with the line before them. A
+// client that falls more than LOG_STREAM_CLIENT_BUFFER bytes behind
+// is disconnected; it reconnects with "FROM <last seq + 1>" and loses
+// nothing still in the backlog.
+// See tools/logtail.cpp.
+//
+// Only lines that go through LogRing are streamed; the fallback path
+// (no ring, ring full) only reaches the file.
+
+#ifndef LOG_STREAM_H_
+#define LOG_STREAM_H_
+
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+
+#include "LogRing.h"
+
+using namespace std;
+
+#ifndef LOG_STREAM_SOCKET
+#define LOG_STREAM_SOCKET "/dev/shm" LOG_RING_SHM_NAME ".sock"
+#endif
+#define LOG_STREAM_BACKLOG_LINES 1024
+#define LOG_STREAM_MAX_CLIENTS 8
+#define LOG_STREAM_CLIENT_BUFFER 65536
+#define LOG_STREAM_MAX_REQUEST 64
+
+class LogStream
+{
+public:
+	static LogStream& GetInstance(void);
+	// Called by LogRing when this process becomes the writer.
+	bool Start(void);
+	void Stop(void);
+	// Called by LogRing's writer thread with each batch of text lines
+	// it has written to the file.
+	void Publish(const char *lines, size_t len);
+	// "<E> xyz: 123 TID: ..." -> 123, 0 if there is no sequence number.
+	// Inline so clients (tools/logtail) can use it without Log.
+	static uint64_t SequenceOf(const char *line, size_t len)
+	{
+		// "<E> " owner ": " SEQ " TID: "; the owner name is free text,
+		// so find " TID: " and walk back over the digits.
+		static const char tid[] = " TID: ";
+		const size_t tidLen = sizeof(tid) - 1;
+		for (size_t i = 4; i + tidLen <= len; i++)
+		{
+			if (memcmp(line + i, tid, tidLen) != 0)
+			{
+				continue;
+			}
+			size_t start = i;
+			while (start > 0 && line[start - 1] >= '0' && line[start - 1] <= '9')
+			{
+				start--;
+			}
+			uint64_t seq = 0;
+			for (size_t j = start; j < i; j++)
+			{
+				seq = seq * 10 + (line[j] - '0');
+			}
+			return seq;
+		}
+		return 0;
+	}
+private:
+	LogStream();
+	LogStream(LogStream const& copy);  // Not allowed
+	LogStream& operator=(LogStream const& copy);  // Not allowed
+	struct Line
+	{
+		// A line with no number of its own (a stack trace line) has
+		// the one of the line before it, so FROM replays it with it.
+		uint64_t sequence;
+		string text;
+	};
+	struct Client
+	{
+		int fd;
+		bool subscribed;
+		string request;
+		string out;
+	};
+	void _serverThreadProc(void);
+	void _accept(void);
+	bool _read(Client& client);
+	bool _write(Client& client);
+	void _subscribe(Client& client);
+	void _wake(void);
+	static void _atForkChild(void);
+	mutex m_mutex;  // m_backlog, m_clients
+	deque<Line> m_backlog;
+	uint64_t m_lastSequence;  // Of the last line published
+	vector<Client> m_clients;
+	int m_listenFd;
+	int m_wakeFd;  // eventfd
+	thread m_server;
+	atomic<bool> m_running;
+};
+
+#endif  // LOG_STREAM_H_
@@ -7,15 +7,35 @@
 using namespace std;
 using namespace chrono;
 
+#include "BatteryChecker.h"
 #include "Log.h"
+#include "Metrics.h"
 #include "PwmServoDriver.h"
+#include "Scheduler.h"
 
 int main(int argc, char *argv[])
 {
+    // On SIGSEGV / SIGABRT etc. dump the recent (trace level) history
+    // to LOGFILE_NAME ".crash":
+    FlightRecorder::InstallCrashHandler();
+    // With -DPROFILE_ENABLED=1, 'kill -USR2 <pid>' logs the
+    // PROFILE_SCOPE() table (see Profile.h):
+    Profile::InstallSignalHandler();
+    // I2C / PWM / log counters for 'pwmstat -m' (see Metrics.h):
+    Metrics::Serve();
+
     PwmServoDriver pwm(0x40);
     // Reset chip, set freq to 4096:
     pwm.begin();
 
+    // Charger status every 15 s, on the same (already open) bus:
+    BatteryChecker battery;
+    battery.Start();
+    // And the chip every 5 s; both are Scheduler tasks, on one thread
+    // and (same jitter budget) mostly the same wakeups:
+    int healthTask = Scheduler::GetInstance().Add("PwmServoDriver::CheckHealth",
+        5000, 1000, [&pwm]() { pwm.CheckHealth(); });
+
     // bool PwmServoDriver::setPWM(uint8_t num, uint16_t on, uint16_t off)
     //     num: One of the PWM output pins, from 0 to 15
     //      on: At what point in the 4096 - part cycle
@@ -34,5 +54,8 @@ int main(int argc, char *argv[])
 
     // Still need to use the DIRECTION GPIO for FWD / REV...
 
+    // 'pwm' goes out of scope next:
+    Scheduler::GetInstance().Remove(healthTask);
+
 
 }
\ No newline at end of file
@@ -0,0 +1,262 @@
+// Metrics.cpp
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Log.h"
+#include "LogHandle.h"
+#include "Metrics.h"
+#include "Scheduler.h"
+
+atomic<Metric *> Metrics::m_metrics[METRICS_MAX];
+atomic<int> Metrics::m_count(0);
+atomic<int> Metrics::m_slotCount(0);
+atomic<MetricsThread *> Metrics::m_threads(nullptr);
+
+Metric::Metric(const char *name, const char *help, MetricType type)
+	: m_name(name), m_help(help), m_type(type), m_gauge(0)
+{
+	int slots = 0;
+	if (type == MetricTypeCounter)
+	{
+		slots = 1;
+	}
+	else if (type == MetricTypeHistogram)
+	{
+		slots = METRICS_BUCKETS + 1;
+	}
+	m_slot = Metrics::Register(this, slots);
+}
+
+int Metrics::Register(Metric *metric, int slots)
+{
+	// Metrics are statics, constructed once under the compiler's
+	// guard (or before main()), so no lock here. Slots are taken
+	// before the metric is listed: a reader never sees a metric
+	// without its slots.
+	int slot = -1;
+	if (slots > 0)
+	{
+		slot = m_slotCount.fetch_add(slots, memory_order_relaxed);
+		if (slot + slots > METRICS_MAX_SLOTS)
+		{
+			return -1;
+		}
+	}
+	int id = m_count.fetch_add(1, memory_order_relaxed);
+	if (id >= METRICS_MAX)
+	{
+		return -1;
+	}
+	m_metrics[id].store(metric, memory_order_release);
+	return slot;
+}
+
+MetricsThread *Metrics::_newThread(void)
+{
+	// Never freed: a reader may be summing it, and an exited thread's
+	// counts still count.
+	MetricsThread *t = new MetricsThread();
+	for (auto &s : t->slots)
+	{
+		s.store(0, memory_order_relaxed);
+	}
+	MetricsThread *head = m_threads.load(memory_order_relaxed);
+	do
+	{
+		t->next = head;
+	} while (!m_threads.compare_exchange_weak(head, t,
+		memory_order_release, memory_order_relaxed));
+	return t;
+}
+
+uint64_t Metrics::Sum(int slot)
+{
+	uint64_t sum = 0;
+	for (MetricsThread *t = m_threads.load(memory_order_acquire);
+		t != nullptr; t = t->next)
+	{
+		sum += t->slots[slot].load(memory_order_relaxed);
+	}
+	return sum;
+}
+
+// Bucket i's upper bound (inclusive); the last has none.
+static uint64_t bucketBound(int i)
+{
+	return (1ULL << i) - 1;
+}
+
+// Upper bound of the bucket holding the 'q' quantile, "inf" if that's
+// the last one.
+static string quantile(const uint64_t *buckets, uint64_t count, double q)
+{
+	uint64_t want = (uint64_t)(count * q + 0.5);
+	uint64_t seen = 0;
+	for (int i = 0; i < METRICS_BUCKETS - 1; i++)
+	{
+		seen += buckets[i];
+		if (seen >= want && seen > 0)
+		{
+			return to_string(bucketBound(i));
+		}
+	}
+	return "inf";
+}
+
+// Every listed metric, in registration order.
+template<typename F>
+static void forEach(atomic<Metric *> *metrics, int count, F f)
+{
+	for (int i = 0; i < min(count, METRICS_MAX); i++)
+	{
+		const Metric *metric = metrics[i].load(memory_order_acquire);
+		if (metric != nullptr && (metric->Slot() >= 0 || metric->Type() == MetricTypeGauge))
+		{
+			f(*metric);
+		}
+	}
+}
+
+string Metrics::Render(void)
+{
+	static const char *typeNames[] = { "counter", "gauge", "histogram" };
+	string s;
+	char line[256];
+	forEach(m_metrics, m_count.load(memory_order_acquire), [&](const Metric& m)
+	{
+		snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n",
+			m.Name(), m.Help(), m.Name(), typeNames[m.Type()]);
+		s += line;
+		if (m.Type() == MetricTypeCounter)
+		{
+			snprintf(line, sizeof(line), "%s %llu\n", m.Name(),
+				(unsigned long long)Sum(m.Slot()));
+			s += line;
+		}
+		else if (m.Type() == MetricTypeGauge)
+		{
+			snprintf(line, sizeof(line), "%s %lld\n", m.Name(),
+				(long long)m.GaugeValue());
+			s += line;
+		}
+		else
+		{
+			uint64_t cumulative = 0;
+			for (int i = 0; i < METRICS_BUCKETS; i++)
+			{
+				cumulative += Sum(m.Slot() + i);
+				if (i < METRICS_BUCKETS - 1)
+				{
+					snprintf(line, sizeof(line), "%s_bucket{le=\"%llu\"} %llu\n", m.Name(),
+						(unsigned long long)bucketBound(i), (unsigned long long)cumulative);
+				}
+				else
+				{
+					snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %llu\n", m.Name(),
+						(unsigned long long)cumulative);
+				}
+				s += line;
+			}
+			snprintf(line, sizeof(line), "%s_sum %llu\n%s_count %llu\n",
+				m.Name(), (unsigned long long)Sum(m.Slot() + METRICS_BUCKETS),
+				m.Name(), (unsigned long long)cumulative);
+			s += line;
+		}
+	});
+	return s;
+}
+
+string Metrics::Compact(void)
+{
+	string s;
+	char field[160];
+	forEach(m_metrics, m_count.load(memory_order_acquire), [&](const Metric& m)
+	{
+		if (m.Type() == MetricTypeCounter)
+		{
+			snprintf(field, sizeof(field), "%s=%llu", m.Name(),
+				(unsigned long long)Sum(m.Slot()));
+		}
+		else if (m.Type() == MetricTypeGauge)
+		{
+			snprintf(field, sizeof(field), "%s=%lld", m.Name(),
+				(long long)m.GaugeValue());
+		}
+		else
+		{
+			uint64_t buckets[METRICS_BUCKETS];
+			uint64_t count = 0;
+			for (int i = 0; i < METRICS_BUCKETS; i++)
+			{
+				buckets[i] = Sum(m.Slot() + i);
+				count += buckets[i];
+			}
+			snprintf(field, sizeof(field), "%s=%llu,%llu,%s,%s", m.Name(),
+				(unsigned long long)count,
+				(unsigned long long)Sum(m.Slot() + METRICS_BUCKETS),
+				quantile(buckets, count, 0.5).c_str(),
+				quantile(buckets, count, 0.99).c_str());
+		}
+		if (!s.empty())
+		{
+			s += ' ';
+		}
+		s += field;
+	});
+	return s;
+}
+
+bool Metrics::Serve(const char *path)
+{
+	static LogHandle log("Metrics");
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		log->LogErr(AT, "Metrics: socket path too long.");
+		return false;
+	}
+	strcpy(addr.sun_path, path);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+	{
+		log->LogErr(AT, "Metrics: socket()", errno);
+		return false;
+	}
+	// Left behind by a previous run.
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 4) != 0)
+	{
+		log->LogErr(AT, "Metrics: can't listen", errno);
+		close(fd);
+		return false;
+	}
+	if (Scheduler::GetInstance().AddFd("Metrics::Serve", fd, [fd]() { _accept(fd); }) == 0)
+	{
+		log->LogErr(AT, "Metrics: Can't watch the socket.");
+		close(fd);
+		return false;
+	}
+	return true;
+}
+
+// On the Scheduler thread: the whole page in one non-blocking send()
+// (a few KB, well under a unix socket's buffer). A client that isn't
+// reading gets what fits.
+void Metrics::_accept(int fd)
+{
+	int client;
+	while ((client = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+	{
+		string page = Render();
+		send(client, page.data(), page.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+		close(client);
+	}
+}
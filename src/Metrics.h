@@ -0,0 +1,169 @@
+// Metrics.h
+// Counters, gauges and histograms for the field: I2C error rates and
+// latency, PWM update rates, log volume and drops.
+//
+//     static MetricCounter transfers("i2c_transfers_total", "I2C transfers");
+//     static MetricHistogram latency("i2c_transfer_us", "I2C transfer time, us");
+//     transfers.Add();
+//     latency.Observe(us);
+//
+// Counters and histograms are sharded per thread the way Profile's
+// counters are: each thread adds to its own block (one per thread,
+// never freed), a relaxed load and store per slot, no lock and no
+// atomic read-modify-write. Readers sum every thread's block. A gauge
+// is one atomic of its own; the last Set() wins.
+//
+// Histograms have METRICS_BUCKETS fixed power of two buckets: bucket i
+// counts values <= 2^i - 1 (so 0, 1, 3, 7, ...), the last one anything
+// bigger.
+//
+// Read them:
+//   - Metrics::Render(): Prometheus text format, served by Serve() on
+//     the unix socket METRICS_SOCKET to whoever connects ('pwmstat -m');
+//   - Metrics::Compact(): one line, "name=value ..." (histograms as
+//     name=count,sum,p50,p99), which Diagnostics sends to the client.
+//
+// Metrics are constructed as statics; ones past METRICS_MAX (or out of
+// shard slots) are ignored.
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <atomic>
+#include <string>
+
+#include <stdint.h>
+#include <time.h>
+
+using namespace std;
+
+#define METRICS_MAX 64
+#define METRICS_MAX_SLOTS 512  // Per thread; a histogram takes METRICS_BUCKETS + 1
+#define METRICS_BUCKETS 20  // The last is +Inf; 2^18 - 1 before it
+#ifndef METRICS_SOCKET
+#define METRICS_SOCKET "/tmp/pwm-metrics.sock"
+#endif
+
+enum MetricType
+{
+	MetricTypeCounter = 0,
+	MetricTypeGauge,
+	MetricTypeHistogram
+};
+
+class Metric
+{
+public:
+	const char *Name(void) const { return m_name; }
+	const char *Help(void) const { return m_help; }
+	MetricType Type(void) const { return m_type; }
+	int Slot(void) const { return m_slot; }  // First shard slot, -1: none
+	int64_t GaugeValue(void) const { return m_gauge.load(memory_order_relaxed); }
+protected:
+	Metric(const char *name, const char *help, MetricType type);
+	const char *m_name;
+	const char *m_help;
+	MetricType m_type;
+	int m_slot;
+	atomic<int64_t> m_gauge;
+};
+
+struct MetricsThread
+{
+	atomic<uint64_t> slots[METRICS_MAX_SLOTS];
+	MetricsThread *next;
+};
+
+class Metrics
+{
+public:
+	static uint64_t NowUs(void)
+	{
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+	}
+	// The calling thread's block, created on first use.
+	static MetricsThread& Thread(void)
+	{
+		static thread_local MetricsThread *mine = nullptr;
+		if (mine == nullptr)
+		{
+			mine = _newThread();
+		}
+		return *mine;
+	}
+	static void Bump(int slot, uint64_t n)
+	{
+		atomic<uint64_t>& s = Thread().slots[slot];
+		s.store(s.load(memory_order_relaxed) + n, memory_order_relaxed);
+	}
+	// Called by Metric only. Returns the first of 'slots' shard slots,
+	// -1 if there's no room.
+	static int Register(Metric *metric, int slots);
+	// Every thread's shards summed.
+	static uint64_t Sum(int slot);
+	static string Render(void);
+	static string Compact(void);
+	// Answers every connection to 'path' with Render(), from the
+	// Scheduler thread. Returns false if the socket can't be set up.
+	static bool Serve(const char *path = METRICS_SOCKET);
+private:
+	static MetricsThread *_newThread(void);
+	static void _accept(int fd);
+	static atomic<Metric *> m_metrics[METRICS_MAX];
+	static atomic<int> m_count;
+	static atomic<int> m_slotCount;
+	static atomic<MetricsThread *> m_threads;
+};
+
+class MetricCounter : public Metric
+{
+public:
+	MetricCounter(const char *name, const char *help)
+		: Metric(name, help, MetricTypeCounter)
+	{
+	}
+	void Add(uint64_t n = 1)
+	{
+		if (m_slot >= 0)
+		{
+			Metrics::Bump(m_slot, n);
+		}
+	}
+};
+
+class MetricGauge : public Metric
+{
+public:
+	MetricGauge(const char *name, const char *help)
+		: Metric(name, help, MetricTypeGauge)
+	{
+	}
+	void Set(int64_t value) { m_gauge.store(value, memory_order_relaxed); }
+	void Add(int64_t delta) { m_gauge.fetch_add(delta, memory_order_relaxed); }
+};
+
+class MetricHistogram : public Metric
+{
+public:
+	MetricHistogram(const char *name, const char *help)
+		: Metric(name, help, MetricTypeHistogram)
+	{
+	}
+	static int Bucket(uint64_t value)
+	{
+		int b = value == 0 ? 0 : 64 - __builtin_clzll(value);
+		return b < METRICS_BUCKETS - 1 ? b : METRICS_BUCKETS - 1;
+	}
+	void Observe(uint64_t value)
+	{
+		if (m_slot >= 0)
+		{
+			Metrics::Bump(m_slot + Bucket(value), 1);
+			Metrics::Bump(m_slot + METRICS_BUCKETS, value);  // Sum
+		}
+	}
+};
+
+#endif  // METRICS_H_
@@ -0,0 +1,101 @@
+// PendingMessages.cpp
+
+#include <cstring>
+
+#include "PendingMessages.h"
+
+PendingMessages& PendingMessages::GetInstance(void)
+{
+	// C++11 guarantees this is initialized exactly once,
+	// even if several threads get here at the same time.
+	static PendingMessages instance;
+	return instance;
+}
+
+PendingMessages::PendingMessages()
+	: m_deferred(0), m_dropped(0), m_droppedReported(0),
+	  m_policy(PendingDropOldest)
+{
+}
+
+void PendingMessages::SetOverflowPolicy(PendingOverflowPolicy policy)
+{
+	m_policy.store(policy, memory_order_relaxed);
+}
+
+bool PendingMessages::_tryPush(const char *msg, size_t len)
+{
+	return m_queue.TryPush([&](Message& m)
+	{
+		if (len > PENDING_MESSAGE_MAX_LEN)
+		{
+			// Truncate but keep the line ending so the
+			// log file stays one-message-per-line.
+			len = PENDING_MESSAGE_MAX_LEN;
+			memcpy(m.text, msg, len - 2);
+			m.text[len - 2] = '\r';
+			m.text[len - 1] = '\n';
+		}
+		else
+		{
+			memcpy(m.text, msg, len);
+		}
+		m.length = (uint16_t)len;
+	});
+}
+
+bool PendingMessages::Push(const char *msg, size_t len)
+{
+	m_deferred.fetch_add(1, memory_order_relaxed);
+	while (!_tryPush(msg, len))
+	{
+		if (m_policy.load(memory_order_relaxed) == PendingDropNewest)
+		{
+			m_dropped.fetch_add(1, memory_order_relaxed);
+			return false;
+		}
+		// DropOldest: throw away the head to make room. If a drainer
+		// beat us to it the queue is no longer full, retry either way.
+		char discard[PENDING_MESSAGE_MAX_LEN];
+		size_t discardLen;
+		if (Pop(discard, sizeof(discard), discardLen))
+		{
+			m_dropped.fetch_add(1, memory_order_relaxed);
+		}
+	}
+	return true;
+}
+
+bool PendingMessages::Pop(char *buf, size_t bufSize, size_t& len)
+{
+	return m_queue.TryPop([&](Message& m)
+	{
+		len = (m.length > bufSize) ? bufSize : m.length;
+		memcpy(buf, m.text, len);
+	});
+}
+
+uint64_t PendingMessages::GetDeferredCount(void) const
+{
+	return m_deferred.load(memory_order_relaxed);
+}
+
+uint64_t PendingMessages::GetDroppedCount(void) const
+{
+	return m_dropped.load(memory_order_relaxed);
+}
+
+uint64_t PendingMessages::TakeUnreportedDrops(void)
+{
+	uint64_t dropped = m_dropped.load(memory_order_relaxed);
+	uint64_t reported = m_droppedReported.load(memory_order_relaxed);
+	while (dropped > reported)
+	{
+		if (m_droppedReported.compare_exchange_weak(reported, dropped,
+				memory_order_relaxed))
+		{
+			return dropped - reported;
+		}
+	}
+	return 0;
+}
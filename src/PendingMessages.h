@@ -0,0 +1,73 @@
+// PendingMessages.h
+// Log messages that could not be written immediately because another
+// thread or process holds the lock on the log file wait here until
+// the next Log call that does get the lock drains them.
+//
+// This USED TO BE an unbounded vector<string> behind a mutex; under
+// sustained contention it grew forever. It is now a fixed-size,
+// lock-free multi-producer / multi-consumer ring (D. Vyukov's bounded
+// queue) so memory use stays flat (CAPACITY * MAX_LEN bytes) no matter
+// how long the log file stays locked. See BoundedQueue.h.
+
+#ifndef PENDING_MESSAGES_H_
+#define PENDING_MESSAGES_H_
+
+#include <atomic>
+#include <cstddef>
+
+#include <stdint.h>
+
+#include "BoundedQueue.h"
+
+using namespace std;
+
+// Must be a power of two.
+#define PENDING_MESSAGES_CAPACITY 64
+// Longer messages are truncated (and still end with "\r\n").
+#define PENDING_MESSAGE_MAX_LEN 256
+
+// What Push() does when the queue is full:
+//   DropOldest - discard the oldest pending message to make room
+//                (keeps the most recent history, the default).
+//   DropNewest - discard the message being pushed.
+enum PendingOverflowPolicy
+{
+	PendingDropOldest = 0,
+	PendingDropNewest
+};
+
+class PendingMessages
+{
+public:
+	static PendingMessages& GetInstance(void);
+	// Returns false if the message was dropped (DropNewest and full).
+	bool Push(const char *msg, size_t len);
+	// Copies the oldest pending message into buf (NOT nul-terminated),
+	// returns false when the queue is empty.
+	bool Pop(char *buf, size_t bufSize, size_t& len);
+	bool IsEmpty(void) const { return m_queue.IsEmpty(); }
+	void SetOverflowPolicy(PendingOverflowPolicy policy);
+	// Total messages ever deferred / dropped since start up:
+	uint64_t GetDeferredCount(void) const;
+	uint64_t GetDroppedCount(void) const;
+	// Returns the number of drops since the last call, so the
+	// drain path can log "N messages dropped" exactly once.
+	uint64_t TakeUnreportedDrops(void);
+private:
+	PendingMessages();
+	PendingMessages(PendingMessages const& copy);  // Not allowed
+	PendingMessages& operator=(PendingMessages const& copy);  // Not allowed
+	bool _tryPush(const char *msg, size_t len);
+	struct Message
+	{
+		uint16_t length;
+		char text[PENDING_MESSAGE_MAX_LEN];
+	};
+	BoundedQueue<Message, PENDING_MESSAGES_CAPACITY> m_queue;
+	alignas(64) atomic<uint64_t> m_deferred;
+	atomic<uint64_t> m_dropped;
+	atomic<uint64_t> m_droppedReported;
+	atomic<int> m_policy;
+};
+
+#endif  // PENDING_MESSAGES_H_
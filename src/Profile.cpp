@@ -0,0 +1,167 @@
+// Profile.cpp
+
+#include "Log.h"
+#include "LogHandle.h"
+#include "Profile.h"
+
+#if PROFILE_ENABLED
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include <semaphore.h>
+#include <signal.h>
+
+atomic<ProfileSite *> Profile::m_sites[PROFILE_MAX_SITES];
+atomic<int> Profile::m_siteCount(0);
+atomic<ProfileThread *> Profile::m_threads(nullptr);
+
+static sem_t dumpRequest;
+
+ProfileSite::ProfileSite(const char *name, const char *at)
+	: m_name(name), m_at(at)
+{
+	m_id = Profile::Register(this);
+}
+
+int Profile::Register(ProfileSite *site)
+{
+	// Function-local statics are constructed once, under the
+	// compiler's guard, so no lock here.
+	int id = m_siteCount.fetch_add(1, memory_order_relaxed);
+	if (id >= PROFILE_MAX_SITES)
+	{
+		return -1;
+	}
+	m_sites[id].store(site, memory_order_release);
+	return id;
+}
+
+ProfileThread *Profile::_newThread(void)
+{
+	// Never freed: Render() may be reading it, and an exited thread's
+	// counts still belong in the profile.
+	ProfileThread *t = new ProfileThread();
+	for (auto &c : t->sites)
+	{
+		c.count.store(0, memory_order_relaxed);
+		c.totalNs.store(0, memory_order_relaxed);
+		c.maxNs.store(0, memory_order_relaxed);
+	}
+	t->tid = Log::ThreadId();
+	ProfileThread *head = m_threads.load(memory_order_relaxed);
+	do
+	{
+		t->next = head;
+	} while (!m_threads.compare_exchange_weak(head, t,
+		memory_order_release, memory_order_relaxed));
+	return t;
+}
+
+string Profile::Render(void)
+{
+	struct Row
+	{
+		const ProfileSite *site;
+		uint64_t count;
+		uint64_t totalNs;
+		uint64_t maxNs;
+	};
+	vector<Row> rows;
+	int sites = min(m_siteCount.load(memory_order_acquire), PROFILE_MAX_SITES);
+	for (int i = 0; i < sites; i++)
+	{
+		const ProfileSite *site = m_sites[i].load(memory_order_acquire);
+		if (site == nullptr)
+		{
+			continue;  // Registered, not stored yet.
+		}
+		Row row = { site, 0, 0, 0 };
+		for (ProfileThread *t = m_threads.load(memory_order_acquire);
+			t != nullptr; t = t->next)
+		{
+			const ProfileCounters& c = t->sites[i];
+			row.count += c.count.load(memory_order_relaxed);
+			row.totalNs += c.totalNs.load(memory_order_relaxed);
+			row.maxNs = max(row.maxNs, c.maxNs.load(memory_order_relaxed));
+		}
+		rows.push_back(row);
+	}
+	sort(rows.begin(), rows.end(), [](const Row& a, const Row& b)
+	{
+		return a.totalNs > b.totalNs;
+	});
+	string s;
+	char line[256];
+	snprintf(line, sizeof(line), "%-28s %10s %12s %10s %10s  %s\r\n",
+		"site", "count", "total ms", "avg us", "max us", "at");
+	s += line;
+	for (const Row& row : rows)
+	{
+		// AT is "file:line: "; drop the ": ".
+		int atLen = (int)strlen(row.site->At());
+		snprintf(line, sizeof(line), "%-28s %10llu %12.3f %10.2f %10.2f  %.*s\r\n",
+			row.site->Name(), (unsigned long long)row.count,
+			row.totalNs / 1e6,
+			row.count ? row.totalNs / 1e3 / row.count : 0.0,
+			row.maxNs / 1e3, max(atLen - 2, 0), row.site->At());
+		s += line;
+	}
+	return s;
+}
+
+void Profile::Dump(void)
+{
+	static LogHandle log("Profile");
+	string s = Render();
+	// One line per row: a whole table won't fit in a LogRing slot.
+	size_t start = 0;
+	size_t end;
+	while ((end = s.find("\r\n", start)) != string::npos)
+	{
+		log->LogInfo(s.substr(start, end - start));
+		start = end + 2;
+	}
+}
+
+void Profile::_signalHandler(int sig)
+{
+	// sem_post() is async-signal-safe; rendering and logging are not.
+	(void)sig;
+	sem_post(&dumpRequest);
+}
+
+void Profile::_dumperThreadProc(void)
+{
+	FlightRecorder::InstallAltStack();
+	for (;;)
+	{
+		while (sem_wait(&dumpRequest) != 0 && errno == EINTR)
+		{
+		}
+		Dump();
+	}
+}
+
+void Profile::InstallSignalHandler(void)
+{
+	static bool installed = false;
+	if (installed)
+	{
+		return;
+	}
+	installed = true;
+	sem_init(&dumpRequest, 0, 0);
+	// Parked on a semaphore until a dump is asked for; detached, as it
+	// never has anything to finish at exit.
+	thread(_dumperThreadProc).detach();
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = _signalHandler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	sigaction(PROFILE_SIGNAL, &sa, nullptr);
+}
+
+#endif  // PROFILE_ENABLED
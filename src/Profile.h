@@ -0,0 +1,161 @@
+// Profile.h
+// Built-in hot path profile: where time goes on the device, without
+// attaching a profiler.
+//
+//     bool I2c::WriteByte(uint8_t data)
+//     {
+//         PROFILE_SCOPE("I2c::WriteByte");
+//         ...
+//
+// times the rest of the enclosing scope and adds it to that call
+// site's count / total / max. Each thread has its own counters (one
+// block per thread, never freed, so threads that have exited still
+// count); a timed scope costs two clock_gettime() vDSO calls and three
+// plain stores, no lock and no atomic read-modify-write.
+//
+// Profile::Render() sums every thread's counters into a table, slowest
+// total first. With InstallSignalHandler() (see Main.cpp),
+//     kill -USR2 <pid>
+// logs that table (owner "Profile").
+//
+// Off unless built with -DPROFILE_ENABLED=1 (see makeit.sh); without
+// it PROFILE_SCOPE() compiles to nothing and Profile does nothing.
+
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <atomic>
+#include <string>
+
+#include <stdint.h>
+#include <time.h>
+
+using namespace std;
+
+#ifndef PROFILE_ENABLED
+#define PROFILE_ENABLED 0
+#endif
+// Distinct PROFILE_SCOPE() call sites; more are not timed.
+#define PROFILE_MAX_SITES 64
+#define PROFILE_SIGNAL SIGUSR2
+
+#if PROFILE_ENABLED
+
+#define PROFILE_CONCAT_(a, b) a ## b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+// 'name' must be a string literal.
+#define PROFILE_SCOPE(name) \
+	static ProfileSite PROFILE_CONCAT(profile_site_, __LINE__)(name, AT); \
+	ProfileTimer PROFILE_CONCAT(profile_timer_, __LINE__)( \
+		PROFILE_CONCAT(profile_site_, __LINE__))
+
+// One PROFILE_SCOPE() call site. Registered on first use.
+class ProfileSite
+{
+public:
+	ProfileSite(const char *name, const char *at);
+	const char *Name(void) const { return m_name; }
+	const char *At(void) const { return m_at; }
+	int Id(void) const { return m_id; }  // -1: too many sites
+private:
+	const char *m_name;
+	const char *m_at;
+	int m_id;
+};
+
+// Only the owning thread writes these; Render() reads them from
+// another thread, hence atomics (relaxed loads / stores only).
+struct ProfileCounters
+{
+	atomic<uint64_t> count;
+	atomic<uint64_t> totalNs;
+	atomic<uint64_t> maxNs;
+};
+
+struct ProfileThread
+{
+	ProfileCounters sites[PROFILE_MAX_SITES];
+	uint32_t tid;
+	ProfileThread *next;
+};
+
+class Profile
+{
+public:
+	static uint64_t NowNs(void)
+	{
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
+	// The calling thread's counters, created on first use.
+	static ProfileThread& Thread(void)
+	{
+		static thread_local ProfileThread *mine = nullptr;
+		if (mine == nullptr)
+		{
+			mine = _newThread();
+		}
+		return *mine;
+	}
+	static void Add(int site, uint64_t ns)
+	{
+		ProfileCounters& c = Thread().sites[site];
+		c.count.store(c.count.load(memory_order_relaxed) + 1, memory_order_relaxed);
+		c.totalNs.store(c.totalNs.load(memory_order_relaxed) + ns, memory_order_relaxed);
+		if (ns > c.maxNs.load(memory_order_relaxed))
+		{
+			c.maxNs.store(ns, memory_order_relaxed);
+		}
+	}
+	// Called by ProfileSite only.
+	static int Register(ProfileSite *site);
+	// Every site's count, total, average and max over all threads.
+	static string Render(void);
+	// Logs Render(), one line per row.
+	static void Dump(void);
+	// PROFILE_SIGNAL -> Dump() (from a helper thread, not the handler).
+	static void InstallSignalHandler(void);
+private:
+	static ProfileThread *_newThread(void);
+	static void _signalHandler(int sig);
+	static void _dumperThreadProc(void);
+	static atomic<ProfileSite *> m_sites[PROFILE_MAX_SITES];
+	static atomic<int> m_siteCount;
+	static atomic<ProfileThread *> m_threads;
+};
+
+class ProfileTimer
+{
+public:
+	explicit ProfileTimer(const ProfileSite& site)
+		: m_site(site.Id()), m_start(Profile::NowNs())
+	{
+	}
+	~ProfileTimer()
+	{
+		if (m_site >= 0)
+		{
+			Profile::Add(m_site, Profile::NowNs() - m_start);
+		}
+	}
+private:
+	int m_site;
+	uint64_t m_start;
+};
+
+#else  // !PROFILE_ENABLED
+
+#define PROFILE_SCOPE(name) do { } while (0)
+
+class Profile
+{
+public:
+	static string Render(void) { return string(); }
+	static void Dump(void) { }
+	static void InstallSignalHandler(void) { }
+};
+
+#endif  // PROFILE_ENABLED
+
+#endif  // PROFILE_H_
@@ -16,7 +16,15 @@
  ****************************************************/
 // WAS: Adafruit_PWMServoDriver.cpp, NOW: PwmServoDriver.cpp
 
+#include "Metrics.h"
 #include "PwmServoDriver.h"
+#include "SharedMemory.h"
+
+static MetricCounter pwmUpdates("pwm_updates_total", "setPWM() calls that reached the chip");
+static MetricCounter pwmFailures("pwm_update_failures_total", "setPWM() calls that failed");
+static MetricHistogram pwmLatency("pwm_update_us", "setPWM() time, microseconds");
+static MetricCounter sharedStuck("pwm_shared_stuck_total",
+	"Duty cycles not published, SharedData record held by a stuck writer");
 
 // Set to true to print some debug messages, or false to disable them.
 //#define ENABLE_DEBUG_OUTPUT
@@ -28,7 +36,9 @@
     @param  addr The 7-bit I2C address to locate this chip, default is 0x40
 */
 /**************************************************************************/
-PwmServoDriver::PwmServoDriver(uint8_t addr) {
+PwmServoDriver::PwmServoDriver(uint8_t addr)
+	: m_log("PwmServoDriver")
+{
 	m_i2caddr = addr;
 }
 
@@ -62,6 +72,7 @@ void PwmServoDriver::reset(void) {
 */
 /**************************************************************************/
 void PwmServoDriver::setPWMFreq(float freq) {
+	PROFILE_SCOPE("PwmServoDriver::setPWMFreq");
 #ifdef ENABLE_DEBUG_OUTPUT
   Serial.print("Attempting to set freq ");
   Serial.println(freq);
@@ -85,6 +96,7 @@ void PwmServoDriver::setPWMFreq(float freq) {
 #ifdef ENABLE_DEBUG_OUTPUT
   Serial.print("Final pre-scale: "); Serial.println(prescale);
 #endif
+	LOGF_DEBUG(m_log, "setPWMFreq %.1f Hz, prescale %u", freq, prescale);
   
 	uint8_t oldmode;
 	read8(PCA9685_MODE1, oldmode);
@@ -109,28 +121,87 @@ void PwmServoDriver::setPWMFreq(float freq) {
 */
 bool PwmServoDriver::setPWM(uint8_t num, uint16_t on, uint16_t off)
 {
+	PROFILE_SCOPE("PwmServoDriver::setPWM");
 #ifdef ENABLE_DEBUG_OUTPUT
   Serial.print("Setting PWM "); Serial.print(num); Serial.print(": "); Serial.print(on); Serial.print("->"); Serial.println(off);
 #endif
+	LOGF_TRACE(m_log, "setPWM %u: %u->%u", num, on, off);
+
+	uint64_t startUs = Metrics::NowUs();
+	// One 5 byte write: register, then (auto increment) ON_L .. OFF_H.
+	m_wire.beginTransmission(m_i2caddr);
+	m_wire.write(LED0_ON_L + 4 * num);
+	m_wire.write(on);
+	m_wire.write(on >> 8);
+	m_wire.write(off);
+	m_wire.write(off >> 8);
+	bool ok = m_wire.endTransmission() == 0;
+	pwmLatency.Observe(Metrics::NowUs() - startUs);
+	(ok ? pwmUpdates : pwmFailures).Add();
+	SharedData *shared = SharedMemory::Writable();
+	if (ok && shared != nullptr && num < SHARED_DATA_PWM_CHANNELS)
+	{
+		// For anyone watching (tools/pwmstat); never blocks a reader.
+		bool published = shared->pwm.Modify([&](SharedPwm& pwm)
+		{
+			pwm.on[num] = on;
+			pwm.off[num] = off;
+			pwm.address = m_i2caddr;
+			pwm.updatedMs = SharedDataNowMs();
+			pwm.writes++;
+		});
+		if (!published)
+		{
+			sharedStuck.Add();
+		}
+	}
+	return ok;
+}
 
-	return
-		(
-			m_i2c.Open(m_i2caddr)
-			&&
-			m_i2c.WriteByte(LED0_ON_L + (4 * num))
-			&&
-			m_i2c.WriteByte(LED0_ON_L + 4 * num)
-			&&
-			m_i2c.WriteByte(on & 0xff)
-			&&
-			m_i2c.WriteByte((on >> 8) & 0xff)
-			&&
-			m_i2c.WriteByte(off &0xff)
-			&&
-			m_i2c.WriteByte((off >> 8) & 0xff)
-			&&
-			m_i2c.Close()
-		);
+bool PwmServoDriver::setPWMs(const uint16_t *on, const uint16_t *off,
+	uint8_t first, uint8_t count)
+{
+	PROFILE_SCOPE("PwmServoDriver::setPWMs");
+	if (count == 0 || first + count > 16)
+	{
+		LOGF_ERROR(m_log, "setPWMs %u + %u: no such channels", first, count);
+		return false;
+	}
+	LOGF_TRACE(m_log, "setPWMs %u .. %u", first, first + count - 1);
+	uint8_t frame[64];
+	for (int i = 0; i < count; i++)
+	{
+		frame[4 * i] = on[i] & 0xff;
+		frame[4 * i + 1] = on[i] >> 8;
+		frame[4 * i + 2] = off[i] & 0xff;
+		frame[4 * i + 3] = off[i] >> 8;
+	}
+	uint64_t startUs = Metrics::NowUs();
+	// Split, if at all, between channels.
+	bool ok = m_wire.Bus().WriteRegisters(m_i2caddr, LED0_ON_L + 4 * first,
+		frame, 4 * count, 4);
+	pwmLatency.Observe(Metrics::NowUs() - startUs);
+	(ok ? pwmUpdates : pwmFailures).Add();
+	SharedData *shared = SharedMemory::Writable();
+	if (ok && shared != nullptr)
+	{
+		bool published = shared->pwm.Modify([&](SharedPwm& pwm)
+		{
+			for (int i = 0; i < count; i++)
+			{
+				pwm.on[first + i] = on[i];
+				pwm.off[first + i] = off[i];
+			}
+			pwm.address = m_i2caddr;
+			pwm.updatedMs = SharedDataNowMs();
+			pwm.writes++;
+		});
+		if (!published)
+		{
+			sharedStuck.Add();
+		}
+	}
+	return ok;
 }
 
 /**************************************************************************/
@@ -185,52 +256,52 @@ void PwmServoDriver::setPin(uint8_t num, uint16_t val, bool invert)
 	}
 }
 
+bool PwmServoDriver::CheckHealth(void)
+{
+	m_healthWire.beginTransmission(m_i2caddr);
+	m_healthWire.write(PCA9685_MODE1);
+	m_healthWire.endTransmission(false);
+	if (m_healthWire.requestFrom(m_i2caddr, (uint8_t)1) != 1)
+	{
+		// Failure reason already logged.
+		return false;
+	}
+	uint8_t mode = m_healthWire.read();
+	// begin() leaves it awake (SLEEP, 0x10, clear) with auto increment
+	// (AI, 0x20) on; power-on default is 0x11.
+	if ((mode & 0x10) != 0 || (mode & 0x20) == 0)
+	{
+		LOGF_WARN(m_log, "PCA9685 at 0x%02x lost its setup, MODE1 0x%02x", m_i2caddr, mode);
+		return false;
+	}
+	return true;
+}
+
 /*******************************************************************************************/
 
 bool PwmServoDriver::read8(uint8_t reg, uint8_t &val)
 {
-	return
-		(
-		m_i2c.Open(m_i2caddr)
-		&&
-		m_i2c.WriteByte(reg)
-		&&
-		m_i2c.ReadByte(val)
-		&&
-		m_i2c.Close()
-		);
-
-/*	
-  _i2c->beginTransmission(_i2caddr);
-  _i2c->write(addr);
-  _i2c->endTransmission();
-
-  _i2c->requestFrom((uint8_t)_i2caddr, (uint8_t)1);
-  return _i2c->read();
-*/
+	// Upstream ends the write with a STOP; with a repeated start
+	// instead it's one combined write / read transaction.
+	m_wire.beginTransmission(m_i2caddr);
+	m_wire.write(reg);
+	m_wire.endTransmission(false);
+	if (m_wire.requestFrom(m_i2caddr, (uint8_t)1) != 1)
+	{
+		return false;
+	}
+	val = m_wire.read();
+	return true;
 }
 
 // example call:
 // write8(PCA9685_PRESCALE, prescale); // set the prescaler
 //   PCA9685_PRESCALE is 0xFE, prescale is 0-0xFF
 bool PwmServoDriver::write8(uint8_t reg, uint8_t d) {
-	return
-		(
-			m_i2c.Open(m_i2caddr)
-			&&
-			m_i2c.WriteByte(reg)
-			&&
-			m_i2c.WriteByte(d)
-			&&
-			m_i2c.Close()
-		);
-
-/*
-  _i2c->beginTransmission(_i2caddr);
-  _i2c->write(addr);
-  _i2c->write(d);
-  _i2c->endTransmission();
-  */
+	m_wire.beginTransmission(m_i2caddr);
+	m_wire.write(reg);
+	m_wire.write(d);
+	return m_wire.endTransmission() == 0;
 }
 /**********
  * Here is how we read Battery Charging Status:
@@ -23,7 +23,8 @@
 
 #include <math.h>
 
-#include "I2c.h"
+#include "LogHandle.h"
+#include "Wire.h"
 
 using namespace std;
 using namespace chrono;
@@ -53,11 +54,26 @@ public:
 	void reset(void);
 	void setPWMFreq(float freq);
 	bool setPWM(uint8_t num, uint16_t on, uint16_t off);
+	// Channels 'first' .. 'first' + 'count' - 1 (on[0], off[0] is
+	// 'first'), in one write: all 16 are a 65 byte frame, where setPWM()
+	// per channel takes 16 transactions. Split (between channels) only
+	// if the adapter can't take it (see I2cBus::WriteRegisters()).
+	bool setPWMs(const uint16_t *on, const uint16_t *off,
+		uint8_t first = 0, uint8_t count = 16);
 	void setPin(uint8_t num, uint16_t val, bool invert=false);
+	// Reads MODE1 back: false if the chip doesn't answer or has lost
+	// begin()'s setup (asleep / no auto increment, e.g. after a
+	// brown-out). Meant to be run periodically (a Scheduler task).
+	bool CheckHealth(void);
 
 private:
 	uint8_t m_i2caddr;
-	I2c m_i2c;
+	// Upstream's _i2c (see Wire.h).
+	TwoWire m_wire;
+	// CheckHealth() runs on the Scheduler thread: a TwoWire of its own,
+	// same bus.
+	TwoWire m_healthWire;
+	LogHandle m_log;
 	bool read8(uint8_t reg, uint8_t &val);
 	bool write8(uint8_t reg, uint8_t d);
 	void delay(int n)
@@ -0,0 +1,515 @@
+// Scheduler.cpp
+
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Log.h"
+#include "LogHandle.h"
+#include "Scheduler.h"
+
+#define WHEEL_MASK (SCHEDULER_WHEEL_SLOTS - 1)
+// Ticks covered by 'level' and everything below it.
+#define LEVEL_SPAN(level) (1ull << (SCHEDULER_WHEEL_BITS * ((level) + 1)))
+
+Scheduler& Scheduler::GetInstance(void)
+{
+	// Never deleted, see LogRing::GetInstance().
+	static Scheduler *instance = new Scheduler();
+	return *instance;
+}
+
+Scheduler::Scheduler()
+	: m_nextId(1), m_now(0), m_current(nullptr),
+	m_epollFd(-1), m_timerFd(-1), m_eventFd(-1),
+	m_started(false), m_keepRunning(true), m_wakeups(0)
+{
+	memset(m_wheel, 0, sizeof(m_wheel));
+	pthread_atfork(nullptr, nullptr, _atForkChild);
+}
+
+uint64_t Scheduler::_nowTick(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / SCHEDULER_TICK_MS;
+}
+
+int Scheduler::Add(const char *name, int periodMs, int jitterMs,
+	SchedulerCallback callback)
+{
+	if (periodMs <= 0 || !callback)
+	{
+		return 0;
+	}
+	if (!m_started.load(memory_order_acquire) && !_start())
+	{
+		return 0;
+	}
+	Task *t = new Task();
+	t->name = name;
+	t->fd = -1;
+	t->periodTicks = max((periodMs + SCHEDULER_TICK_MS - 1) / SCHEDULER_TICK_MS, 1);
+	// Round up by at most the budget, and never by a whole period.
+	uint64_t jitterTicks = min((uint64_t)max(jitterMs, 0) / SCHEDULER_TICK_MS,
+		t->periodTicks - 1);
+	t->alignTicks = 1;
+	while (t->alignTicks * 2 - 1 <= jitterTicks)
+	{
+		t->alignTicks *= 2;
+	}
+	t->callback = callback;
+	t->removed = false;
+	t->restart = false;
+	t->slot = nullptr;
+	int id;
+	{
+		lock_guard<mutex> lock(m_mutex);
+		id = m_nextId++;
+		t->id = id;
+		m_tasks[id] = t;
+		_schedule(t, _nowTick() + t->periodTicks);
+	}
+	_wake();
+	return id;
+}
+
+int Scheduler::AddFd(const char *name, int fd, SchedulerCallback callback,
+	uint32_t events)
+{
+	if (fd < 0 || !callback)
+	{
+		return 0;
+	}
+	if (!m_started.load(memory_order_acquire) && !_start())
+	{
+		return 0;
+	}
+	Task *t = new Task();
+	t->name = name;
+	t->fd = fd;
+	t->periodTicks = 0;
+	t->callback = callback;
+	t->removed = false;
+	t->restart = false;
+	t->slot = nullptr;
+	lock_guard<mutex> lock(m_mutex);
+	t->id = m_nextId++;
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.u64 = t->id;
+	if (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fd, &ev) != 0)
+	{
+		delete t;
+		return 0;
+	}
+	m_tasks[t->id] = t;
+	return t->id;
+}
+
+bool Scheduler::SetPeriod(int id, int periodMs)
+{
+	if (periodMs <= 0)
+	{
+		return false;
+	}
+	{
+		lock_guard<mutex> lock(m_mutex);
+		auto it = m_tasks.find(id);
+		if (it == m_tasks.end() || it->second->fd >= 0)
+		{
+			return false;
+		}
+		Task *t = it->second;
+		t->periodTicks = max((periodMs + SCHEDULER_TICK_MS - 1) / SCHEDULER_TICK_MS, 1);
+		if (t == m_current)
+		{
+			// Re-filed by _runSlot() when the callback returns.
+			t->restart = true;
+		}
+		else
+		{
+			_unlink(t);
+			_schedule(t, _nowTick() + t->periodTicks);
+		}
+	}
+	_wake();
+	return true;
+}
+
+bool Scheduler::Remove(int id)
+{
+	unique_lock<mutex> lock(m_mutex);
+	auto it = m_tasks.find(id);
+	if (it == m_tasks.end())
+	{
+		return false;
+	}
+	Task *t = it->second;
+	m_tasks.erase(it);
+	if (t->fd >= 0)
+	{
+		// An event already returned by epoll_wait() finds the id gone.
+		epoll_ctl(m_epollFd, EPOLL_CTL_DEL, t->fd, nullptr);
+	}
+	if (t != m_current)
+	{
+		_unlink(t);
+		delete t;
+		return true;
+	}
+	// Running: _run()'s caller deletes it when the callback returns.
+	t->removed = true;
+	if (this_thread::get_id() != m_thread.get_id())
+	{
+		m_idle.wait(lock, [this, t]() { return m_current != t; });
+	}
+	return true;
+}
+
+int Scheduler::GetTaskCount(void)
+{
+	lock_guard<mutex> lock(m_mutex);
+	return (int)m_tasks.size();
+}
+
+uint64_t Scheduler::GetWakeupCount(void) const
+{
+	return m_wakeups.load(memory_order_relaxed);
+}
+
+// Files 't' to run at 'nominal' rounded up to its alignment.
+void Scheduler::_schedule(Task *t, uint64_t nominal)
+{
+	t->nominal = nominal;
+	t->due = (nominal + t->alignTicks - 1) & ~(t->alignTicks - 1);
+	_link(t);
+}
+
+// Slot for t->due, relative to m_now. Level L holds what is due within
+// LEVEL_SPAN(L) ticks; its slots are emptied (cascaded) when m_now
+// reaches a multiple of LEVEL_SPAN(L - 1), which is never after 'due'.
+void Scheduler::_link(Task *t)
+{
+	uint64_t at = max(t->due, m_now);
+	uint64_t delta = at - m_now;
+	int level = 0;
+	while (level < SCHEDULER_WHEEL_LEVELS - 1 && delta >= LEVEL_SPAN(level))
+	{
+		level++;
+	}
+	if (delta >= LEVEL_SPAN(level))
+	{
+		// Beyond the wheel: park it in the furthest slot, it gets
+		// re-filed from there.
+		at = m_now + LEVEL_SPAN(level) - 1;
+	}
+	Task **slot = &m_wheel[level][(at >> (SCHEDULER_WHEEL_BITS * level)) & WHEEL_MASK];
+	t->slot = slot;
+	t->prev = nullptr;
+	t->next = *slot;
+	if (t->next != nullptr)
+	{
+		t->next->prev = t;
+	}
+	*slot = t;
+}
+
+void Scheduler::_unlink(Task *t)
+{
+	if (t->slot == nullptr)
+	{
+		return;
+	}
+	if (t->prev != nullptr)
+	{
+		t->prev->next = t->next;
+	}
+	else
+	{
+		*t->slot = t->next;
+	}
+	if (t->next != nullptr)
+	{
+		t->next->prev = t->prev;
+	}
+	t->slot = nullptr;
+}
+
+// m_now just reached the start of the current slot of 'level': move
+// its tasks down to finer slots.
+void Scheduler::_cascade(int level)
+{
+	Task **slot = &m_wheel[level][(m_now >> (SCHEDULER_WHEEL_BITS * level)) & WHEEL_MASK];
+	Task *t = *slot;
+	*slot = nullptr;
+	while (t != nullptr)
+	{
+		Task *next = t->next;
+		t->slot = nullptr;
+		_link(t);
+		t = next;
+	}
+}
+
+// The first tick after m_now with anything to do: a non-empty level 0
+// slot, or a non-empty coarser slot to cascade.
+bool Scheduler::_nextTick(uint64_t& tick)
+{
+	bool found = false;
+	for (int level = 0; level < SCHEDULER_WHEEL_LEVELS; level++)
+	{
+		int shift = SCHEDULER_WHEEL_BITS * level;
+		uint64_t at = ((m_now >> shift) + 1) << shift;
+		for (int i = 0; i < SCHEDULER_WHEEL_SLOTS; i++, at += 1ull << shift)
+		{
+			if (found && at >= tick)
+			{
+				break;
+			}
+			if (m_wheel[level][(at >> shift) & WHEEL_MASK] != nullptr)
+			{
+				tick = at;
+				found = true;
+				break;
+			}
+		}
+	}
+	return found;
+}
+
+// Processes every tick up to 'tick', skipping straight over the empty
+// ones.
+void Scheduler::_advance(uint64_t tick, unique_lock<mutex>& lock)
+{
+	while (m_now < tick)
+	{
+		uint64_t next;
+		if (!_nextTick(next) || next > tick)
+		{
+			m_now = tick;
+			return;
+		}
+		m_now = next;
+		for (int level = SCHEDULER_WHEEL_LEVELS - 1; level > 0; level--)
+		{
+			if ((m_now & (LEVEL_SPAN(level - 1) - 1)) == 0)
+			{
+				_cascade(level);
+			}
+		}
+		_runSlot(lock);
+	}
+}
+
+// Runs everything in m_now's level 0 slot, and files each task again.
+void Scheduler::_runSlot(unique_lock<mutex>& lock)
+{
+	Task **slot = &m_wheel[0][m_now & WHEEL_MASK];
+	while (*slot != nullptr)
+	{
+		Task *t = *slot;
+		_unlink(t);
+		_run(t, lock);
+		if (t->removed)
+		{
+			delete t;
+			continue;
+		}
+		uint64_t now = _nowTick();
+		uint64_t nominal = t->restart ? now + t->periodTicks : t->nominal + t->periodTicks;
+		t->restart = false;
+		if (nominal <= now)
+		{
+			// Fell behind (slow callback, suspend): skip the missed
+			// runs rather than firing them back to back.
+			nominal += ((now - nominal) / t->periodTicks + 1) * t->periodTicks;
+		}
+		_schedule(t, nominal);
+	}
+}
+
+// Calls t's callback without the lock. Remove() can happen meanwhile:
+// check t->removed after.
+void Scheduler::_run(Task *t, unique_lock<mutex>& lock)
+{
+	static LogHandle log("Scheduler");
+	m_current = t;
+	lock.unlock();
+	struct timespec start;
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	t->callback();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	long tookMs = (end.tv_sec - start.tv_sec) * 1000
+		+ (end.tv_nsec - start.tv_nsec) / 1000000;
+	if (tookMs > SCHEDULER_SLOW_MS)
+	{
+		LOGF_WARN(log, "Task %s took %ld ms, other tasks were held up",
+			t->name.c_str(), tookMs);
+	}
+	lock.lock();
+	m_current = nullptr;
+	m_idle.notify_all();
+}
+
+// Sets the timerfd for the next tick with work, or disarms it.
+void Scheduler::_arm(void)
+{
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	uint64_t tick;
+	if (_nextTick(tick))
+	{
+		uint64_t ms = tick * SCHEDULER_TICK_MS;
+		its.it_value.tv_sec = ms / 1000;
+		its.it_value.tv_nsec = (ms % 1000) * 1000000;
+	}
+	timerfd_settime(m_timerFd, TFD_TIMER_ABSTIME, &its, nullptr);
+}
+
+void Scheduler::_wake(void)
+{
+	uint64_t one = 1;
+	if (m_eventFd >= 0 && write(m_eventFd, &one, sizeof(one)) < 0)
+	{
+		// Counter already non-zero, the thread will wake anyway.
+	}
+}
+
+bool Scheduler::_start(void)
+{
+	static mutex startMutex;
+	lock_guard<mutex> lock(startMutex);
+	if (m_started.load(memory_order_relaxed))
+	{
+		return true;
+	}
+	if (!m_keepRunning.load())
+	{
+		return false;
+	}
+	// No logging in here: LogSinks starts its flusher task from inside
+	// a log call.
+	m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+	m_timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	m_eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	bool ok = m_epollFd >= 0 && m_timerFd >= 0 && m_eventFd >= 0;
+	for (int fd : { m_timerFd, m_eventFd })
+	{
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u64 = 0;  // Ours; AddFd() ids start at 1.
+		ok = ok && epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fd, &ev) == 0;
+	}
+	if (!ok)
+	{
+		for (int *fd : { &m_epollFd, &m_timerFd, &m_eventFd })
+		{
+			if (*fd >= 0)
+			{
+				close(*fd);
+				*fd = -1;
+			}
+		}
+		return false;
+	}
+	// LogRing's atexit() handler is registered first so it runs
+	// after ours; a callback running while we stop can still log.
+	LogRing::GetInstance();
+	static int atExitInstalled = atexit(_atExit);
+	(void)atExitInstalled;
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_now = _nowTick();
+	}
+	m_thread = thread(&Scheduler::_threadProc, this);
+	m_started.store(true, memory_order_release);
+	return true;
+}
+
+void Scheduler::_threadProc(void)
+{
+	FlightRecorder::InstallAltStack();
+	unique_lock<mutex> lock(m_mutex);
+	while (m_keepRunning.load())
+	{
+		_advance(_nowTick(), lock);
+		_arm();
+		lock.unlock();
+		struct epoll_event events[8];
+		int n = epoll_wait(m_epollFd, events, 8, -1);
+		m_wakeups.fetch_add(1, memory_order_relaxed);
+		lock.lock();
+		for (int i = 0; i < n; i++)
+		{
+			if (events[i].data.u64 == 0)
+			{
+				// Timer or _wake(): 8 byte counters, reading resets
+				// them (EAGAIN: the other one).
+				uint64_t count;
+				for (int fd : { m_timerFd, m_eventFd })
+				{
+					if (read(fd, &count, sizeof(count)) < 0)
+					{
+					}
+				}
+				continue;
+			}
+			auto it = m_tasks.find((int)events[i].data.u64);
+			if (it == m_tasks.end())
+			{
+				continue;  // Removed since.
+			}
+			Task *t = it->second;
+			_run(t, lock);
+			if (t->removed)
+			{
+				delete t;
+			}
+		}
+	}
+}
+
+void Scheduler::_atExit(void)
+{
+	Scheduler& scheduler = GetInstance();
+	scheduler.m_keepRunning.store(false);
+	scheduler._wake();
+	if (scheduler.m_thread.joinable())
+	{
+		scheduler.m_thread.join();
+	}
+}
+
+void Scheduler::_atForkChild(void)
+{
+	Scheduler& scheduler = GetInstance();
+	// The thread doesn't exist in the child, and the tasks belong to
+	// the parent's objects: drop them all. The epoll set is shared
+	// with the parent, so the next Add() makes new fds too.
+	new (&scheduler.m_thread) thread();
+	new (&scheduler.m_mutex) mutex();
+	new (&scheduler.m_idle) condition_variable();
+	for (auto &entry : scheduler.m_tasks)
+	{
+		delete entry.second;
+	}
+	scheduler.m_tasks.clear();
+	memset(scheduler.m_wheel, 0, sizeof(scheduler.m_wheel));
+	scheduler.m_current = nullptr;
+	for (int *fd : { &scheduler.m_epollFd, &scheduler.m_timerFd, &scheduler.m_eventFd })
+	{
+		if (*fd >= 0)
+		{
+			close(*fd);
+			*fd = -1;
+		}
+	}
+	scheduler.m_started.store(false, memory_order_relaxed);
+}
@@ -0,0 +1,138 @@
+// Scheduler.h
+// One thread that runs every periodic task in the process.
+//
+// BatteryChecker and Diagnostics USED TO each run a thread of their
+// own that slept 15 s (5 s on retry) between checks, and LogSinks had
+// a third that woke every LOG_CONSOLE_FLUSH_MS; every new periodic
+// job meant another mostly idle thread and stack. Now they register a
+// callback here:
+//     int id = Scheduler::GetInstance().Add("Battery", 15000, 1000,
+//         [this]() { _check(); });
+// and one thread runs them all from an epoll loop on a timerfd that is
+// armed only for the next tick that has something to do.
+//
+// Tasks live in a hierarchical timer wheel (SCHEDULER_WHEEL_LEVELS
+// levels of 2^SCHEDULER_WHEEL_BITS slots, SCHEDULER_TICK_MS per tick
+// at level 0), so adding, re-arming and removing a task is O(1) no
+// matter how many there are; a task far in the future sits in a coarse
+// slot and moves down ("cascades") as its time approaches.
+//
+// The jitter budget is how late a task may run. Each run is rounded up
+// to a multiple of the largest power of two ticks that fits in the
+// budget, on the monotonic clock, so tasks with similar budgets fall on
+// the same tick and share one wakeup (e.g. battery poll, diagnostics
+// and chip health check). Runs are spaced from the nominal schedule,
+// the rounding does not accumulate.
+//
+// AddFd() puts an fd (netlink socket, GPIO line events, ...) in the
+// same epoll set: its callback runs when the fd is readable (or
+// writable, for a non-blocking sender waiting out a full socket), so
+// event sources need no thread of their own either.
+//
+// Callbacks run on the scheduler thread, one at a time: keep them
+// short (an I2C transfer, a statvfs()) and never block in one. One
+// that takes over SCHEDULER_SLOW_MS is logged.
+
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+using namespace std;
+
+#ifndef SCHEDULER_TICK_MS
+#define SCHEDULER_TICK_MS 10
+#endif
+#define SCHEDULER_WHEEL_BITS 6
+#define SCHEDULER_WHEEL_SLOTS (1 << SCHEDULER_WHEEL_BITS)
+// 4 levels of 64 slots at 10 ms: ~46 hours ahead; anything further
+// waits in the last slot and is re-filed when it comes round.
+#define SCHEDULER_WHEEL_LEVELS 4
+#define SCHEDULER_SLOW_MS 100
+
+typedef function<void(void)> SchedulerCallback;
+
+class Scheduler
+{
+public:
+	static Scheduler& GetInstance(void);
+	// Runs 'callback' every 'periodMs', the first time 'periodMs' from
+	// now, at most 'jitterMs' late. Returns the task id, 0 on failure.
+	int Add(const char *name, int periodMs, int jitterMs,
+		SchedulerCallback callback);
+	// Runs 'callback' whenever 'fd' is readable ('events' EPOLLIN), or
+	// writable (EPOLLOUT). Level triggered: the callback must read what
+	// is there, or Remove() a write watch once it has nothing to send.
+	// The fd stays the caller's to close, after Remove().
+	int AddFd(const char *name, int fd, SchedulerCallback callback,
+		uint32_t events = EPOLLIN);
+	// Every 'periodMs' from now on (first run 'periodMs' from now).
+	bool SetPeriod(int id, int periodMs);
+	// The task (or fd watch) won't run again. From any other thread this waits for a
+	// run in progress to finish; a callback may remove its own task.
+	bool Remove(int id);
+	int GetTaskCount(void);
+	// Times the scheduler thread woke up.
+	uint64_t GetWakeupCount(void) const;
+private:
+	struct Task
+	{
+		int id;
+		string name;
+		int fd;  // AddFd(); -1 for a timer
+		uint64_t periodTicks;
+		uint64_t alignTicks;  // Power of two, <= the jitter budget.
+		uint64_t nominal;  // Tick it would run with no jitter.
+		uint64_t due;  // Tick it runs at; 'nominal' rounded up.
+		SchedulerCallback callback;
+		bool removed;
+		bool restart;  // SetPeriod() while running.
+		// Wheel slot list.
+		Task *prev;
+		Task *next;
+		Task **slot;
+	};
+	Scheduler();
+	Scheduler(Scheduler const& copy);  // Not allowed
+	Scheduler& operator=(Scheduler const& copy);  // Not allowed
+	bool _start(void);
+	void _threadProc(void);
+	void _advance(uint64_t tick, unique_lock<mutex>& lock);
+	void _cascade(int level);
+	void _runSlot(unique_lock<mutex>& lock);
+	void _run(Task *t, unique_lock<mutex>& lock);
+	void _schedule(Task *t, uint64_t nominal);
+	void _link(Task *t);
+	void _unlink(Task *t);
+	bool _nextTick(uint64_t& tick);
+	void _arm(void);
+	void _wake(void);
+	static uint64_t _nowTick(void);
+	static void _atExit(void);
+	static void _atForkChild(void);
+	mutex m_mutex;  // Everything below
+	condition_variable m_idle;  // m_current finished
+	Task *m_wheel[SCHEDULER_WHEEL_LEVELS][SCHEDULER_WHEEL_SLOTS];
+	map<int, Task *> m_tasks;
+	int m_nextId;
+	uint64_t m_now;  // Last tick processed.
+	Task *m_current;  // Callback running now.
+	thread m_thread;
+	int m_epollFd;
+	int m_timerFd;
+	int m_eventFd;  // Add() / SetPeriod() / stop
+	atomic<bool> m_started;
+	atomic<bool> m_keepRunning;
+	atomic<uint64_t> m_wakeups;
+};
+
+#endif  // SCHEDULER_H_
@@ -0,0 +1,235 @@
+// SeqLock.h
+// A small record that is written rarely and read often, possibly by
+// other processes (it can live in shared memory, see SharedMemory.h).
+//
+// Readers never write to it and never wait for a lock: Read() copies
+// the record and checks the sequence number didn't move meanwhile,
+// retrying if a write was in progress. So a reader always gets all
+// fields from the same Write() / Modify(), never a mix of old and new.
+// A writer makes the sequence odd while it writes (taking turns with
+// any other writer, a short spin) and even again after.
+//
+// In shared memory the writer can be another process, and one killed
+// mid-write leaves the sequence odd for good. So a writer records its
+// pid while it holds the turn; one that has waited SEQ_LOCK_WRITE_SPINS
+// checks that pid and takes the turn over if the process is gone (the
+// half written record is then overwritten, or, for Modify(), the
+// rest of it written). If the holder is alive, or unknown (it died
+// between taking the turn and recording its pid, or the pid was
+// reused), it yields for up to SEQ_LOCK_WRITE_YIELDS turns and then
+// gives up: Write() / Modify() return false and the caller counts it.
+//
+// Giving up marks that turn stuck, so later writers (the callers are
+// hot paths: every I2C transfer, every setPWM()) fail at once rather
+// than wait again. No write holds a turn for SEQ_LOCK_STUCK_MS, so the
+// first writer after that takes a turn still marked stuck over,
+// whoever held it. (A holder that was only stopped, e.g. SIGSTOP, that
+// long and then finishes can leave one torn record; the next write
+// fixes it.)
+//
+// The record is stored as 32 bit atomic words (lock-free on every
+// target, and fine to load from a read-only mapping); T must be
+// trivially copyable. The sequence and the record start on a cache
+// line of their own so records next to each other don't share one.
+
+#ifndef SEQ_LOCK_H_
+#define SEQ_LOCK_H_
+
+#include <atomic>
+#include <type_traits>
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Read() gives up (returns false) after this many torn copies; only
+// a writer that died mid-write, or writes back to back with no gap,
+// keep it busy that long.
+#define SEQ_LOCK_READ_TRIES 10000
+// A write is a few dozen stores; a turn held this long is suspect.
+#define SEQ_LOCK_WRITE_SPINS 10000
+#define SEQ_LOCK_WRITE_YIELDS 1000
+#define SEQ_LOCK_STUCK_MS 1000
+
+template<typename T>
+class alignas(64) SeqLock
+{
+	static_assert(is_trivially_copyable<T>::value, "SeqLock<T>: T must be trivially copyable");
+public:
+	static const size_t Words = (sizeof(T) + 3) / 4;
+	// False if it couldn't get the writer's turn (see above).
+	bool Write(const T& value)
+	{
+		uint32_t s;
+		if (!_lock(s))
+		{
+			return false;
+		}
+		_store(value);
+		_unlock(s);
+		return true;
+	}
+	// Read, change and write back, all under the writer's turn.
+	template<typename F>
+	bool Modify(F f)
+	{
+		uint32_t s;
+		if (!_lock(s))
+		{
+			return false;
+		}
+		T value;
+		_load(value);
+		f(value);
+		_store(value);
+		_unlock(s);
+		return true;
+	}
+	// A consistent copy. 'version' (optional): how many writes it has
+	// seen, 0 if never written.
+	bool Read(T& value, uint32_t *version = nullptr) const
+	{
+		for (int tries = 0; tries < SEQ_LOCK_READ_TRIES; tries++)
+		{
+			uint32_t before = m_sequence.load(memory_order_acquire);
+			if ((before & 1) != 0)
+			{
+				continue;  // Being written.
+			}
+			_load(value);
+			atomic_thread_fence(memory_order_acquire);
+			if (m_sequence.load(memory_order_relaxed) == before)
+			{
+				if (version != nullptr)
+				{
+					*version = before / 2;
+				}
+				return true;
+			}
+		}
+		return false;
+	}
+	uint32_t Version(void) const
+	{
+		return m_sequence.load(memory_order_acquire) / 2;
+	}
+private:
+	// 's': the (even) sequence before this write.
+	bool _lock(uint32_t& s)
+	{
+		int32_t self = (int32_t)getpid();
+		int spins = 0;
+		int yields = 0;
+		s = m_sequence.load(memory_order_relaxed);
+		for (;;)
+		{
+			if ((s & 1) == 0)
+			{
+				if (m_sequence.compare_exchange_weak(s, s + 1,
+					memory_order_acquire, memory_order_relaxed))
+				{
+					m_writer.store(self, memory_order_relaxed);
+					break;
+				}
+				continue;
+			}
+			uint32_t stuck = m_stuck.load(memory_order_acquire);
+			if (stuck != s && ++spins < SEQ_LOCK_WRITE_SPINS)
+			{
+				s = m_sequence.load(memory_order_relaxed);
+				continue;
+			}
+			int32_t writer = m_writer.load(memory_order_relaxed);
+			if (writer != 0 && writer != self && kill(writer, 0) != 0 && errno == ESRCH
+				&& m_writer.compare_exchange_strong(writer, self, memory_order_acquire))
+			{
+				// A recorded pid holds the turn until it clears it, so
+				// the (odd) sequence is frozen: its turn is ours now.
+				s = m_sequence.load(memory_order_relaxed) - 1;
+				m_stuck.store(0, memory_order_relaxed);
+				break;
+			}
+			if (stuck == s)
+			{
+				// Given up on already: fail at once, or take it over
+				// (claimed on m_writer, like a dead pid's turn).
+				if (_nowMs() - m_stuckSinceMs.load(memory_order_relaxed) < SEQ_LOCK_STUCK_MS
+					|| !m_writer.compare_exchange_strong(writer, self, memory_order_acquire))
+				{
+					return false;
+				}
+				if (m_sequence.load(memory_order_relaxed) == s)
+				{
+					s--;
+					m_stuck.store(0, memory_order_relaxed);
+					break;
+				}
+				// It did finish: give back what isn't ours.
+				m_writer.compare_exchange_strong(self, 0, memory_order_relaxed);
+				s = m_sequence.load(memory_order_relaxed);
+				continue;
+			}
+			if (++yields > SEQ_LOCK_WRITE_YIELDS)
+			{
+				m_stuckSinceMs.store(_nowMs(), memory_order_relaxed);
+				m_stuck.store(s, memory_order_release);
+				return false;
+			}
+			sched_yield();
+			spins = 0;
+			s = m_sequence.load(memory_order_relaxed);
+		}
+		// The odd sequence is visible before any of the new words.
+		atomic_thread_fence(memory_order_release);
+		return true;
+	}
+	void _unlock(uint32_t s)
+	{
+		if (m_stuck.load(memory_order_relaxed) != 0)
+		{
+			m_stuck.store(0, memory_order_relaxed);  // A slow one after all
+		}
+		// Cleared first: a waiter that sees a pid sees its turn.
+		m_writer.store(0, memory_order_relaxed);
+		m_sequence.store(s + 2, memory_order_release);
+	}
+	// CLOCK_MONOTONIC, the same in every process; wraps, compare
+	// differences only.
+	static uint32_t _nowMs(void)
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint32_t)ts.tv_sec * 1000u + (uint32_t)(ts.tv_nsec / 1000000);
+	}
+	void _store(const T& value)
+	{
+		uint32_t words[Words] = { };
+		memcpy(words, &value, sizeof(T));
+		for (size_t i = 0; i < Words; i++)
+		{
+			m_words[i].store(words[i], memory_order_relaxed);
+		}
+	}
+	void _load(T& value) const
+	{
+		uint32_t words[Words];
+		for (size_t i = 0; i < Words; i++)
+		{
+			words[i] = m_words[i].load(memory_order_relaxed);
+		}
+		memcpy(&value, words, sizeof(T));
+	}
+	atomic<uint32_t> m_sequence;
+	atomic<int32_t> m_writer;  // pid holding the turn, 0 if none
+	atomic<uint32_t> m_stuck;  // Odd sequence given up on, 0 if none
+	atomic<uint32_t> m_stuckSinceMs;  // _nowMs() when it was
+	atomic<uint32_t> m_words[Words];
+};
+
+#endif  // SEQ_LOCK_H_
@@ -0,0 +1,157 @@
+// SharedMemory.cpp
+// No logging in here: tools map the segment without linking Log.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "SharedMemory.h"
+
+uint64_t SharedDataNowMs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+SharedMemory::SharedMemory()
+	: m_pSharedData(nullptr)
+{
+}
+
+SharedMemory::~SharedMemory()
+{
+	Close();
+}
+
+SharedData *SharedMemory::Writable(void)
+{
+	// Never deleted, see LogRing::GetInstance().
+	static SharedMemory *instance = new SharedMemory();
+	static bool opened = instance->Open();
+	(void)opened;
+	return instance->m_pSharedData;
+}
+
+bool SharedMemory::Open(bool readOnly)
+{
+	if (m_pSharedData != nullptr)
+	{
+		return true;
+	}
+	if (readOnly)
+	{
+		int fd = shm_open(SHARED_DATA_SHM_NAME, O_RDONLY | O_CLOEXEC, 0);
+		return fd >= 0 && _map(fd, true);
+	}
+	// Twice: the second time after removing a stale segment.
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		if (_create())
+		{
+			return true;
+		}
+		int fd = shm_open(SHARED_DATA_SHM_NAME, O_RDWR | O_CLOEXEC, 0);
+		if (fd < 0)
+		{
+			if (errno == ENOENT)
+			{
+				continue;  // Removed between the two shm_open()s.
+			}
+			return false;
+		}
+		if (_map(fd, false))
+		{
+			return true;
+		}
+		// Another build's, or its creator died setting it up.
+		// Readers that still have it mapped keep their copy.
+		shm_unlink(SHARED_DATA_SHM_NAME);
+	}
+	return false;
+}
+
+void SharedMemory::Close(void)
+{
+	if (m_pSharedData != nullptr)
+	{
+		munmap(m_pSharedData, sizeof(SharedData));
+		m_pSharedData = nullptr;
+	}
+}
+
+bool SharedMemory::_create(void)
+{
+	const size_t size = sizeof(SharedData);
+	int fd = shm_open(SHARED_DATA_SHM_NAME, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	if (fd < 0)
+	{
+		return false;
+	}
+	// Readers run as other users; don't let umask lock them out.
+	fchmod(fd, 0666);
+	if (ftruncate(fd, size) != 0)
+	{
+		close(fd);
+		shm_unlink(SHARED_DATA_SHM_NAME);
+		return false;
+	}
+	void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+	{
+		shm_unlink(SHARED_DATA_SHM_NAME);
+		return false;
+	}
+	// ftruncate() gave us zeroed memory: every SeqLock at sequence 0,
+	// never written.
+	SharedData *shared = static_cast<SharedData *>(p);
+	shared->version = SHARED_DATA_VERSION;
+	shared->size = size;
+	shared->magic.store(SHARED_DATA_MAGIC, memory_order_release);
+	m_pSharedData = shared;
+	return true;
+}
+
+// Maps (and closes) 'fd' if it is a finished segment of this version.
+bool SharedMemory::_map(int fd, bool readOnly)
+{
+	const size_t size = sizeof(SharedData);
+	// The creator may not have sized or set it up yet.
+	struct stat st;
+	int waitedMs = 0;
+	while (fstat(fd, &st) == 0 && (size_t)st.st_size < size && waitedMs < 1000)
+	{
+		usleep(1000);
+		waitedMs++;
+	}
+	if ((size_t)st.st_size < size)
+	{
+		close(fd);
+		return false;
+	}
+	void *p = mmap(nullptr, size, readOnly ? PROT_READ : PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+	{
+		return false;
+	}
+	SharedData *shared = static_cast<SharedData *>(p);
+	while (shared->magic.load(memory_order_acquire) != SHARED_DATA_MAGIC && waitedMs < 1000)
+	{
+		usleep(1000);
+		waitedMs++;
+	}
+	if (shared->magic.load(memory_order_acquire) != SHARED_DATA_MAGIC
+		|| shared->version != SHARED_DATA_VERSION || shared->size != size)
+	{
+		munmap(p, size);
+		return false;
+	}
+	m_pSharedData = shared;
+	return true;
+}
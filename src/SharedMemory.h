@@ -0,0 +1,104 @@
+// SharedMemory.h
+// State other processes (and Diagnostics) read without asking us: the
+// SharedData segment, SHARED_DATA_SHM_NAME.
+//
+// In raw/ BatteryChecker USED TO store batteryChargingStatus and
+// batteryVoltageStatus into SharedData as two plain stores, and
+// Diagnostics (another process) read them as two plain loads: nothing
+// ordered them, and a reader could pair a new charging status with an
+// old voltage status. Now each record is a SeqLock: readers get one
+// consistent copy, wait-free unless a write is in progress, and never
+// take a lock or write to the segment (tools/pwmstat maps it read
+// only). Records are cache line aligned, so the writers of one don't
+// slow down readers of another.
+//
+// Besides the battery record it carries what is cheap to publish on
+// every change: the PCA9685's duty cycles (PwmServoDriver::setPWM())
+// and I2C bus counters (I2cBus::Transfer()).
+//
+// The segment is versioned: a process that finds one from a different
+// build (SHARED_DATA_VERSION / size) replaces it if it is a writer and
+// refuses it if it is a reader. Bump the version when SharedData
+// changes.
+
+#ifndef SHARED_MEMORY_H_
+#define SHARED_MEMORY_H_
+
+#include <atomic>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "SeqLock.h"
+
+using namespace std;
+
+#ifndef SHARED_DATA_SHM_NAME
+#define SHARED_DATA_SHM_NAME "/i2c_shared_data"
+#endif
+#define SHARED_DATA_MAGIC 0x44534332  // "2CSD"
+#define SHARED_DATA_VERSION 3
+#define SHARED_DATA_PWM_CHANNELS 16
+
+// Milliseconds on CLOCK_MONOTONIC: the same clock in every process.
+uint64_t SharedDataNowMs(void);
+
+struct SharedBattery
+{
+	int32_t voltageStatus;  // VoltageStatus
+	int32_t chargingStatus;  // ChargingStatus
+	int32_t capacityPercent;
+	int32_t pollIntervalMs;
+	uint64_t updatedMs;  // SharedDataNowMs()
+	uint64_t checks;
+};
+
+struct SharedPwm
+{
+	uint16_t on[SHARED_DATA_PWM_CHANNELS];
+	uint16_t off[SHARED_DATA_PWM_CHANNELS];
+	uint32_t address;  // PCA9685 slave address
+	uint32_t reserved;
+	uint64_t updatedMs;
+	uint64_t writes;
+};
+
+struct SharedBus
+{
+	uint64_t transfers;
+	uint64_t failures;
+	uint64_t bytes;
+	uint64_t updatedMs;
+};
+
+struct SharedData
+{
+	atomic<uint32_t> magic;  // Set last, by the creator.
+	uint32_t version;
+	uint32_t size;
+	SeqLock<SharedBattery> battery;
+	SeqLock<SharedPwm> pwm;
+	SeqLock<SharedBus> bus;
+};
+
+class SharedMemory
+{
+public:
+	SharedMemory();
+	~SharedMemory();
+	// Maps the segment. Writers create (or replace a stale) one;
+	// readers ('readOnly') only map an existing one of this version.
+	bool Open(bool readOnly = false);
+	void Close(void);
+	SharedData *m_pSharedData;
+	// This process's writable mapping, opened on first use and never
+	// unmapped; nullptr if that failed.
+	static SharedData *Writable(void);
+private:
+	SharedMemory(SharedMemory const& copy);  // Not allowed
+	SharedMemory& operator=(SharedMemory const& copy);  // Not allowed
+	bool _create(void);
+	bool _map(int fd, bool readOnly);
+};
+
+#endif  // SHARED_MEMORY_H_
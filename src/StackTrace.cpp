@@ -0,0 +1,289 @@
+// StackTrace.cpp
+
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <elf.h>
+#include <execinfo.h>
+#include <link.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "Log.h"
+#include "LogHandle.h"
+#include "StackTrace.h"
+
+// Deferred traces are rendered at this nice value:
+#define STACK_TRACE_RENDER_NICE 10
+
+StackTraces& StackTraces::GetInstance(void)
+{
+	// Never deleted, see LogRing::GetInstance().
+	static StackTraces *instance = new StackTraces();
+	return *instance;
+}
+
+StackTraces::StackTraces()
+	: m_rendererStarted(false), m_keepRunning(true), m_dropped(0)
+{
+	// The first backtrace() call dlopen()s libgcc_s (and so mallocs);
+	// get that over with now rather than in the first Capture().
+	void *prime[2];
+	backtrace(prime, 2);
+	sem_init(&m_wakeup, 0, 0);
+	pthread_atfork(nullptr, nullptr, _atForkChild);
+}
+
+void StackTraces::Capture(StackTrace& trace, int skip)
+{
+	static StackTraces& primed = GetInstance();
+	(void)primed;
+	// +1 for Capture() itself.
+	void *frames[STACK_TRACE_MAX_FRAMES + 8];
+	int want = STACK_TRACE_MAX_FRAMES + 1 + skip;
+	if (want > (int)(sizeof(frames) / sizeof(frames[0])))
+	{
+		want = sizeof(frames) / sizeof(frames[0]);
+	}
+	int n = backtrace(frames, want) - (1 + skip);
+	if (n < 0)
+	{
+		n = 0;
+	}
+	memcpy(trace.frames, frames + 1 + skip, n * sizeof(void *));
+	trace.count = n;
+}
+
+const StackTraces::Frame& StackTraces::_symbolize(void *addr)
+{
+	// Caller holds m_cacheMutex.
+	auto it = m_cache.find(addr);
+	if (it != m_cache.end())
+	{
+		return it->second;
+	}
+	Frame f;
+	Dl_info info;
+	// 'addr' is a return address, it may be one past the end of the
+	// calling function; look up the call instruction instead.
+	if (dladdr((char *)addr - 1, &info) == 0 || info.dli_fname == nullptr)
+	{
+		char buf[32];
+		snprintf(buf, sizeof(buf), "[%p]", addr);
+		f.text = buf;
+		return m_cache.emplace(addr, f).first->second;
+	}
+	f.text = info.dli_fname;
+	f.text += " : ";
+	if (info.dli_sname != nullptr)
+	{
+		int status;
+		char *demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+		if (status == 0 && demangled != nullptr)
+		{
+			f.text += demangled;
+		}
+		else
+		{
+			// Not C++, show it as a C function with no arguments.
+			f.text += info.dli_sname;
+			f.text += "()";
+		}
+		free(demangled);
+		char ofst[32];
+		snprintf(ofst, sizeof(ofst), "+0x%lx",
+			(unsigned long)((char *)addr - (char *)info.dli_saddr));
+		f.text += ofst;
+	}
+	else
+	{
+		f.text += "?";
+	}
+	// addr2line wants the offset into the file for a PIE or shared
+	// library, the absolute address for an old fixed-address ET_EXEC.
+	uintptr_t fileAddr = (uintptr_t)addr;
+	const ElfW(Ehdr) *ehdr = (const ElfW(Ehdr) *)info.dli_fbase;
+	if (ehdr != nullptr && ehdr->e_type != ET_EXEC)
+	{
+		fileAddr -= (uintptr_t)info.dli_fbase;
+	}
+	const char *module = strrchr(info.dli_fname, '/');
+	module = (module != nullptr) ? (module + 1) : info.dli_fname;
+	// Give a line that I can copy and execute to get a line number:
+	char hint[300];
+	snprintf(hint, sizeof(hint), "    ~/cross/addr2line 0x%lx -e %s",
+		(unsigned long)fileAddr, module);
+	f.hint = hint;
+	return m_cache.emplace(addr, f).first->second;
+}
+
+string StackTraces::Render(const StackTrace& trace, const char *who)
+{
+	string s("Stack Trace from ");
+	s += who;
+	s += ":\r\n";
+	if (trace.count == 0)
+	{
+		s += "  <empty, possibly corrupt>\r\n";
+		return s;
+	}
+	// For some reason the ARM returns 64 in addrlen and [7]->[63] are
+	// exactly the same! So stop when [6] == [7]
+	int count = trace.count;
+	for (int i = 0; i < count - 1; i++)
+	{
+		if (trace.frames[i] == trace.frames[i + 1])
+		{
+			count = i + 2;  // Actually shows two repeats. OK.
+			break;
+		}
+	}
+	// The last entry is always "__libc_start_main..." and I don't care
+	// about that entry, do one less...
+	int last = (count > 1) ? (count - 1) : count;
+	lock_guard<mutex> lock(m_cacheMutex);
+	for (int i = 0; i < last; i++)
+	{
+		const Frame& f = _symbolize(trace.frames[i]);
+		s += to_string(i + 1);
+		s += ":  ";
+		s += f.text;
+		s += "\r\n";
+		if (!f.hint.empty())
+		{
+			s += f.hint;
+			s += "\r\n";
+		}
+	}
+	return s;
+}
+
+bool StackTraces::Defer(uint16_t owner, const char *at, const char *msg,
+	const StackTrace& trace)
+{
+	bool queued = m_queue.TryPush([&](Deferred& d)
+	{
+		d.owner = owner;
+		d.at = at;
+		snprintf(d.msg, sizeof(d.msg), "%s", msg);
+		d.trace = trace;
+	});
+	if (!queued)
+	{
+		m_dropped.fetch_add(1, memory_order_relaxed);
+		return false;
+	}
+	if (!m_rendererStarted.load(memory_order_acquire))
+	{
+		_startRenderer();
+	}
+	if (!m_keepRunning.load(memory_order_acquire))
+	{
+		// Logged from a static destructor after _atExit() stopped
+		// the renderer: do it myself.
+		while (m_queue.TryPop([&](Deferred& d) { _renderDeferred(d); }))
+		{
+		}
+		return true;
+	}
+	sem_post(&m_wakeup);
+	return true;
+}
+
+uint64_t StackTraces::GetDroppedCount(void) const
+{
+	return m_dropped.load(memory_order_relaxed);
+}
+
+void StackTraces::_startRenderer(void)
+{
+	static mutex startMutex;
+	lock_guard<mutex> lock(startMutex);
+	if (m_rendererStarted.load(memory_order_relaxed))
+	{
+		return;
+	}
+	// LogRing registers its atexit() handler first, so ours (which
+	// still logs) runs before the ring's writer is stopped.
+	LogRing::GetInstance();
+	static int atExitInstalled = atexit(_atExit);
+	(void)atExitInstalled;
+	m_renderer = thread(&StackTraces::_rendererThreadProc, this);
+	m_rendererStarted.store(true, memory_order_release);
+}
+
+void StackTraces::_rendererThreadProc(void)
+{
+	FlightRecorder::InstallAltStack();
+	// Linux: setpriority() on a TID affects only this thread.
+	setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), STACK_TRACE_RENDER_NICE);
+	for (;;)
+	{
+		while (m_queue.TryPop([&](Deferred& d) { _renderDeferred(d); }))
+		{
+		}
+		if (!m_keepRunning.load(memory_order_acquire))
+		{
+			break;
+		}
+		while (sem_wait(&m_wakeup) != 0 && errno == EINTR)
+		{
+		}
+	}
+}
+
+void StackTraces::_renderDeferred(const Deferred& d)
+{
+	// The interned owner: SetLevel() on it applies here too.
+	Log& log = LogOwners::Get(d.owner);
+	if (!log.IsEnabled(LogLevelError))
+	{
+		return;
+	}
+	string name(log.GetLogName());  // "xyz: "
+	if (name.length() >= 2)
+	{
+		name.resize(name.length() - 2);
+	}
+	log.Emit(LogLevelError, d.at, d.msg);
+	// One record per line: a whole trace won't fit in a LogRing slot.
+	string s = Render(d.trace, name.c_str());
+	size_t start = 0;
+	size_t end;
+	while ((end = s.find("\r\n", start)) != string::npos)
+	{
+		log.Emit(LogLevelError, d.at, s.substr(start, end - start).c_str());
+		start = end + 2;
+	}
+}
+
+void StackTraces::_atExit(void)
+{
+	// Render whatever is still queued before the process goes away.
+	StackTraces& traces = GetInstance();
+	if (!traces.m_rendererStarted.load(memory_order_acquire))
+	{
+		return;
+	}
+	traces.m_keepRunning.store(false, memory_order_release);
+	sem_post(&traces.m_wakeup);
+	if (traces.m_renderer.joinable())
+	{
+		traces.m_renderer.join();
+	}
+}
+
+void StackTraces::_atForkChild(void)
+{
+	StackTraces& traces = GetInstance();
+	// The renderer thread doesn't exist in the child; forget it
+	// without joining. The parent renders what it queued.
+	new (&traces.m_renderer) thread();
+	new (&traces.m_cacheMutex) mutex();
+	traces.m_rendererStarted.store(false, memory_order_relaxed);
+	traces.m_keepRunning.store(true, memory_order_relaxed);
+	while (traces.m_queue.TryPop([](Deferred&) { }))
+	{
+	}
+	sem_init(&traces.m_wakeup, 0, 0);
+}
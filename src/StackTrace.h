@@ -0,0 +1,103 @@
+// StackTrace.h
+// Stack traces split into a cheap capture and a deferred render.
+//
+// Log::GetStackTrace() USED TO call backtrace_symbols() (malloc),
+// malloc a demangle buffer and run __cxa_demangle() on every frame of
+// every trace: far too slow to attach a trace to an error in the field.
+//
+// Now:
+//   Capture()  stores raw return addresses in a StackTrace (no malloc,
+//              no lock, no symbol lookup).
+//   Render()   turns them into text with dladdr() + __cxa_demangle(),
+//              caching each address so a trace seen before costs only
+//              the string appends.
+//   Defer()    queues an error line plus its trace; a low priority
+//              thread in this process renders and logs it later, off
+//              the caller's hot path. (Symbols only make sense in the
+//              process that captured them, so this can't be done by
+//              the LogRing writer, which may be another process.)
+//
+// NB: Link with '-rdynamic' or dladdr() only finds exported symbols
+// and the frames show as 'module : ?' (the addr2line hint still works).
+
+#ifndef STACK_TRACE_H_
+#define STACK_TRACE_H_
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include <semaphore.h>
+#include <stdint.h>
+
+#include "BoundedQueue.h"
+
+using namespace std;
+
+#define STACK_TRACE_MAX_FRAMES 32
+// Must be a power of two.
+#define STACK_TRACE_QUEUE_SIZE 16
+#define STACK_TRACE_MSG_LEN 256
+
+struct StackTrace
+{
+	void *frames[STACK_TRACE_MAX_FRAMES];
+	int count;
+};
+
+class StackTraces
+{
+public:
+	static StackTraces& GetInstance(void);
+	// Raw return addresses of the caller, skipping 'skip' more frames
+	// (Capture() itself is never included).
+	static void Capture(StackTrace& trace, int skip = 0);
+	// "Stack Trace from who:\r\n" then one line per frame plus an
+	// addr2line hint line, same layout GetStackTrace() always had.
+	string Render(const StackTrace& trace, const char *who);
+	// Queues an error line and its trace for the render thread.
+	// 'owner' is the LogOwners id (LogHandle::Id()) they are logged
+	// through, so its runtime level applies; 'at' must be a string
+	// literal (AT). Returns false if the queue is full; the caller
+	// should log the line without its trace.
+	bool Defer(uint16_t owner, const char *at, const char *msg,
+		const StackTrace& trace);
+	// Traces dropped because the queue was full.
+	uint64_t GetDroppedCount(void) const;
+private:
+	StackTraces();
+	StackTraces(StackTraces const& copy);  // Not allowed
+	StackTraces& operator=(StackTraces const& copy);  // Not allowed
+	struct Frame
+	{
+		string text;  // "./pwm : I2c::WriteByte(unsigned char)+0x4c"
+		string hint;  // "    ~/cross/addr2line 0x2f3c -e pwm"
+	};
+	struct Deferred
+	{
+		uint16_t owner;
+		const char *at;
+		char msg[STACK_TRACE_MSG_LEN];
+		StackTrace trace;
+	};
+	const Frame& _symbolize(void *addr);
+	void _startRenderer(void);
+	void _rendererThreadProc(void);
+	void _renderDeferred(const Deferred& d);
+	static void _atExit(void);
+	static void _atForkChild(void);
+	// Per-address cache. Bounded by the number of distinct return
+	// addresses in the program, not by traffic.
+	mutex m_cacheMutex;
+	unordered_map<void *, Frame> m_cache;
+	BoundedQueue<Deferred, STACK_TRACE_QUEUE_SIZE> m_queue;
+	sem_t m_wakeup;
+	thread m_renderer;
+	atomic<bool> m_rendererStarted;
+	atomic<bool> m_keepRunning;
+	atomic<uint64_t> m_dropped;
+};
+
+#endif  // STACK_TRACE_H_
@@ -0,0 +1,126 @@
+// SysfsAttribute.cpp
+
+#include <charconv>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "SysfsAttribute.h"
+
+SysfsAttribute::SysfsAttribute(const string& path)
+	: m_path(path), m_fd(-1), m_lastError(0)
+{
+}
+
+SysfsAttribute::~SysfsAttribute()
+{
+	Close();
+}
+
+bool SysfsAttribute::Open(void)
+{
+	if (m_fd >= 0)
+	{
+		return true;
+	}
+	m_fd = open(m_path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (m_fd < 0)
+	{
+		m_lastError = errno;
+		return false;
+	}
+	return true;
+}
+
+void SysfsAttribute::Close(void)
+{
+	if (m_fd >= 0)
+	{
+		close(m_fd);
+		m_fd = -1;
+	}
+}
+
+int SysfsAttribute::Read(char *buf, size_t size)
+{
+	if (size == 0 || !Open())
+	{
+		return -1;
+	}
+	ssize_t n;
+	while ((n = pread(m_fd, buf, size - 1, 0)) < 0 && errno == EINTR)
+	{
+	}
+	if (n < 0)
+	{
+		// ENODEV and friends: the device (or driver) went away; try a
+		// fresh open next time.
+		m_lastError = errno;
+		Close();
+		return -1;
+	}
+	buf[n] = '\0';
+	return (int)n;
+}
+
+bool SysfsAttribute::ReadInt(int64_t& value, int base)
+{
+	char buf[SYSFS_ATTRIBUTE_MAX];
+	int n = Read(buf, sizeof(buf));
+	if (n < 0)
+	{
+		return false;
+	}
+	const char *p = buf;
+	const char *end = buf + n;
+	while (p < end && (*p == ' ' || *p == '\t'))
+	{
+		p++;
+	}
+	if (base == 16 && end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+	{
+		p += 2;
+	}
+	int64_t v;
+	from_chars_result r = from_chars(p, end, v, base);
+	if (r.ec != errc())
+	{
+		m_lastError = EINVAL;
+		return false;
+	}
+	value = v;
+	return true;
+}
+
+bool SysfsAttribute::ReadInt(int& value, int base)
+{
+	int64_t v;
+	if (!ReadInt(v, base))
+	{
+		return false;
+	}
+	value = (int)v;
+	return true;
+}
+
+bool SysfsAttribute::WaitForChange(int timeoutMs)
+{
+	if (!Open())
+	{
+		return false;
+	}
+	struct pollfd pfd;
+	pfd.fd = m_fd;
+	pfd.events = POLLPRI | POLLERR;
+	pfd.revents = 0;
+	int rv = poll(&pfd, 1, timeoutMs);
+	if (rv < 0)
+	{
+		m_lastError = errno;
+		return false;
+	}
+	return rv > 0;
+}
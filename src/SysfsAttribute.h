@@ -0,0 +1,64 @@
+// SysfsAttribute.h
+// One sysfs attribute (a small text file such as
+// /sys/class/power_supply/battery/capacity), kept open and re-read
+// cheaply.
+//
+// BatteryChecker::GetBatteryVoltageRaw() USED TO build an ifstream,
+// getline() into a string and parse it through an istringstream on
+// every poll: an open() / close() and several allocations for a three
+// character file. Now the fd is opened on first use and stays open;
+// each read is one pread(fd, buf, n, 0) into a stack buffer, parsed
+// with from_chars(). sysfs regenerates the value on every read from
+// offset 0, so nothing needs re-opening. If the device goes away
+// (ENODEV etc.) the fd is closed and the next read opens it again.
+//
+// Attributes whose driver calls sysfs_notify() can be waited on:
+// WaitForChange() poll()s for POLLPRI | POLLERR, or put Fd() in an
+// epoll set with EPOLLPRI. Read() after each wakeup re-arms it.
+//
+// Not thread safe: one reader (e.g. a Scheduler task) per object.
+
+#ifndef SYSFS_ATTRIBUTE_H_
+#define SYSFS_ATTRIBUTE_H_
+
+#include <string>
+
+#include <stddef.h>
+#include <stdint.h>
+
+using namespace std;
+
+// Longest value read; sysfs attributes are at most a page, the
+// numeric ones a few bytes.
+#define SYSFS_ATTRIBUTE_MAX 64
+
+class SysfsAttribute
+{
+public:
+	explicit SysfsAttribute(const string& path);
+	~SysfsAttribute();
+	const string& Path(void) const { return m_path; }
+	// Opens now rather than on the first read.
+	bool Open(void);
+	void Close(void);
+	// The raw value, NUL terminated; returns its length, -1 on error.
+	int Read(char *buf, size_t size);
+	// The leading integer ('base' 16 takes an optional "0x"). False on
+	// a read error (GetLastError()) or if there is no number
+	// (GetLastError() is EINVAL).
+	bool ReadInt(int64_t& value, int base = 10);
+	bool ReadInt(int& value, int base = 10);
+	// For attributes that notify: true when it changed, false on
+	// timeout or error. -1: wait forever.
+	bool WaitForChange(int timeoutMs);
+	int Fd(void) const { return m_fd; }
+	int GetLastError(void) const { return m_lastError; }
+private:
+	SysfsAttribute(SysfsAttribute const& copy);  // Not allowed
+	SysfsAttribute& operator=(SysfsAttribute const& copy);  // Not allowed
+	string m_path;
+	int m_fd;
+	int m_lastError;
+};
+
+#endif  // SYSFS_ATTRIBUTE_H_
@@ -0,0 +1,292 @@
+// Wire.cpp
+
+#include <errno.h>
+#include <string.h>
+
+#include <linux/i2c.h>
+
+#include "Log.h"
+#include "LogHandle.h"
+#include "Wire.h"
+
+TwoWire Wire;
+
+TwoWire::TwoWire(I2cBus& bus, size_t bufferSize)
+	: m_bus(bus), m_bufferSize(WIRE_BUFFER_SIZE), m_transmitting(false),
+	m_overflow(false), m_writeError(0), m_heldCount(0), m_rxIndex(0), m_rxLength(0)
+{
+	// No Log here: 'Wire' is constructed before main().
+	m_tx.address = 0;
+	m_tx.offset = 0;
+	m_tx.length = 0;
+	setBufferSize(bufferSize);
+}
+
+size_t TwoWire::setBufferSize(size_t size)
+{
+	if (size < 1 || size > I2C_MAX_MESSAGE || m_transmitting || m_heldCount > 0)
+	{
+		return 0;
+	}
+	m_bufferSize = size;
+	// Grown again as needed; an instance that only sends short
+	// messages never holds more than those.
+	m_rxBuffer.clear();
+	m_rxBuffer.shrink_to_fit();
+	m_rxIndex = 0;
+	m_rxLength = 0;
+	return m_bufferSize;
+}
+
+void TwoWire::begin(void)
+{
+	m_transmitting = false;
+	m_heldCount = 0;
+	m_txData.clear();
+	m_rxIndex = 0;
+	m_rxLength = 0;
+}
+
+void TwoWire::begin(uint8_t address)
+{
+	static LogHandle log("Wire");
+	LOGF_ERROR(log, "Wire: begin(0x%02x): no I2C slave mode on Linux", address);
+	begin();
+}
+
+void TwoWire::begin(int address)
+{
+	begin((uint8_t)address);
+}
+
+void TwoWire::setClock(uint32_t frequency)
+{
+	// clock-frequency in the device tree; nothing to do from here.
+	(void)frequency;
+}
+
+void TwoWire::beginTransmission(uint8_t address)
+{
+	if (m_heldCount == 0)
+	{
+		m_txData.clear();
+	}
+	m_transmitting = true;
+	m_overflow = false;
+	m_tx.address = address;
+	m_tx.offset = m_txData.size();
+	m_tx.length = 0;
+}
+
+void TwoWire::beginTransmission(int address)
+{
+	beginTransmission((uint8_t)address);
+}
+
+uint8_t TwoWire::endTransmission(uint8_t sendStop)
+{
+	if (!m_transmitting)
+	{
+		return 4;
+	}
+	m_transmitting = false;
+	if (m_overflow)
+	{
+		m_heldCount = 0;
+		m_txData.clear();
+		return 1;
+	}
+	m_held[m_heldCount++] = m_tx;
+	if (!sendStop && m_heldCount < WIRE_MAX_SEGMENTS)
+	{
+		return 0;  // Goes with the next requestFrom() / endTransmission().
+	}
+	return _send(0, 0);
+}
+
+uint8_t TwoWire::endTransmission(void)
+{
+	return endTransmission((uint8_t)true);
+}
+
+size_t TwoWire::requestFrom(uint16_t address, size_t quantity, bool sendStop)
+{
+	// Always a STOP at the end (see Wire.h).
+	(void)sendStop;
+	if (quantity > m_bufferSize)
+	{
+		quantity = m_bufferSize;
+	}
+	if (m_rxBuffer.size() < quantity)
+	{
+		m_rxBuffer.resize(quantity);
+	}
+	m_rxIndex = 0;
+	m_rxLength = 0;
+	if (_send(address, quantity) != 0)
+	{
+		return 0;
+	}
+	m_rxLength = quantity;
+	return quantity;
+}
+
+uint8_t TwoWire::requestFrom(uint8_t address, uint8_t quantity, uint8_t sendStop)
+{
+	return (uint8_t)requestFrom((uint16_t)address, (size_t)quantity, sendStop != 0);
+}
+
+uint8_t TwoWire::requestFrom(uint8_t address, uint8_t quantity, uint32_t iaddress,
+	uint8_t isize, uint8_t sendStop)
+{
+	if (isize > 0)
+	{
+		beginTransmission(address);
+		// Three bytes at most, MSB first.
+		if (isize > 3)
+		{
+			isize = 3;
+		}
+		while (isize-- > 0)
+		{
+			write((uint8_t)(iaddress >> (isize * 8)));
+		}
+		endTransmission((uint8_t)false);
+	}
+	return requestFrom(address, quantity, sendStop);
+}
+
+uint8_t TwoWire::requestFrom(uint8_t address, uint8_t quantity)
+{
+	return requestFrom(address, quantity, (uint8_t)true);
+}
+
+uint8_t TwoWire::requestFrom(int address, int quantity)
+{
+	return requestFrom((uint8_t)address, (uint8_t)quantity, (uint8_t)true);
+}
+
+uint8_t TwoWire::requestFrom(int address, int quantity, int sendStop)
+{
+	return requestFrom((uint8_t)address, (uint8_t)quantity, (uint8_t)sendStop);
+}
+
+size_t TwoWire::write(uint8_t data)
+{
+	if (!m_transmitting)
+	{
+		// Would be a slave's reply; no such thing here.
+		m_writeError = 1;
+		return 0;
+	}
+	if (m_tx.length >= m_bufferSize)
+	{
+		m_overflow = true;
+		m_writeError = 1;
+		return 0;
+	}
+	m_txData.push_back(data);
+	m_tx.length++;
+	return 1;
+}
+
+size_t TwoWire::write(const uint8_t *data, size_t quantity)
+{
+	size_t n = 0;
+	while (n < quantity && write(data[n]) == 1)
+	{
+		n++;
+	}
+	return n;
+}
+
+size_t TwoWire::write(const char *str)
+{
+	return str == nullptr ? 0 : write((const uint8_t *)str, strlen(str));
+}
+
+int TwoWire::available(void)
+{
+	return m_rxLength - m_rxIndex;
+}
+
+int TwoWire::read(void)
+{
+	if (m_rxIndex < m_rxLength)
+	{
+		return m_rxBuffer[m_rxIndex++];
+	}
+	return -1;
+}
+
+int TwoWire::peek(void)
+{
+	if (m_rxIndex < m_rxLength)
+	{
+		return m_rxBuffer[m_rxIndex];
+	}
+	return -1;
+}
+
+size_t TwoWire::readBytes(uint8_t *buffer, size_t length)
+{
+	size_t n = 0;
+	while (n < length && m_rxIndex < m_rxLength)
+	{
+		buffer[n++] = m_rxBuffer[m_rxIndex++];
+	}
+	return n;
+}
+
+void TwoWire::flush(void)
+{
+	// Arduino's doesn't either; writes go out at endTransmission().
+}
+
+void TwoWire::onReceive(void (*function)(int))
+{
+	static LogHandle log("Wire");
+	(void)function;
+	log->LogErr(AT, "Wire: onReceive(): no I2C slave mode on Linux");
+}
+
+void TwoWire::onRequest(void (*function)(void))
+{
+	static LogHandle log("Wire");
+	(void)function;
+	log->LogErr(AT, "Wire: onRequest(): no I2C slave mode on Linux");
+}
+
+// The held writes, then (if 'readLength') a read into m_rxBuffer, all
+// in one I2C_RDWR. Returns endTransmission()'s code.
+uint8_t TwoWire::_send(uint16_t readAddress, size_t readLength)
+{
+	i2c_msg msgs[WIRE_MAX_SEGMENTS + 1];
+	int count = 0;
+	for (int i = 0; i < m_heldCount; i++)
+	{
+		msgs[count++] = { m_held[i].address, 0, (uint16_t)m_held[i].length,
+			m_txData.data() + m_held[i].offset };
+	}
+	m_heldCount = 0;
+	if (readLength > 0)
+	{
+		msgs[count++] = { readAddress, I2C_M_RD, (uint16_t)readLength, m_rxBuffer.data() };
+	}
+	if (count == 0)
+	{
+		return 0;
+	}
+	int error = 0;
+	bool ok = m_bus.Transfer(msgs, count, &error);
+	m_txData.clear();
+	if (ok)
+	{
+		return 0;
+	}
+	if (error == ENXIO)
+	{
+		return 2;
+	}
+	return error == EREMOTEIO ? 3 : 4;
+}
@@ -0,0 +1,155 @@
+// Wire.h
+// Arduino's TwoWire (raw/Wire.h) for Linux i2c-dev, so drivers written
+// against it (raw/Adafruit_PWMServoDriver.cpp and friends) build and
+// run here as they are:
+//
+//     Wire.beginTransmission(0x40);
+//     Wire.write(LED0_ON_L + 4 * num);
+//     Wire.write(on);
+//     ...
+//     Wire.endTransmission();
+//
+// USED TO be hand translated, a byte at a time, into I2c::WriteByte()
+// calls, each its own transfer with its own START and STOP (so the
+// chip saw a register number, then a "register number", ...). Now the
+// writes between beginTransmission() and endTransmission() are
+// buffered and go out as one I2C write: one I2cBus::Transfer(), one
+// ioctl(I2C_RDWR).
+//
+// endTransmission(false) (repeated start) holds the write back and
+// returns 0; the next requestFrom() or endTransmission() sends it and
+// its own message in the same I2C_RDWR, with a repeated START and no
+// STOP in between, so the usual "write register number, read it back"
+// is one bus transaction:
+//     Wire.beginTransmission(addr);
+//     Wire.write(reg);
+//     Wire.endTransmission(false);
+//     Wire.requestFrom(addr, 1);
+//     uint8_t value = Wire.read();
+// So an endTransmission(false) can't report a NACK; the one that sends
+// it does. Up to WIRE_MAX_SEGMENTS messages are held; one more sends
+// them all.
+//
+// The Arduino's buffers are static 32 byte arrays (BUFFER_LENGTH, and
+// TWI_BUFFER_LENGTH under it), so a full PCA9685 frame (register + 64
+// bytes) had to be split into three transactions. Here each instance
+// has its own capacity, WIRE_BUFFER_SIZE (i2c-dev's limit) unless
+// given to the constructor or setBufferSize(); buffers grow as they
+// are written, up to that. BUFFER_LENGTH is still defined, for drivers
+// that test it.
+//
+// Differences from the Arduino's:
+//   - no slave mode: begin(address), onReceive() and onRequest() log an
+//     error and do nothing (i2c-dev only does master);
+//   - setClock() is ignored: the adapter's clock comes from the device
+//     tree;
+//   - every transfer ends with a STOP, even requestFrom(.., false): i2c-dev
+//     can't keep the bus between two ioctl()s;
+//   - endTransmission() returns 1 (data too long) and sends nothing if
+//     more than the buffer size was written; a length the adapter
+//     refuses (EOPNOTSUPP) is 4, it isn't split up: only the driver
+//     knows where a message can be cut (see I2cBus::WriteRegisters());
+//     2 is ENXIO (address NACK), 3 EREMOTEIO (data NACK), 4 anything
+//     else.
+//
+// Not thread safe, like the Arduino's: a transmission is state kept
+// between calls. Use one TwoWire per thread ('Wire' for the main
+// thread); they share the bus (I2cBus), which is.
+
+#ifndef WIRE_H_
+#define WIRE_H_
+
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "I2c.h"
+
+// Arduino drivers test this to size their own chunks.
+#ifndef BUFFER_LENGTH
+#define BUFFER_LENGTH 32
+#endif
+#ifndef WIRE_BUFFER_SIZE
+#define WIRE_BUFFER_SIZE I2C_MAX_MESSAGE
+#endif
+#define WIRE_MAX_SEGMENTS 4
+
+using namespace std;
+
+class TwoWire
+{
+public:
+	explicit TwoWire(I2cBus& bus = I2cBus::GetInstance(),
+		size_t bufferSize = WIRE_BUFFER_SIZE);
+	// Longest message written or read, 1 .. I2C_MAX_MESSAGE. Returns
+	// the new size, 0 (and no change) if out of range or during a
+	// transmission.
+	size_t setBufferSize(size_t size);
+	size_t getBufferSize(void) const { return m_bufferSize; }
+	void begin(void);
+	void begin(uint8_t address);
+	void begin(int address);
+	void setClock(uint32_t frequency);
+	void beginTransmission(uint8_t address);
+	void beginTransmission(int address);
+	uint8_t endTransmission(void);
+	uint8_t endTransmission(uint8_t sendStop);
+	uint8_t requestFrom(uint8_t address, uint8_t quantity);
+	uint8_t requestFrom(uint8_t address, uint8_t quantity, uint8_t sendStop);
+	// Writes 'isize' bytes of 'iaddress' (register number, MSB first),
+	// then reads; one transaction.
+	uint8_t requestFrom(uint8_t address, uint8_t quantity, uint32_t iaddress,
+		uint8_t isize, uint8_t sendStop);
+	uint8_t requestFrom(int address, int quantity);
+	uint8_t requestFrom(int address, int quantity, int sendStop);
+	// More than 255 bytes (up to the buffer size).
+	size_t requestFrom(uint16_t address, size_t quantity, bool sendStop);
+	size_t write(uint8_t data);
+	size_t write(const uint8_t *data, size_t quantity);
+	size_t write(const char *str);
+	size_t write(unsigned long n) { return write((uint8_t)n); }
+	size_t write(long n) { return write((uint8_t)n); }
+	size_t write(unsigned int n) { return write((uint8_t)n); }
+	size_t write(int n) { return write((uint8_t)n); }
+	int available(void);
+	int read(void);
+	int peek(void);
+	size_t readBytes(uint8_t *buffer, size_t length);
+	void flush(void);
+	void onReceive(void (*function)(int));
+	void onRequest(void (*function)(void));
+	// Print's.
+	int getWriteError(void) const { return m_writeError; }
+	void clearWriteError(void) { m_writeError = 0; }
+	I2cBus& Bus(void) const { return m_bus; }
+private:
+	TwoWire(TwoWire const& copy);  // Not allowed
+	TwoWire& operator=(TwoWire const& copy);  // Not allowed
+	// A message in m_txData.
+	struct Segment
+	{
+		uint16_t address;
+		size_t offset;
+		size_t length;
+	};
+	uint8_t _send(uint16_t readAddress, size_t readLength);
+	I2cBus& m_bus;
+	size_t m_bufferSize;
+	// beginTransmission() .. endTransmission()
+	bool m_transmitting;
+	bool m_overflow;
+	int m_writeError;
+	Segment m_tx;
+	// Held by endTransmission(false), then m_tx's, back to back.
+	vector<uint8_t> m_txData;
+	Segment m_held[WIRE_MAX_SEGMENTS];
+	int m_heldCount;
+	vector<uint8_t> m_rxBuffer;
+	size_t m_rxIndex;
+	size_t m_rxLength;
+};
+
+extern TwoWire Wire;
+
+#endif  // WIRE_H_
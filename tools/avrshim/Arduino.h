@@ -0,0 +1,24 @@
+// Arduino.h
+// What raw/twi.c takes from the Arduino core, on a Linux host (see
+// avr/io.h). The pull-ups are the simulated bus's business, so
+// digitalWrite() does nothing.
+
+#ifndef AVRSHIM_ARDUINO_H_
+#define AVRSHIM_ARDUINO_H_
+
+#include <stdint.h>
+
+#ifndef F_CPU
+#define F_CPU 16000000L
+#endif
+
+#define HIGH 0x1
+#define LOW 0x0
+
+inline void digitalWrite(uint8_t pin, uint8_t value)
+{
+	(void)pin;
+	(void)value;
+}
+
+#endif  // AVRSHIM_ARDUINO_H_
@@ -0,0 +1,12 @@
+// avr/interrupt.h
+// See avr/io.h: an ISR is an ordinary function on the host; the TWI
+// model calls it, never re-entered.
+
+#ifndef AVRSHIM_INTERRUPT_H_
+#define AVRSHIM_INTERRUPT_H_
+
+#define ISR(vector) void vector(void)
+#define sei()
+#define cli()
+
+#endif  // AVRSHIM_INTERRUPT_H_
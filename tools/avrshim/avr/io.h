@@ -0,0 +1,57 @@
+// avr/io.h
+// Just enough of avr-libc's for raw/twi.c on a Linux host (see
+// tools/twisim.cpp): the TWI unit's registers and bits, as an
+// ATmega328P has them.
+//
+// TWBR, TWSR, TWAR and TWDR are plain bytes. TWCR is an object: writing
+// it is what starts the unit's next bus operation, so its assignment
+// goes to TwiControlWrite() and reads to TwiControlRead() (twisim.cpp),
+// which model the hardware.
+//
+// C++ only: twi.c is compiled as part of twisim.cpp.
+
+#ifndef AVRSHIM_IO_H_
+#define AVRSHIM_IO_H_
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+#define _SFR_BYTE(sfr) (sfr)
+
+// TWCR
+#define TWINT 7
+#define TWEA 6
+#define TWSTA 5
+#define TWSTO 4
+#define TWWC 3
+#define TWEN 2
+#define TWIE 0
+
+// TWSR
+#define TWPS1 1
+#define TWPS0 0
+
+void TwiControlWrite(uint8_t value);
+uint8_t TwiControlRead(void);
+
+class TwiControlRegister
+{
+public:
+	TwiControlRegister& operator=(uint8_t value)
+	{
+		TwiControlWrite(value);
+		return *this;
+	}
+	operator uint8_t() const { return TwiControlRead(); }
+};
+
+extern TwiControlRegister TWCR;
+extern volatile uint8_t TWBR;
+extern volatile uint8_t TWSR;
+extern volatile uint8_t TWAR;
+extern volatile uint8_t TWDR;
+
+// ISR(TWI_vect) is an ordinary function, called by the unit's model.
+#define TWI_vect TwiInterrupt
+
+#endif  // AVRSHIM_IO_H_
@@ -0,0 +1,10 @@
+// pins_arduino.h
+// An Uno's TWI pins (A4, A5), see Arduino.h.
+
+#ifndef AVRSHIM_PINS_ARDUINO_H_
+#define AVRSHIM_PINS_ARDUINO_H_
+
+#define SDA 18
+#define SCL 19
+
+#endif  // AVRSHIM_PINS_ARDUINO_H_
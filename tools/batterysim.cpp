@@ -0,0 +1,202 @@
+// batterysim.cpp
+// Stands in for the fuel gauge, the charger and the kernel so
+// BatteryChecker can be tried without the hardware (see
+// src/BatterySim.h). Start pwm (or anything with a BatteryChecker)
+// with the same directory:
+//     batterysim -d /tmp/bsim init
+//     BATTERY_SIM_DIR=/tmp/bsim ./pwm &
+//     batterysim -d /tmp/bsim capacity 12
+//     batterysim -d /tmp/bsim drain 30 0 2000
+//
+// Usage: batterysim [-d dir] [-q] <command>
+//   init                      capacity 80, not charging
+//   capacity <0-100>
+//   charger none|pre|fast|done
+//   drain <from> <to> <ms>    capacity from..to, one step every <ms>
+//   alert                     the ALERT line falling
+//   -d    default $BATTERY_SIM_DIR, else /tmp/batterysim
+//   -q    change the files only, no uevent: what polling alone sees
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../src/BatterySim.h"
+
+using namespace std;
+
+static string dir;
+static bool quiet = false;
+
+static bool writeFile(const char *name, const string& value)
+{
+	string path = dir + "/" + name;
+	// In place, the way sysfs changes: BatteryChecker keeps the file
+	// open (a rename() would leave it reading the old one). Write, then
+	// cut off what is left of a longer old value; a reader in between
+	// still finds the new number first.
+	string text = value + "\n";
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0 || pwrite(fd, text.data(), text.size(), 0) != (ssize_t)text.size()
+		|| ftruncate(fd, text.size()) != 0)
+	{
+		fprintf(stderr, "batterysim: %s: %s\n", path.c_str(), strerror(errno));
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		return false;
+	}
+	close(fd);
+	return true;
+}
+
+// One datagram to BatteryChecker's socket; fine if nobody is there.
+static void sendEvent(const string& payload)
+{
+	if (quiet)
+	{
+		return;
+	}
+	int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	string path = dir + "/" BATTERY_SIM_SOCKET;
+	strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+	if (sendto(fd, payload.data(), payload.size(), 0, (sockaddr *)&addr,
+		sizeof(addr)) < 0)
+	{
+		fprintf(stderr, "batterysim: no BatteryChecker listening on %s: %s\n",
+			path.c_str(), strerror(errno));
+	}
+	close(fd);
+}
+
+// What the fuel gauge driver's "change" uevent looks like on the
+// netlink socket: NUL separated.
+static void sendUevent(int capacity)
+{
+	static int seqnum = 0;
+	const char *devpath = "/devices/platform/battery/power_supply/battery";
+	string payload = string("change@") + devpath + '\0'
+		+ "ACTION=change" + '\0'
+		+ "DEVPATH=" + devpath + '\0'
+		+ "SUBSYSTEM=power_supply" + '\0'
+		+ "POWER_SUPPLY_NAME=battery" + '\0';
+	if (capacity >= 0)
+	{
+		payload += "POWER_SUPPLY_CAPACITY=" + to_string(capacity) + '\0';
+	}
+	payload += "SEQNUM=" + to_string(++seqnum) + '\0';
+	sendEvent(payload);
+}
+
+static bool setCapacity(int capacity)
+{
+	if (!writeFile(BATTERY_SIM_CAPACITY, to_string(capacity)))
+	{
+		return false;
+	}
+	sendUevent(capacity);
+	return true;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: batterysim [-d dir] [-q] init | capacity <0-100> |\n"
+		"         charger none|pre|fast|done | drain <from> <to> <ms> | alert\n");
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *env = getenv(BATTERY_SIM_DIR_ENV);
+	dir = (env != nullptr && *env != '\0') ? env : "/tmp/batterysim";
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-'; i++)
+	{
+		if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+		{
+			dir = argv[++i];
+		}
+		else if (strcmp(argv[i], "-q") == 0)
+		{
+			quiet = true;
+		}
+		else
+		{
+			usage();
+		}
+	}
+	if (i >= argc)
+	{
+		usage();
+	}
+	string command = argv[i++];
+	mkdir(dir.c_str(), 0755);
+	if (command == "init")
+	{
+		return writeFile(BATTERY_SIM_CHARGER, "0x00") && setCapacity(80) ? 0 : 1;
+	}
+	if (command == "capacity" && i < argc)
+	{
+		return setCapacity(atoi(argv[i])) ? 0 : 1;
+	}
+	if (command == "charger" && i < argc)
+	{
+		// Status register bits 5:4.
+		const char *states[] = { "none", "pre", "fast", "done" };
+		for (int state = 0; state < 4; state++)
+		{
+			if (strcmp(argv[i], states[state]) == 0)
+			{
+				char reg[8];
+				snprintf(reg, sizeof(reg), "0x%02x", state << 4);
+				if (!writeFile(BATTERY_SIM_CHARGER, reg))
+				{
+					return 1;
+				}
+				sendUevent(-1);
+				return 0;
+			}
+		}
+		usage();
+	}
+	if (command == "drain" && i + 2 < argc)
+	{
+		int from = atoi(argv[i]);
+		int to = atoi(argv[i + 1]);
+		int ms = atoi(argv[i + 2]);
+		int step = from > to ? -1 : 1;
+		for (int capacity = from; ; capacity += step)
+		{
+			if (!setCapacity(capacity))
+			{
+				return 1;
+			}
+			printf("capacity %d\n", capacity);
+			fflush(stdout);
+			if (capacity == to)
+			{
+				return 0;
+			}
+			usleep(ms * 1000);
+		}
+	}
+	if (command == "alert")
+	{
+		sendEvent(BATTERY_SIM_ALERT "battery");
+		return 0;
+	}
+	usage();
+}
@@ -0,0 +1,463 @@
+// logbench.cpp
+// What a log call costs the caller, and how that changes when several
+// threads or processes log at once.
+//
+// Every scenario runs in its own fork()ed child (so each one starts
+// with fresh Log / LogRing state and elects its own ring writer) and
+// prints one JSON object per line (JSON Lines) to stdout:
+//   {"scenario":"info-t4-shared", "api":"info", "threads":4,
+//    "processes":1, "owner":"shared", "rotate":true, "messages":8000,
+//    "seconds":..., "msgsPerSec":..., "p50Ns":..., "p99Ns":...,
+//    "p999Ns":..., "maxNs":..., "allocsPerCall":...,
+//    "syscallsPerCall":..., "processSyscallsPerCall":...,
+//    "ctxSwitchesPerCall":..., "deferred":...}
+//
+//   api          info     Log::LogInfo()
+//                logf     LOGF_INFO()
+//                err      Log::LogErr() from one call site, so this is
+//                         mostly the rate limiter's suppressed path
+//                disabled LOG_DEBUG() with the owner at Info
+//   owner        shared   every thread logs through one Log
+//                private  one Log (owner) per thread
+//   rotate       true     the log file is a real file, so LogFile trims
+//                         it every ~KEEP_LAST_LOG_SIZE bytes
+//                false    /dev/null, never trimmed
+//   latencies    wall time of each call on the calling thread
+//                (CLOCK_MONOTONIC, includes ~20-50 ns of timer overhead)
+//   allocsPerCall           operator new calls on the calling thread
+//   syscallsPerCall         read + write class syscalls on the calling
+//                           thread (/proc/thread-self/io); futex and
+//                           such are not counted
+//   processSyscallsPerCall  the same for whole processes, i.e. also
+//                           the ring writer thread
+//   ctxSwitchesPerCall      voluntary context switches on the calling
+//                           thread (how often a call blocked)
+//   deferred     lines that went to PendingMessages (ring full AND
+//                log file locked)
+// Throughput is what the callers saw; the ring writer may still be
+// draining when they finish.
+//
+// Built by makeit.sh with the same flags as pwm, against its own ring
+// (LOG_RING_SHM_NAME "/logbench_ring") and log file so it can run next
+// to pwm without mixing into its log.
+//
+// Usage: logbench [-n messages per worker] [-t max threads]
+//                 [-p max processes] [-f log file] [-s scenario]
+//   -s runs only the scenarios whose name starts with the argument.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/Log.h"
+#include "../src/PendingMessages.h"
+
+using namespace std;
+
+// Counts allocations made by the calling thread.
+static thread_local uint64_t threadAllocs = 0;
+
+void *operator new(size_t size)
+{
+	threadAllocs++;
+	void *p = malloc(size == 0 ? 1 : size);
+	if (p == nullptr)
+	{
+		throw bad_alloc();
+	}
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	free(p);
+}
+
+enum BenchApi
+{
+	BenchInfo = 0,
+	BenchLogF,
+	BenchErr,
+	BenchDisabled
+};
+
+static const char *const apiNames[] = { "info", "logf", "err", "disabled" };
+
+struct Scenario
+{
+	BenchApi api;
+	int threads;
+	int processes;
+	bool sharedOwner;
+	bool rotate;
+};
+
+// One per worker (thread or process), in MAP_SHARED memory.
+struct WorkerStats
+{
+	uint64_t allocs;
+	uint64_t syscalls;
+	uint64_t ctxSwitches;
+	uint64_t processSyscalls;  // Process-mode workers only
+	uint64_t startNs;
+	uint64_t endNs;
+};
+
+struct Shared
+{
+	pthread_barrier_t start;
+	pthread_barrier_t done;
+};
+
+static int messagesPerWorker = 2000;
+static const char *logFilePath = "/tmp/logbench.log";
+
+static uint64_t nowNs(void)
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// syscr + syscw from a /proc/.../io file.
+static uint64_t readSyscalls(const char *path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		return 0;
+	}
+	char buf[512];
+	ssize_t n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+	{
+		return 0;
+	}
+	buf[n] = 0;
+	uint64_t total = 0;
+	const char *names[] = { "syscr: ", "syscw: " };
+	for (const char *name : names)
+	{
+		const char *p = strstr(buf, name);
+		if (p != nullptr)
+		{
+			total += strtoull(p + strlen(name), nullptr, 10);
+		}
+	}
+	return total;
+}
+
+// What reading /proc/.../io itself adds between two snapshots.
+static uint64_t readSyscallsOverhead(const char *path)
+{
+	uint64_t before = readSyscalls(path);
+	return readSyscalls(path) - before;
+}
+
+static uint64_t threadCtxSwitches(void)
+{
+	rusage usage;
+	getrusage(RUSAGE_THREAD, &usage);
+	return usage.ru_nvcsw;
+}
+
+static void *sharedAlloc(size_t size)
+{
+	void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+	{
+		perror("mmap");
+		exit(1);
+	}
+	memset(p, 0, size);
+	return p;
+}
+
+// The measured loop for one worker. 'latencies' has messagesPerWorker
+// entries.
+static void runWorker(const Scenario& s, Log& log, Shared *shared,
+	uint32_t *latencies, WorkerStats& stats, int worker)
+{
+	static const char *threadIo = "/proc/thread-self/io";
+	uint64_t ioOverhead = readSyscallsOverhead(threadIo);
+	char msg[64];
+	pthread_barrier_wait(&shared->start);
+
+	uint64_t allocs = threadAllocs;
+	uint64_t ctx = threadCtxSwitches();
+	uint64_t io = readSyscalls(threadIo);
+	stats.startNs = nowNs();
+	for (int i = 0; i < messagesPerWorker; i++)
+	{
+		uint64_t t0 = nowNs();
+		switch (s.api)
+		{
+		case BenchInfo:
+			snprintf(msg, sizeof(msg), "servo %d pulse %d us", worker, 1000 + i % 1000);
+			t0 = nowNs();  // Not timing our own snprintf()
+			log.LogInfo(msg);
+			break;
+		case BenchLogF:
+			LOGF_INFO(log, "servo %d pulse %d us", worker, 1000 + i % 1000);
+			break;
+		case BenchErr:
+			log.LogErr(AT, "servo not responding");
+			break;
+		case BenchDisabled:
+			LOG_DEBUG(log, "servo " << worker << " pulse " << 1000 + i % 1000 << " us");
+			break;
+		}
+		uint64_t elapsed = nowNs() - t0;
+		latencies[i] = (elapsed > UINT32_MAX) ? UINT32_MAX : (uint32_t)elapsed;
+	}
+	stats.endNs = nowNs();
+	uint64_t ioAfter = readSyscalls(threadIo);
+	stats.syscalls = (ioAfter - io > ioOverhead) ? (ioAfter - io - ioOverhead) : 0;
+	stats.ctxSwitches = threadCtxSwitches() - ctx;
+	stats.allocs = threadAllocs - allocs;
+
+	pthread_barrier_wait(&shared->done);
+}
+
+static string scenarioName(const Scenario& s)
+{
+	string name = apiNames[s.api];
+	if (s.processes > 1)
+	{
+		name += "-p" + to_string(s.processes);
+	}
+	else
+	{
+		name += "-t" + to_string(s.threads);
+		if (s.threads > 1)
+		{
+			name += s.sharedOwner ? "-shared" : "-private";
+		}
+	}
+	if (!s.rotate)
+	{
+		name += "-norotate";
+	}
+	return name;
+}
+
+static uint32_t percentile(const vector<uint32_t>& sorted, double p)
+{
+	if (sorted.empty())
+	{
+		return 0;
+	}
+	size_t i = (size_t)(p * (sorted.size() - 1) + 0.5);
+	return sorted[min(i, sorted.size() - 1)];
+}
+
+// Runs in the scenario's own process.
+static void runScenario(const Scenario& s)
+{
+	LogFile::SetPath(s.rotate ? logFilePath : "/dev/null");
+	LogSinks::GetInstance().Configure("console=off");
+
+	int workers = (s.processes > 1) ? s.processes : s.threads;
+	Shared *shared = (Shared *)sharedAlloc(sizeof(Shared));
+	pthread_barrierattr_t attr;
+	pthread_barrierattr_init(&attr);
+	pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	// Workers plus this (timing) thread:
+	pthread_barrier_init(&shared->start, &attr, workers + 1);
+	pthread_barrier_init(&shared->done, &attr, workers + 1);
+	uint32_t *latencies = (uint32_t *)sharedAlloc(
+		sizeof(uint32_t) * workers * messagesPerWorker);
+	WorkerStats *stats = (WorkerStats *)sharedAlloc(sizeof(WorkerStats) * workers);
+
+	Log mainLog("bench");
+	mainLog.SetLevel(LogLevelInfo);
+	// Attach to the ring and become its writer before timing anything.
+	mainLog.LogInfo(scenarioName(s).c_str());
+	uint64_t deferred = PendingMessages::GetInstance().GetDeferredCount();
+
+	static const char *processIo = "/proc/self/io";
+	uint64_t processIoOverhead = readSyscallsOverhead(processIo);
+	uint64_t processIoBefore = readSyscalls(processIo);
+
+	vector<thread> threads;
+	vector<pid_t> children;
+	for (int w = 0; w < workers; w++)
+	{
+		uint32_t *mine = latencies + (size_t)w * messagesPerWorker;
+		if (s.processes > 1)
+		{
+			pid_t pid = fork();
+			if (pid == 0)
+			{
+				uint64_t before = readSyscalls(processIo);
+				runWorker(s, mainLog, shared, mine, stats[w], w);
+				stats[w].processSyscalls = readSyscalls(processIo) - before;
+				exit(0);
+			}
+			children.push_back(pid);
+		}
+		else
+		{
+			threads.emplace_back([&s, &mainLog, shared, mine, stats, w]()
+			{
+				if (s.sharedOwner)
+				{
+					runWorker(s, mainLog, shared, mine, stats[w], w);
+					return;
+				}
+				string owner = "bench" + to_string(w);
+				Log log(owner.c_str());
+				log.SetLevel(LogLevelInfo);
+				runWorker(s, log, shared, mine, stats[w], w);
+			});
+		}
+	}
+	pthread_barrier_wait(&shared->start);
+	pthread_barrier_wait(&shared->done);
+	for (auto &t : threads)
+	{
+		t.join();
+	}
+	for (pid_t pid : children)
+	{
+		waitpid(pid, nullptr, 0);
+	}
+	uint64_t processSyscalls = readSyscalls(processIo) - processIoBefore;
+	processSyscalls -= min(processSyscalls, processIoOverhead);
+	deferred = PendingMessages::GetInstance().GetDeferredCount() - deferred;
+
+	uint64_t messages = (uint64_t)workers * messagesPerWorker;
+	vector<uint32_t> sorted(latencies, latencies + messages);
+	sort(sorted.begin(), sorted.end());
+	WorkerStats total = { 0, 0, 0, 0, UINT64_MAX, 0 };
+	for (int w = 0; w < workers; w++)
+	{
+		total.startNs = min(total.startNs, stats[w].startNs);
+		total.endNs = max(total.endNs, stats[w].endNs);
+		total.allocs += stats[w].allocs;
+		total.syscalls += stats[w].syscalls;
+		total.ctxSwitches += stats[w].ctxSwitches;
+		processSyscalls += stats[w].processSyscalls;
+	}
+	// First call in to last call out, over all workers.
+	double seconds = max<uint64_t>(total.endNs - total.startNs, 1) / 1e9;
+
+	printf("{\"scenario\":\"%s\",\"api\":\"%s\",\"threads\":%d,\"processes\":%d,"
+		"\"owner\":\"%s\",\"rotate\":%s,\"messages\":%llu,\"seconds\":%.6f,"
+		"\"msgsPerSec\":%.0f,\"p50Ns\":%u,\"p99Ns\":%u,\"p999Ns\":%u,\"maxNs\":%u,"
+		"\"allocsPerCall\":%.3f,\"syscallsPerCall\":%.3f,"
+		"\"processSyscallsPerCall\":%.3f,\"ctxSwitchesPerCall\":%.4f,"
+		"\"deferred\":%llu}\n",
+		scenarioName(s).c_str(), apiNames[s.api], s.threads, s.processes,
+		(s.sharedOwner || workers == 1) ? "shared" : "private",
+		s.rotate ? "true" : "false", (unsigned long long)messages, seconds,
+		messages / seconds, percentile(sorted, 0.50), percentile(sorted, 0.99),
+		percentile(sorted, 0.999), sorted.empty() ? 0 : sorted.back(),
+		(double)total.allocs / messages, (double)total.syscalls / messages,
+		(double)processSyscalls / messages,
+		(double)total.ctxSwitches / messages, (unsigned long long)deferred);
+	fflush(stdout);
+}
+
+static vector<Scenario> defaultScenarios(int maxThreads, int maxProcesses)
+{
+	vector<Scenario> list;
+	for (int api = BenchInfo; api <= BenchDisabled; api++)
+	{
+		list.push_back({ (BenchApi)api, 1, 1, true, true });
+	}
+	list.push_back({ BenchInfo, 1, 1, true, false });
+	for (int t = 2; t <= maxThreads; t *= 2)
+	{
+		list.push_back({ BenchInfo, t, 1, true, true });
+		list.push_back({ BenchInfo, t, 1, false, true });
+		list.push_back({ BenchLogF, t, 1, true, true });
+	}
+	list.push_back({ BenchInfo, maxThreads, 1, true, false });
+	for (int p = 2; p <= maxProcesses; p *= 2)
+	{
+		list.push_back({ BenchInfo, 1, p, true, true });
+	}
+	return list;
+}
+
+int main(int argc, char *argv[])
+{
+	int maxThreads = min(8, max(2, (int)thread::hardware_concurrency()));
+	int maxProcesses = 4;
+	const char *only = nullptr;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:t:p:f:s:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			messagesPerWorker = max(1, atoi(optarg));
+			break;
+		case 't':
+			maxThreads = max(1, atoi(optarg));
+			break;
+		case 'p':
+			maxProcesses = max(1, atoi(optarg));
+			break;
+		case 'f':
+			logFilePath = optarg;
+			break;
+		case 's':
+			only = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n messages] [-t max threads] "
+				"[-p max processes] [-f log file] [-s scenario]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	for (const Scenario& s : defaultScenarios(maxThreads, maxProcesses))
+	{
+		if (only != nullptr && scenarioName(s).compare(0, strlen(only), only) != 0)
+		{
+			continue;
+		}
+		pid_t pid = fork();
+		if (pid < 0)
+		{
+			perror("fork");
+			return 1;
+		}
+		if (pid == 0)
+		{
+			runScenario(s);
+			exit(0);  // Not _exit(): LogRing drains at exit.
+		}
+		int status;
+		waitpid(pid, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		{
+			fprintf(stderr, "%s failed\n", scenarioName(s).c_str());
+			return 1;
+		}
+	}
+	return 0;
+}
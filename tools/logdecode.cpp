@@ -0,0 +1,418 @@
+// logdecode.cpp
+// Host-side decoder for binary log files (see src/LogBinary.h).
+// Prints them in the same text format Log writes to LOGFILE_NAME:
+//   <E> OWNER: SEQ TID: xxx PID: xxx PPID: xxx mm/dd/yy hh:mm:ss.dddd: AT: msg
+//
+// Usage: logdecode [-s] [i2c.log.bin.1] [i2c.log.bin] ...   (stdin if none)
+//   -s  merge every file and print in sequence number order (the
+//       order the lines were logged in, across all threads and
+//       processes) rather than file order.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <time.h>
+
+#include "../src/LogBinary.h"
+
+using namespace std;
+
+struct FormatDef
+{
+	int level;
+	string at;
+	string fmt;
+};
+
+// Keyed on (pid << 16 | id): ids are only unique within a process.
+static map<uint64_t, FormatDef> formats;
+static map<uint64_t, string> owners;
+static map<uint32_t, uint32_t> parents;
+// -s: (seq, line) of every message, printed at the end.
+static bool sortBySequence = false;
+static vector<pair<uint64_t, string>> sorted;
+
+static uint64_t key(uint32_t pid, uint16_t id)
+{
+	return ((uint64_t)pid << 16) | id;
+}
+
+// A fork()ed child logs with its parent's ids; walk up the PPIDs.
+template<typename T>
+static const T *lookup(const map<uint64_t, T>& m, uint32_t pid, uint16_t id)
+{
+	for (int depth = 0; depth < 16; depth++)
+	{
+		auto it = m.find(key(pid, id));
+		if (it != m.end())
+		{
+			return &it->second;
+		}
+		auto p = parents.find(pid);
+		if (p == parents.end())
+		{
+			break;
+		}
+		pid = p->second;
+	}
+	return nullptr;
+}
+
+struct Arg
+{
+	char tag;
+	int64_t i;
+	uint64_t u;
+	double d;
+	string s;
+};
+
+static bool readArgs(const char *p, const char *end, vector<Arg>& args)
+{
+	while (p < end)
+	{
+		Arg a;
+		a.tag = *p++;
+		a.i = 0;
+		a.u = 0;
+		a.d = 0;
+		switch (a.tag)
+		{
+		case 'i':
+		{
+			int32_t v;
+			if (end - p < (long)sizeof(v)) return false;
+			memcpy(&v, p, sizeof(v));
+			p += sizeof(v);
+			a.i = v;
+			a.u = (uint64_t)(int64_t)v;
+			a.d = v;
+			break;
+		}
+		case 'I':
+			if (end - p < (long)sizeof(a.i)) return false;
+			memcpy(&a.i, p, sizeof(a.i));
+			p += sizeof(a.i);
+			a.u = (uint64_t)a.i;
+			a.d = (double)a.i;
+			break;
+		case 'u':
+		{
+			uint32_t v;
+			if (end - p < (long)sizeof(v)) return false;
+			memcpy(&v, p, sizeof(v));
+			p += sizeof(v);
+			a.u = v;
+			a.i = v;
+			a.d = v;
+			break;
+		}
+		case 'U':
+		case 'p':
+			if (end - p < (long)sizeof(a.u)) return false;
+			memcpy(&a.u, p, sizeof(a.u));
+			p += sizeof(a.u);
+			a.i = (int64_t)a.u;
+			a.d = (double)a.u;
+			break;
+		case 'd':
+			if (end - p < (long)sizeof(a.d)) return false;
+			memcpy(&a.d, p, sizeof(a.d));
+			p += sizeof(a.d);
+			a.i = (int64_t)a.d;
+			a.u = (uint64_t)a.i;
+			break;
+		case 's':
+		{
+			uint16_t len;
+			if (end - p < (long)sizeof(len)) return false;
+			memcpy(&len, p, sizeof(len));
+			p += sizeof(len);
+			if (end - p < len) return false;
+			a.s.assign(p, len);
+			p += len;
+			break;
+		}
+		default:
+			return false;
+		}
+		args.push_back(a);
+	}
+	return true;
+}
+
+// printf() again, one conversion at a time, using the type each
+// argument was stored with rather than the one the format names.
+static string render(const string& fmt, const vector<Arg>& args)
+{
+	string out;
+	size_t next = 0;
+	char buf[512];
+	for (size_t i = 0; i < fmt.length(); i++)
+	{
+		if (fmt[i] != '%')
+		{
+			out += fmt[i];
+			continue;
+		}
+		if (i + 1 < fmt.length() && fmt[i + 1] == '%')
+		{
+			out += '%';
+			i++;
+			continue;
+		}
+		string spec("%");
+		size_t j = i + 1;
+		while (j < fmt.length() && strchr("-+ #0", fmt[j])) spec += fmt[j++];
+		while (j < fmt.length() && isdigit((unsigned char)fmt[j])) spec += fmt[j++];
+		if (j < fmt.length() && fmt[j] == '.')
+		{
+			spec += fmt[j++];
+			while (j < fmt.length() && isdigit((unsigned char)fmt[j])) spec += fmt[j++];
+		}
+		while (j < fmt.length() && strchr("hlLqjzt", fmt[j])) j++;
+		if (j >= fmt.length())
+		{
+			break;
+		}
+		char conv = fmt[j];
+		i = j;
+		if (next >= args.size())
+		{
+			out += "<?>";
+			continue;
+		}
+		const Arg& a = args[next++];
+		if (strchr("di", conv))
+		{
+			snprintf(buf, sizeof(buf), (spec + "lld").c_str(), (long long)a.i);
+		}
+		else if (strchr("ouxX", conv))
+		{
+			snprintf(buf, sizeof(buf), (spec + "ll" + conv).c_str(),
+				(unsigned long long)a.u);
+		}
+		else if (conv == 'c')
+		{
+			snprintf(buf, sizeof(buf), (spec + "c").c_str(), (int)a.i);
+		}
+		else if (strchr("eEfFgGaA", conv))
+		{
+			snprintf(buf, sizeof(buf), (spec + conv).c_str(), a.d);
+		}
+		else if (conv == 'p')
+		{
+			snprintf(buf, sizeof(buf), "0x%llx", (unsigned long long)a.u);
+		}
+		else if (conv == 's')
+		{
+			if (a.tag == 's')
+			{
+				snprintf(buf, sizeof(buf), (spec + "s").c_str(), a.s.c_str());
+			}
+			else
+			{
+				snprintf(buf, sizeof(buf), "%lld", (long long)a.i);
+			}
+		}
+		else
+		{
+			snprintf(buf, sizeof(buf), "<%%%c?>", conv);
+		}
+		out += buf;
+	}
+	return out;
+}
+
+// Same layout as Log::FillTime().
+static string timeText(uint64_t ns)
+{
+	time_t secs = (time_t)(ns / 1000000000ULL);
+	long ms = (long)((ns % 1000000000ULL) / 1000000);
+	struct tm tim;
+	gmtime_r(&secs, &tim);
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%02d/%02d/%02d %02d:%02d:%02d.%04ld: ",
+		(tim.tm_mon + 1), tim.tm_mday, (tim.tm_year % 100),
+		tim.tm_hour, tim.tm_min, tim.tm_sec, ms);
+	return buf;
+}
+
+static void decodeMessage(const LogBinaryHeader *h, const char *p, const char *end)
+{
+	static const char *levelTags[] = { "<T> ", "<D> ", "<I> ", "<W> ", "<E> " };
+	uint16_t fmtId;
+	uint16_t ownerId;
+	uint32_t tid;
+	uint64_t seq;
+	uint64_t ns;
+	if (end - p < (long)(sizeof(fmtId) + sizeof(ownerId) + sizeof(tid)
+		+ sizeof(seq) + sizeof(ns)))
+	{
+		return;
+	}
+	memcpy(&fmtId, p, sizeof(fmtId));
+	p += sizeof(fmtId);
+	memcpy(&ownerId, p, sizeof(ownerId));
+	p += sizeof(ownerId);
+	memcpy(&tid, p, sizeof(tid));
+	p += sizeof(tid);
+	memcpy(&seq, p, sizeof(seq));
+	p += sizeof(seq);
+	memcpy(&ns, p, sizeof(ns));
+	p += sizeof(ns);
+
+	vector<Arg> args;
+	bool argsOk = readArgs(p, end, args);
+
+	const FormatDef *f = lookup(formats, h->pid, fmtId);
+	const string *owner = lookup(owners, h->pid, ownerId);
+	auto parent = parents.find(h->pid);
+
+	int level = (h->level <= 4) ? h->level : 4;
+	string line(levelTags[level]);
+	line += (owner != nullptr) ? *owner : ("owner#" + to_string(ownerId));
+	line += ": ";
+	char seqBuf[32];
+	snprintf(seqBuf, sizeof(seqBuf), "%03llu", (unsigned long long)seq);
+	line += seqBuf;
+	line += " TID: " + to_string(tid);
+	line += " PID: " + to_string(h->pid) + " PPID: ";
+	line += (parent != parents.end()) ? to_string(parent->second) : "?";
+	line += " ";
+	line += timeText(ns);
+	if (f == nullptr)
+	{
+		line += "<unknown format #" + to_string(fmtId) + ">";
+	}
+	else
+	{
+		if (level != 2 /* Info has no AT */)
+		{
+			size_t slash = f->at.find_last_of('/');
+			line += (slash == string::npos) ? f->at : f->at.substr(slash + 1);
+		}
+		line += render(f->fmt, args);
+	}
+	if (!argsOk)
+	{
+		line += " <truncated>";
+	}
+	line += "\r\n";
+	if (sortBySequence)
+	{
+		sorted.push_back(make_pair(seq, line));
+		return;
+	}
+	fwrite(line.data(), 1, line.length(), stdout);
+}
+
+static void decode(istream& in, const char *name)
+{
+	vector<char> data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+	const size_t magicLen = strlen(LOG_BINARY_MAGIC);
+	if (data.size() < magicLen || memcmp(data.data(), LOG_BINARY_MAGIC, magicLen) != 0)
+	{
+		cerr << name << ": not a binary log file" << endl;
+		return;
+	}
+	size_t pos = magicLen;
+	while (pos + sizeof(LogBinaryHeader) <= data.size())
+	{
+		LogBinaryHeader h;
+		memcpy(&h, data.data() + pos, sizeof(h));
+		if (h.length < sizeof(h) || pos + h.length > data.size())
+		{
+			cerr << name << ": corrupt record at offset " << pos << endl;
+			return;
+		}
+		const char *p = data.data() + pos + sizeof(h);
+		const char *end = data.data() + pos + h.length;
+		switch (h.type)
+		{
+		case LogBinaryProcess:
+			if (end - p >= 4)
+			{
+				uint32_t ppid;
+				memcpy(&ppid, p, sizeof(ppid));
+				parents[h.pid] = ppid;
+			}
+			break;
+		case LogBinaryOwner:
+			if (end - p >= 2)
+			{
+				uint16_t id;
+				memcpy(&id, p, sizeof(id));
+				owners[key(h.pid, id)] = string(p + 2, end);
+			}
+			break;
+		case LogBinaryFormat:
+			if (end - p >= 4)
+			{
+				uint16_t id;
+				uint16_t atLength;
+				memcpy(&id, p, sizeof(id));
+				memcpy(&atLength, p + 2, sizeof(atLength));
+				if (end - (p + 4) >= atLength)
+				{
+					FormatDef f;
+					f.level = h.level;
+					f.at.assign(p + 4, atLength);
+					f.fmt.assign(p + 4 + atLength, end);
+					formats[key(h.pid, id)] = f;
+				}
+			}
+			break;
+		case LogBinaryMessage:
+			decodeMessage(&h, p, end);
+			break;
+		default:
+			break;
+		}
+		pos += h.length;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int first = 1;
+	if (argc > 1 && strcmp(argv[1], "-s") == 0)
+	{
+		sortBySequence = true;
+		first = 2;
+	}
+	if (first >= argc)
+	{
+		decode(cin, "stdin");
+	}
+	for (int i = first; i < argc; i++)
+	{
+		ifstream in(argv[i], ios::binary);
+		if (!in)
+		{
+			cerr << argv[i] << ": can't open" << endl;
+			continue;
+		}
+		decode(in, argv[i]);
+	}
+	if (sortBySequence)
+	{
+		stable_sort(sorted.begin(), sorted.end(),
+			[](const pair<uint64_t, string>& a, const pair<uint64_t, string>& b)
+			{
+				return a.first < b.first;
+			});
+		for (auto &entry : sorted)
+		{
+			fwrite(entry.second.data(), 1, entry.second.length(), stdout);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,291 @@
+// logquery.cpp
+// Lines from the log file and its compressed archive (src/LogArchive.h)
+// by time range, owner and level, oldest first:
+//     logquery -b 10:15 -e 10:23 -o I2c -l E
+// Uses the archive's sidecar index (src/LogIndex.h) to inflate only
+// the gzip members whose time range and owner bitmap can match; a
+// generation without an index is inflated and filtered in full.
+//
+// Usage: logquery [-b from] [-e to] [-o owner]... [-l levels] [-v] [log file]
+//        logquery -t
+//   -b, -e  "hh:mm[:ss]" (today) or "mm/dd/yy hh:mm[:ss]", UTC like
+//           the log itself. Without seconds, -e takes the whole minute.
+//   -o      owner name as logged ("I2c", "PwmServoDriver", ...);
+//           repeat for several.
+//   -l      level letters to keep, e.g. "EW" (default all).
+//   -v      say on stderr how many members were read / skipped.
+//   -t      check the line parser (LogIndex::SelfCheck()) and exit,
+//           0 if it is OK; makeit.sh runs it.
+//   log file  default LOGFILE_NAME.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "../src/LogIndex.h"
+
+using namespace std;
+
+#ifndef LOGFILE_NAME
+#define LOGFILE_NAME "/home/pi/i2c/i2c.log"
+#endif
+#define LOG_QUERY_MAX_GENERATIONS 64
+
+static int64_t timeFrom = INT64_MIN;
+static int64_t timeTo = INT64_MAX;
+static vector<string> owners;
+static uint64_t ownerBits = 0;  // 0: any owner
+static const char *levels = nullptr;
+static bool verbose = false;
+static bool lastMatched = false;
+static int membersRead = 0;
+static int membersSkipped = 0;
+
+// "hh:mm[:ss]" or "mm/dd/yy hh:mm[:ss]"; 'end' rounds up to the end of
+// the minute when there are no seconds.
+static bool parseArgTime(const char *s, bool end, int64_t& t)
+{
+	char stamp[32];
+	if (strchr(s, '/') == nullptr)
+	{
+		time_t now = time(nullptr);
+		struct tm tm;
+		gmtime_r(&now, &tm);
+		snprintf(stamp, sizeof(stamp), "%02d/%02d/%02d %s",
+			tm.tm_mon + 1, tm.tm_mday, tm.tm_year % 100, s);
+	}
+	else
+	{
+		snprintf(stamp, sizeof(stamp), "%s", s);
+	}
+	bool seconds = strlen(stamp) >= 17;
+	if (!seconds)
+	{
+		strncat(stamp, ":00", sizeof(stamp) - strlen(stamp) - 1);
+	}
+	if (!LogIndex::ParseTime(stamp, t))
+	{
+		return false;
+	}
+	if (end && !seconds)
+	{
+		t += 59;
+	}
+	return true;
+}
+
+static bool wantOwner(const char *owner, size_t len)
+{
+	if (owners.empty())
+	{
+		return true;
+	}
+	for (const string& o : owners)
+	{
+		if (o.length() == len && memcmp(o.data(), owner, len) == 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// Prints the lines of 'text' that match. A line that isn't a Log line
+// goes with the one before it; a deferred one (" * <E> ...") is a Log
+// line.
+static void filter(const char *text, size_t len)
+{
+	size_t start = 0;
+	while (start < len)
+	{
+		const char *nl = (const char *)memchr(text + start, '\n', len - start);
+		size_t end = (nl != nullptr) ? (nl - text + 1) : len;
+		LogIndexLine line;
+		if (LogIndex::ParseLine(text + start, end - start, line))
+		{
+			lastMatched = (line.time == 0
+					|| (line.time >= timeFrom && line.time <= timeTo))
+				&& (levels == nullptr || strchr(levels, line.level) != nullptr)
+				&& wantOwner(line.owner, line.ownerLen);
+		}
+		if (lastMatched)
+		{
+			fwrite(text + start, 1, end - start, stdout);
+		}
+		start = end;
+	}
+}
+
+static bool readFile(const string& path, vector<char>& data)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		return false;
+	}
+	struct stat st;
+	fstat(fd, &st);
+	data.resize(st.st_size);
+	ssize_t n = read(fd, data.data(), data.size());
+	close(fd);
+	data.resize(n > 0 ? n : 0);
+	return true;
+}
+
+// Inflates gzip member(s) from 'in'; with 'all', every member up to the
+// end, else just the first.
+static void inflateMembers(const char *in, size_t len, bool all, string& out)
+{
+	out.clear();
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	if (inflateInit2(&z, 15 + 16) != Z_OK)
+	{
+		return;
+	}
+	z.next_in = (Bytef *)in;
+	z.avail_in = len;
+	char buf[16384];
+	for (;;)
+	{
+		z.next_out = (Bytef *)buf;
+		z.avail_out = sizeof(buf);
+		int rv = inflate(&z, Z_NO_FLUSH);
+		out.append(buf, sizeof(buf) - z.avail_out);
+		if (rv == Z_STREAM_END)
+		{
+			if (!all || z.avail_in == 0)
+			{
+				break;
+			}
+			inflateReset(&z);
+		}
+		else if (rv != Z_OK)
+		{
+			break;  // Truncated or corrupt: keep what we have.
+		}
+	}
+	inflateEnd(&z);
+}
+
+static bool entryCanMatch(const LogIndexEntry& e)
+{
+	if (e.firstTime != 0 && (e.lastTime < timeFrom || e.firstTime > timeTo))
+	{
+		return false;
+	}
+	return ownerBits == 0 || (e.owners & ownerBits) != 0;
+}
+
+static void queryGeneration(const string& gzPath)
+{
+	vector<char> gz;
+	if (!readFile(gzPath, gz))
+	{
+		return;
+	}
+	vector<char> idx;
+	string text;
+	size_t indexed = 0;  // Bytes of 'gz' covered by the index
+	if (readFile(gzPath + LOG_INDEX_SUFFIX, idx))
+	{
+		size_t count = idx.size() / sizeof(LogIndexEntry);
+		for (size_t i = 0; i < count; i++)
+		{
+			LogIndexEntry e;
+			memcpy(&e, idx.data() + i * sizeof(e), sizeof(e));
+			if (e.version != LOG_INDEX_VERSION || e.offset + e.length > gz.size())
+			{
+				break;
+			}
+			indexed = e.offset + e.length;
+			lastMatched = false;
+			if (!entryCanMatch(e))
+			{
+				membersSkipped++;
+				continue;
+			}
+			membersRead++;
+			inflateMembers(gz.data() + e.offset, e.length, false, text);
+			filter(text.data(), text.length());
+		}
+	}
+	if (indexed < gz.size())
+	{
+		// No index, or members appended after its last entry.
+		membersRead++;
+		lastMatched = false;
+		inflateMembers(gz.data() + indexed, gz.size() - indexed, true, text);
+		filter(text.data(), text.length());
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "b:e:o:l:vt")) != -1)
+	{
+		switch (opt)
+		{
+		case 'b':
+		case 'e':
+			if (!parseArgTime(optarg, opt == 'e', (opt == 'b') ? timeFrom : timeTo))
+			{
+				fprintf(stderr, "Bad time '%s'\n", optarg);
+				return 2;
+			}
+			break;
+		case 'o':
+			owners.push_back(optarg);
+			ownerBits |= LogIndex::OwnerBit(optarg, strlen(optarg));
+			break;
+		case 'l':
+			levels = optarg;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 't':
+			return LogIndex::SelfCheck() ? 0 : 1;
+		default:
+			fprintf(stderr, "Usage: %s [-b from] [-e to] [-o owner]... "
+				"[-l levels] [-v] [log file] | -t\n", argv[0]);
+			return 2;
+		}
+	}
+	string log = (optind < argc) ? argv[optind] : LOGFILE_NAME;
+
+	// Right after a rotation there is no .1.gz yet, so look further.
+	int generations = 0;
+	for (int n = LOG_QUERY_MAX_GENERATIONS; n >= 1; n--)  // Oldest first
+	{
+		string gzPath = log + "." + to_string(n) + ".gz";
+		struct stat st;
+		if (stat(gzPath.c_str(), &st) == 0)
+		{
+			generations++;
+			queryGeneration(gzPath);
+		}
+	}
+	vector<char> text;
+	if (readFile(log, text))
+	{
+		lastMatched = false;
+		filter(text.data(), text.size());
+	}
+	if (verbose)
+	{
+		fprintf(stderr, "%d generation(s), %d member(s) inflated, %d skipped\n",
+			generations, membersRead, membersSkipped);
+	}
+	return 0;
+}
@@ -0,0 +1,104 @@
+// logtail.cpp
+// Follows the live log stream (see src/LogStream.h) instead of
+// polling LOGFILE_NAME. Reconnects after the writer process changes
+// or drops us, resuming from the last sequence number seen.
+//
+// Usage: logtail [-f <first seq>] [socket]
+//   -f 0       start with everything still in the writer's backlog
+//   (default)  new lines only
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../src/LogRing.h"
+#include "../src/LogStream.h"
+
+using namespace std;
+
+static int connectTo(const char *path)
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+	{
+		return -1;
+	}
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = LOG_STREAM_SOCKET;
+	bool haveFrom = false;
+	uint64_t next = 0;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+		{
+			haveFrom = true;
+			next = strtoull(argv[++i], nullptr, 10);
+		}
+		else
+		{
+			path = argv[i];
+		}
+	}
+
+	string partial;
+	for (;;)
+	{
+		int fd = connectTo(path);
+		if (fd < 0)
+		{
+			// No writer right now (between processes); try again.
+			sleep(1);
+			continue;
+		}
+		string request = haveFrom ? ("FROM " + to_string(next) + "\n") : "LIVE\n";
+		if (write(fd, request.data(), request.length()) != (ssize_t)request.length())
+		{
+			close(fd);
+			sleep(1);
+			continue;
+		}
+		char buf[4096];
+		ssize_t n;
+		while ((n = read(fd, buf, sizeof(buf))) > 0)
+		{
+			partial.append(buf, n);
+			size_t nl;
+			while ((nl = partial.find('\n')) != string::npos)
+			{
+				string line = partial.substr(0, nl + 1);
+				partial.erase(0, nl + 1);
+				uint64_t seq = LogStream::SequenceOf(line.data(), line.length());
+				if (seq != 0)
+				{
+					// After a reconnect, carry on right after it.
+					haveFrom = true;
+					next = seq + 1;
+				}
+				fwrite(line.data(), 1, line.length(), stdout);
+			}
+			fflush(stdout);
+		}
+		close(fd);
+		partial.clear();
+	}
+	return 0;
+}
@@ -0,0 +1,141 @@
+// pwmstat.cpp
+// Prints what pwm publishes in SharedMemory (see src/SharedMemory.h):
+// battery, PCA9685 duty cycles and I2C bus counters. Maps the segment
+// read only and never locks it: pwm is not slowed down however often
+// this runs.
+//
+// Usage: pwmstat [-w <ms>] [-m]
+//   -w    print again every <ms> until interrupted
+//   -m    print pwm's metrics instead (Prometheus text, from the
+//         METRICS_SOCKET; see src/Metrics.h)
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../src/Metrics.h"
+#include "../src/SharedMemory.h"
+
+using namespace std;
+
+static const char *age(uint64_t updatedMs, char *buf, size_t size)
+{
+	if (updatedMs == 0)
+	{
+		return "never";
+	}
+	snprintf(buf, size, "%.1f s ago", (SharedDataNowMs() - updatedMs) / 1000.0);
+	return buf;
+}
+
+static void print(const SharedData *shared)
+{
+	char when[32];
+	SharedBattery battery;
+	uint32_t version;
+	if (shared->battery.Read(battery, &version))
+	{
+		printf("battery: capacity %d%%, voltage status %d, charging status %d,"
+			" polled every %d ms; %llu checks, %s\n",
+			battery.capacityPercent, battery.voltageStatus, battery.chargingStatus,
+			battery.pollIntervalMs, (unsigned long long)battery.checks,
+			age(battery.updatedMs, when, sizeof(when)));
+	}
+	SharedPwm pwm;
+	if (shared->pwm.Read(pwm))
+	{
+		printf("pwm 0x%02x: %llu writes, %s\n", pwm.address,
+			(unsigned long long)pwm.writes, age(pwm.updatedMs, when, sizeof(when)));
+		for (int i = 0; i < SHARED_DATA_PWM_CHANNELS; i++)
+		{
+			if (pwm.on[i] != 0 || pwm.off[i] != 0)
+			{
+				printf("  %2d: on %4u off %4u\n", i, pwm.on[i], pwm.off[i]);
+			}
+		}
+	}
+	SharedBus bus;
+	if (shared->bus.Read(bus))
+	{
+		printf("i2c: %llu transfers, %llu failed, %llu bytes, %s\n",
+			(unsigned long long)bus.transfers, (unsigned long long)bus.failures,
+			(unsigned long long)bus.bytes, age(bus.updatedMs, when, sizeof(when)));
+	}
+}
+
+// pwm writes the page and hangs up.
+static bool printMetrics(void)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, METRICS_SOCKET, sizeof(addr.sun_path) - 1);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+	{
+		fprintf(stderr, "pwmstat: can't connect to %s: %s\n", METRICS_SOCKET,
+			strerror(errno));
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		return false;
+	}
+	char buf[4096];
+	ssize_t n;
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+	{
+		fwrite(buf, 1, n, stdout);
+	}
+	close(fd);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	int watchMs = 0;
+	bool metrics = false;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+		{
+			watchMs = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-m") == 0)
+		{
+			metrics = true;
+		}
+		else
+		{
+			fprintf(stderr, "Usage: pwmstat [-w <ms>] [-m]\n");
+			return 2;
+		}
+	}
+	if (metrics)
+	{
+		return printMetrics() ? 0 : 1;
+	}
+	SharedMemory sharedMemory;
+	if (!sharedMemory.Open(true))
+	{
+		fprintf(stderr, "pwmstat: no %s (pwm not running, or another version)\n",
+			SHARED_DATA_SHM_NAME);
+		return 1;
+	}
+	for (;;)
+	{
+		print(sharedMemory.m_pSharedData);
+		if (watchMs <= 0)
+		{
+			return 0;
+		}
+		printf("\n");
+		fflush(stdout);
+		usleep(watchMs * 1000);
+	}
+}
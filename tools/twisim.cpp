@@ -0,0 +1,792 @@
+// twisim.cpp
+// raw/twi.c (the Arduino's TWI interrupt state machine) on a Linux
+// host: compiled as it is against a model of the ATmega's TWI unit
+// (tools/avrshim), on a simulated bus with a PCA9685 at 0x40 and
+// another bus master that addresses the AVR as a slave (0x08).
+//
+// The unit is modelled at the level twi.c sees it: writing TWCR with
+// TWINT set starts the next bus operation (START, send TWDR, receive
+// into TWDR, STOP), which sets TWSR's status and TWINT and, with TWIE
+// on, calls ISR(TWI_vect). That happens synchronously, inside the
+// TWCR write; an operation started from the ISR runs once it has
+// returned, so the ISR is never re-entered, as on the chip. By the
+// time twi_writeTo() / twi_readFrom() get to their busy-wait the
+// transaction is over. A STOP finishes within its write and raises no
+// interrupt, like the real one. Bus timing (SCL, clock stretching) and
+// arbitration are not modelled.
+//
+// Each scenario runs one kind of transaction -n times, checks every
+// result against the PCA9685's registers or the slave callbacks, and
+// prints one JSON object per line (JSON Lines), like tools/logbench:
+//   {"scenario":"master-write-5", "iterations":100000,
+//    "transactions":..., "busBytes":..., "seconds":...,
+//    "transactionsPerSec":..., "interruptsPerByte":...,
+//    "controlWritesPerByte":..., "nsPerByte":..., "nsPerInterrupt":...,
+//    "failures":0}
+//
+//   transactions          STARTs, repeated ones included
+//   busBytes              address and data bytes on the bus
+//   interruptsPerByte     ISR(TWI_vect) runs per bus byte: the state
+//                         machine's cycles (one per byte, plus one per
+//                         START, bar the repeated STARTs twi.c sends
+//                         with TWIE off, and one per STOP as a slave)
+//   controlWritesPerByte  TWCR writes per bus byte
+//   nsPerByte, nsPerInterrupt  host time, harness and model included
+//
+// Exits 1 if any check failed, so it doubles as a regression test for
+// changes to twi.c.
+//
+// Usage: twisim [-n iterations] [-s scenario]
+//   -s runs only the scenarios whose name starts with the argument.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+// As is; its AVR headers come from tools/avrshim (-I).
+#include "../raw/twi.c"
+
+using namespace std;
+
+#define PCA9685_ADDRESS 0x40
+#define MISSING_ADDRESS 0x41
+#define SLAVE_ADDRESS 0x08
+
+TwiControlRegister TWCR;
+volatile uint8_t TWBR;
+volatile uint8_t TWSR;
+volatile uint8_t TWAR;
+volatile uint8_t TWDR;
+
+// A slave on the simulated bus.
+class SimDevice
+{
+public:
+	explicit SimDevice(uint8_t address)
+		: m_address(address), m_nackAfter(-1), m_received(0), m_sent(0),
+		m_lastAcked(false), m_starts(0), m_repeatedStarts(0), m_stops(0)
+	{
+	}
+	virtual ~SimDevice() {}
+	uint8_t Address(void) const { return m_address; }
+	// Addressed by a START ('repeated': no STOP since the last one).
+	// False: NACK.
+	bool Start(bool read, bool repeated)
+	{
+		m_starts++;
+		m_repeatedStarts += repeated ? 1 : 0;
+		m_received = 0;
+		m_sent = 0;
+		return _start(read);
+	}
+	// A byte from the master. False: NACK.
+	bool Receive(uint8_t data)
+	{
+		if (m_nackAfter >= 0 && m_received >= m_nackAfter)
+		{
+			return false;
+		}
+		m_received++;
+		_receive(data);
+		return true;
+	}
+	// The next byte for the master, who ACKs it if 'ack'.
+	uint8_t Send(bool ack)
+	{
+		m_sent++;
+		m_lastAcked = ack;
+		return _send();
+	}
+	void Stop(void) { m_stops++; }
+	// Fault injection: NACK data bytes after this many in a transfer;
+	// -1, never.
+	void SetNackAfter(int n) { m_nackAfter = n; }
+	// Of the last read: bytes sent, and whether the master ACKed the
+	// last one (it shouldn't).
+	int Sent(void) const { return m_sent; }
+	bool LastAcked(void) const { return m_lastAcked; }
+	uint64_t Starts(void) const { return m_starts; }
+	uint64_t RepeatedStarts(void) const { return m_repeatedStarts; }
+	uint64_t Stops(void) const { return m_stops; }
+protected:
+	virtual bool _start(bool read) = 0;
+	virtual void _receive(uint8_t data) = 0;
+	virtual uint8_t _send(void) = 0;
+private:
+	uint8_t m_address;
+	int m_nackAfter;
+	int m_received;
+	int m_sent;
+	bool m_lastAcked;
+	uint64_t m_starts;
+	uint64_t m_repeatedStarts;
+	uint64_t m_stops;
+};
+
+// The PCA9685's register file: first byte of a write is the register
+// pointer, then data; auto increment (MODE1 AI) as in the datasheet,
+// LED registers wrapping from 0x45 to 0. PRE_SCALE only takes a write
+// while asleep. No outputs, no oscillator.
+class Pca9685 : public SimDevice
+{
+public:
+	explicit Pca9685(uint8_t address)
+		: SimDevice(address)
+	{
+		Reset();
+	}
+	void Reset(void)
+	{
+		memset(m_registers, 0, sizeof(m_registers));
+		m_registers[0x00] = 0x11;  // MODE1: SLEEP, ALLCALL
+		m_registers[0x01] = 0x04;  // MODE2: OUTDRV
+		m_registers[0x02] = 0xE2;  // SUBADR1 .. 3
+		m_registers[0x03] = 0xE4;
+		m_registers[0x04] = 0xE8;
+		m_registers[0x05] = 0xE0;  // ALLCALLADR
+		for (int led = 0; led < 16; led++)
+		{
+			m_registers[0x09 + 4 * led] = 0x10;  // LEDn_OFF_H: full off
+		}
+		m_registers[0xFE] = 0x1E;  // PRE_SCALE: 200 Hz
+		m_pointer = 0;
+		m_pointerNext = false;
+	}
+	uint8_t Register(uint8_t reg) const { return m_registers[reg]; }
+protected:
+	bool _start(bool read)
+	{
+		// A write starts with the pointer; a read carries on from it.
+		m_pointerNext = !read;
+		return true;
+	}
+	void _receive(uint8_t data)
+	{
+		if (m_pointerNext)
+		{
+			m_pointer = data;
+			m_pointerNext = false;
+			return;
+		}
+		if (m_pointer == 0xFE && (m_registers[0x00] & 0x10) == 0)
+		{
+			// PRE_SCALE: ignored while awake.
+		}
+		else if (m_pointer == 0x00)
+		{
+			// RESTART (bit 7) reads back 0 once written.
+			m_registers[0x00] = data & 0x7F;
+		}
+		else
+		{
+			m_registers[m_pointer] = data;
+		}
+		_advance();
+	}
+	uint8_t _send(void)
+	{
+		uint8_t data = m_registers[m_pointer];
+		_advance();
+		return data;
+	}
+private:
+	void _advance(void)
+	{
+		if ((m_registers[0x00] & 0x20) == 0)
+		{
+			return;  // No auto increment
+		}
+		m_pointer = m_pointer == 0x45 ? 0 : (uint8_t)(m_pointer + 1);
+	}
+	uint8_t m_registers[256];
+	uint8_t m_pointer;
+	bool m_pointerNext;
+};
+
+enum TwiRole
+{
+	TwiRoleIdle = 0,
+	TwiRoleMasterAddress,  // START sent, SLA+R/W next
+	TwiRoleMasterTx,
+	TwiRoleMasterRx,
+	TwiRoleSlaveRx,
+	TwiRoleSlaveTx
+};
+
+struct TwiStats
+{
+	uint64_t interrupts;
+	uint64_t controlWrites;
+	uint64_t busBytes;
+	uint64_t starts;
+	uint64_t stops;
+};
+
+// The TWI unit and the bus behind it.
+class TwiUnit
+{
+public:
+	TwiUnit()
+		: m_control(0), m_role(TwiRoleIdle), m_ownsBus(false), m_repeated(false),
+		m_pending(false), m_inInterrupt(false), m_selected(nullptr)
+	{
+		memset(&m_stats, 0, sizeof(m_stats));
+	}
+	void Attach(SimDevice *device) { m_devices.push_back(device); }
+	void Write(uint8_t value);
+	uint8_t Read(void) const { return m_control; }
+	// Another master on the bus writes to / reads from 'address': what
+	// twi.c's slave side (twi_setAddress(), the callbacks) sees. Write
+	// returns the bytes ACKed, Read the bytes the AVR sent; -1: address
+	// NACK.
+	int MasterWrite(uint8_t address, const uint8_t *data, int length);
+	int MasterRead(uint8_t address, uint8_t *data, int length);
+	bool Idle(void) const { return m_role == TwiRoleIdle && !m_ownsBus && !m_pending; }
+	const TwiStats& Stats(void) const { return m_stats; }
+private:
+	void _run(void);
+	void _step(void);
+	void _stop(void);
+	void _status(uint8_t status);
+	void _signal(uint8_t status);
+	void _interrupt(void);
+	bool _addressed(uint8_t address) const;
+	SimDevice *_find(uint8_t address) const;
+	uint8_t m_control;  // TWCR, TWINT being the flag
+	TwiRole m_role;
+	bool m_ownsBus;
+	bool m_repeated;
+	// An operation started by the ISR; runs when it returns.
+	bool m_pending;
+	bool m_inInterrupt;
+	SimDevice *m_selected;
+	vector<SimDevice *> m_devices;
+	TwiStats m_stats;
+};
+
+static TwiUnit unit;
+
+void TwiControlWrite(uint8_t value)
+{
+	unit.Write(value);
+}
+
+uint8_t TwiControlRead(void)
+{
+	return unit.Read();
+}
+
+void TwiUnit::Write(uint8_t value)
+{
+	m_stats.controlWrites++;
+	// Writing TWINT clears the flag (and starts the unit), writing 0
+	// leaves it.
+	bool start = (value & _BV(TWINT)) != 0;
+	m_control = (value & ~_BV(TWINT)) | (start ? 0 : (m_control & _BV(TWINT)));
+	if ((m_control & _BV(TWEN)) == 0)
+	{
+		m_role = TwiRoleIdle;
+		m_ownsBus = false;
+		m_pending = false;
+		m_selected = nullptr;
+		return;
+	}
+	if (!start)
+	{
+		return;
+	}
+	if ((m_control & _BV(TWSTO)) != 0)
+	{
+		// A master's STOP goes out now; in slave mode TWSTO only resets
+		// the unit. Either way, no interrupt.
+		if (m_ownsBus)
+		{
+			_stop();
+		}
+		m_control &= ~_BV(TWSTO);
+		if ((m_control & _BV(TWSTA)) == 0)
+		{
+			return;
+		}
+	}
+	if ((m_control & _BV(TWSTA)) != 0 || (m_ownsBus && m_role != TwiRoleIdle))
+	{
+		m_pending = true;
+		if (!m_inInterrupt)
+		{
+			_run();
+		}
+	}
+	// Slave mode: the other master's next move (MasterWrite(),
+	// MasterRead()) reads the ACK setting just written.
+}
+
+void TwiUnit::_run(void)
+{
+	while (m_pending)
+	{
+		m_pending = false;
+		_step();
+		if ((m_control & _BV(TWINT)) != 0 && (m_control & _BV(TWIE)) != 0)
+		{
+			_interrupt();
+		}
+	}
+}
+
+void TwiUnit::_step(void)
+{
+	if ((m_control & _BV(TWSTA)) != 0)
+	{
+		m_repeated = m_ownsBus;
+		m_ownsBus = true;
+		m_role = TwiRoleMasterAddress;
+		m_stats.starts++;
+		_status(m_repeated ? TW_REP_START : TW_START);
+		return;
+	}
+	bool ack;
+	switch (m_role)
+	{
+	case TwiRoleMasterAddress:
+	{
+		uint8_t slarw = TWDR;
+		bool read = (slarw & TW_READ) != 0;
+		m_stats.busBytes++;
+		m_selected = _find(slarw >> 1);
+		ack = m_selected != nullptr && m_selected->Start(read, m_repeated);
+		if (!ack)
+		{
+			m_selected = nullptr;
+		}
+		m_role = read ? TwiRoleMasterRx : TwiRoleMasterTx;
+		if (read)
+		{
+			_status(ack ? TW_MR_SLA_ACK : TW_MR_SLA_NACK);
+		}
+		else
+		{
+			_status(ack ? TW_MT_SLA_ACK : TW_MT_SLA_NACK);
+		}
+		break;
+	}
+	case TwiRoleMasterTx:
+		m_stats.busBytes++;
+		ack = m_selected != nullptr && m_selected->Receive(TWDR);
+		_status(ack ? TW_MT_DATA_ACK : TW_MT_DATA_NACK);
+		break;
+	case TwiRoleMasterRx:
+		// TWEA is the ACK we send for the byte coming in.
+		m_stats.busBytes++;
+		ack = (m_control & _BV(TWEA)) != 0;
+		TWDR = m_selected != nullptr ? m_selected->Send(ack) : 0xFF;
+		_status(ack ? TW_MR_DATA_ACK : TW_MR_DATA_NACK);
+		break;
+	default:
+		break;
+	}
+}
+
+void TwiUnit::_stop(void)
+{
+	if (m_selected != nullptr)
+	{
+		m_selected->Stop();
+	}
+	m_selected = nullptr;
+	m_ownsBus = false;
+	m_role = TwiRoleIdle;
+	m_stats.stops++;
+}
+
+void TwiUnit::_status(uint8_t status)
+{
+	TWSR = status | (TWSR & ~TW_STATUS_MASK);
+	m_control |= _BV(TWINT);
+}
+
+// A slave event: status, then the ISR.
+void TwiUnit::_signal(uint8_t status)
+{
+	_status(status);
+	if ((m_control & _BV(TWIE)) != 0)
+	{
+		_interrupt();
+	}
+}
+
+void TwiUnit::_interrupt(void)
+{
+	m_stats.interrupts++;
+	m_inInterrupt = true;
+	TwiInterrupt();
+	m_inInterrupt = false;
+}
+
+bool TwiUnit::_addressed(uint8_t address) const
+{
+	return !m_ownsBus && (m_control & _BV(TWEN)) != 0 && (m_control & _BV(TWEA)) != 0
+		&& (TWAR >> 1) == address;
+}
+
+SimDevice *TwiUnit::_find(uint8_t address) const
+{
+	for (SimDevice *device : m_devices)
+	{
+		if (device->Address() == address)
+		{
+			return device;
+		}
+	}
+	return nullptr;
+}
+
+int TwiUnit::MasterWrite(uint8_t address, const uint8_t *data, int length)
+{
+	m_stats.starts++;
+	m_stats.busBytes++;
+	if (!_addressed(address))
+	{
+		m_stats.stops++;
+		return -1;
+	}
+	m_role = TwiRoleSlaveRx;
+	_signal(TW_SR_SLA_ACK);
+	int n = 0;
+	bool ack = true;
+	while (n < length && ack)
+	{
+		// As the ISR's last reply left TWEA.
+		ack = (m_control & _BV(TWEA)) != 0;
+		TWDR = data[n];
+		m_stats.busBytes++;
+		_signal(ack ? TW_SR_DATA_ACK : TW_SR_DATA_NACK);
+		n += ack ? 1 : 0;
+	}
+	m_stats.stops++;
+	if (ack)
+	{
+		// Not after a NACK: the unit has stopped listening by then.
+		_signal(TW_SR_STOP);
+	}
+	m_role = TwiRoleIdle;
+	return n;
+}
+
+int TwiUnit::MasterRead(uint8_t address, uint8_t *data, int length)
+{
+	m_stats.starts++;
+	m_stats.busBytes++;
+	if (length < 1 || !_addressed(address))
+	{
+		m_stats.stops++;
+		return -1;
+	}
+	m_role = TwiRoleSlaveTx;
+	_signal(TW_ST_SLA_ACK);
+	int n = 0;
+	for (;;)
+	{
+		// TWEA clear: the AVR is sending its last byte.
+		bool last = (m_control & _BV(TWEA)) == 0;
+		data[n++] = TWDR;
+		m_stats.busBytes++;
+		if (n == length)
+		{
+			_signal(TW_ST_DATA_NACK);
+			break;
+		}
+		if (last)
+		{
+			_signal(TW_ST_LAST_DATA);
+			break;
+		}
+		_signal(TW_ST_DATA_ACK);
+	}
+	m_stats.stops++;
+	m_role = TwiRoleIdle;
+	return n;
+}
+
+static Pca9685 pca(PCA9685_ADDRESS);
+
+static uint8_t slaveReceived[TWI_BUFFER_LENGTH];
+static int slaveReceivedLength = 0;
+static uint8_t slaveReply[TWI_BUFFER_LENGTH];
+static uint8_t slaveReplyLength = 0;
+
+static void onSlaveReceive(uint8_t *data, int length)
+{
+	memcpy(slaveReceived, data, length);
+	slaveReceivedLength = length;
+}
+
+static void onSlaveTransmit(void)
+{
+	twi_transmit(slaveReply, slaveReplyLength);
+}
+
+// Deterministic "random" bytes per iteration.
+static uint32_t pattern(int i, int n)
+{
+	return (uint32_t)(i * 2654435761u) ^ (uint32_t)(n * 40503u);
+}
+
+static bool setupPca(void)
+{
+	// What PwmServoDriver::begin() leaves: awake, auto increment.
+	uint8_t mode1[] = { 0x00, 0x20 };
+	return twi_writeTo(PCA9685_ADDRESS, mode1, sizeof(mode1), true, true) == 0;
+}
+
+// setPWM(): register, ON_L, ON_H, OFF_L, OFF_H.
+static bool masterWrite5(int i)
+{
+	uint8_t channel = i % 16;
+	uint16_t on = pattern(i, 0) & 0x0fff;
+	uint16_t off = pattern(i, 1) & 0x0fff;
+	uint8_t data[] = { (uint8_t)(0x06 + 4 * channel), (uint8_t)on, (uint8_t)(on >> 8),
+		(uint8_t)off, (uint8_t)(off >> 8) };
+	if (twi_writeTo(PCA9685_ADDRESS, data, sizeof(data), true, true) != 0)
+	{
+		return false;
+	}
+	for (int n = 1; n < 5; n++)
+	{
+		if (pca.Register(data[0] + n - 1) != data[n])
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// A full TWI buffer: register, then 31 bytes of LED registers.
+static bool masterWrite32(int i)
+{
+	uint8_t data[TWI_BUFFER_LENGTH];
+	data[0] = 0x06;
+	for (int n = 1; n < TWI_BUFFER_LENGTH; n++)
+	{
+		data[n] = pattern(i, n);
+	}
+	if (twi_writeTo(PCA9685_ADDRESS, data, sizeof(data), true, true) != 0)
+	{
+		return false;
+	}
+	for (int n = 1; n < TWI_BUFFER_LENGTH; n++)
+	{
+		if (pca.Register(0x06 + n - 1) != data[n])
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// Register number, repeated START, read 'length': read8() and friends.
+static bool masterRead(int i, uint8_t reg, uint8_t length)
+{
+	uint64_t stops = pca.Stops();
+	uint64_t repeated = pca.RepeatedStarts();
+	uint8_t data[TWI_BUFFER_LENGTH];
+	data[0] = reg;
+	if (twi_writeTo(PCA9685_ADDRESS, data, 1, true, false) != 0)
+	{
+		return false;
+	}
+	if (twi_readFrom(PCA9685_ADDRESS, data, length, true) != length)
+	{
+		return false;
+	}
+	if (pca.Stops() != stops + 1 || pca.RepeatedStarts() != repeated + 1)
+	{
+		return false;  // Not one transaction
+	}
+	if (pca.Sent() != length || pca.LastAcked())
+	{
+		return false;  // Read past the end, or didn't NACK it
+	}
+	for (int n = 0; n < length; n++)
+	{
+		if (data[n] != pca.Register(reg + n))
+		{
+			return false;
+		}
+	}
+	(void)i;
+	return true;
+}
+
+static bool masterRead1(int i)
+{
+	return masterRead(i, 0x00, 1);
+}
+
+static bool masterRead16(int i)
+{
+	return masterRead(i, 0x06 + 4 * (i % 12), 16);
+}
+
+static bool masterNackAddress(int i)
+{
+	uint8_t data[] = { 0x06, (uint8_t)i };
+	return twi_writeTo(MISSING_ADDRESS, data, sizeof(data), true, true) == 2
+		&& twi_readFrom(MISSING_ADDRESS, data, 1, true) == 0;
+}
+
+static bool masterNackData(int i)
+{
+	uint8_t data[] = { 0x06, (uint8_t)i, 0, 0, 0 };
+	pca.SetNackAfter(2);  // Pointer and one byte
+	bool ok = twi_writeTo(PCA9685_ADDRESS, data, sizeof(data), true, true) == 3;
+	pca.SetNackAfter(-1);
+	return ok;
+}
+
+static bool slaveReceive8(int i)
+{
+	uint8_t data[8];
+	for (int n = 0; n < 8; n++)
+	{
+		data[n] = pattern(i, n);
+	}
+	slaveReceivedLength = -1;
+	return unit.MasterWrite(SLAVE_ADDRESS, data, sizeof(data)) == 8
+		&& slaveReceivedLength == 8 && memcmp(slaveReceived, data, 8) == 0;
+}
+
+static bool slaveTransmit4(int i)
+{
+	for (int n = 0; n < 4; n++)
+	{
+		slaveReply[n] = pattern(i, n);
+	}
+	slaveReplyLength = 4;
+	uint8_t data[4];
+	return unit.MasterRead(SLAVE_ADDRESS, data, sizeof(data)) == 4
+		&& memcmp(data, slaveReply, 4) == 0;
+}
+
+// The AVR as master and slave in turn: each transfer has to leave
+// twi_state READY for the next.
+static bool mixed(int i)
+{
+	return masterWrite5(i) && slaveReceive8(i) && masterRead1(i) && slaveTransmit4(i);
+}
+
+struct Scenario
+{
+	const char *name;
+	bool (*run)(int i);
+};
+
+static const Scenario scenarios[] =
+{
+	{ "master-write-5", masterWrite5 },
+	{ "master-write-32", masterWrite32 },
+	{ "master-read-1-repstart", masterRead1 },
+	{ "master-read-16-repstart", masterRead16 },
+	{ "master-nack-address", masterNackAddress },
+	{ "master-nack-data", masterNackData },
+	{ "slave-receive-8", slaveReceive8 },
+	{ "slave-transmit-4", slaveTransmit4 },
+	{ "mixed", mixed },
+};
+
+static double now(void)
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool runScenario(const Scenario& s, int iterations)
+{
+	TwiStats before = unit.Stats();
+	int failures = 0;
+	double start = now();
+	for (int i = 0; i < iterations; i++)
+	{
+		if (!s.run(i))
+		{
+			failures++;
+		}
+	}
+	double seconds = now() - start;
+	if (!unit.Idle() || twi_state != TWI_READY)
+	{
+		failures++;
+	}
+	TwiStats after = unit.Stats();
+	uint64_t transactions = after.starts - before.starts;
+	uint64_t bytes = after.busBytes - before.busBytes;
+	uint64_t interrupts = after.interrupts - before.interrupts;
+	uint64_t writes = after.controlWrites - before.controlWrites;
+	double perByte = bytes > 0 ? 1.0 / bytes : 0;
+	printf("{\"scenario\":\"%s\",\"iterations\":%d,\"transactions\":%llu,"
+		"\"busBytes\":%llu,\"seconds\":%.6f,\"transactionsPerSec\":%.0f,"
+		"\"interruptsPerByte\":%.3f,\"controlWritesPerByte\":%.3f,"
+		"\"nsPerByte\":%.1f,\"nsPerInterrupt\":%.1f,\"failures\":%d}\n",
+		s.name, iterations, (unsigned long long)transactions,
+		(unsigned long long)bytes, seconds,
+		seconds > 0 ? transactions / seconds : 0,
+		interrupts * perByte, writes * perByte,
+		seconds * 1e9 * perByte,
+		interrupts > 0 ? seconds * 1e9 / interrupts : 0, failures);
+	return failures == 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int iterations = 100000;
+	const char *only = nullptr;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:s:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			iterations = max(1, atoi(optarg));
+			break;
+		case 's':
+			only = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n iterations] [-s scenario]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	unit.Attach(&pca);
+	twi_init();
+	twi_setAddress(SLAVE_ADDRESS);
+	twi_attachSlaveRxEvent(onSlaveReceive);
+	twi_attachSlaveTxEvent(onSlaveTransmit);
+	if (!setupPca())
+	{
+		fprintf(stderr, "PCA9685 setup failed\n");
+		return 1;
+	}
+
+	bool ok = true;
+	for (const Scenario& s : scenarios)
+	{
+		if (only != nullptr && strncmp(s.name, only, strlen(only)) != 0)
+		{
+			continue;
+		}
+		if (!runScenario(s, iterations))
+		{
+			fprintf(stderr, "%s failed\n", s.name);
+			ok = false;
+		}
+	}
+	return ok ? 0 : 1;
+}